@@ -1,7 +1,9 @@
-apps_PROGRAMS := mm
+apps_PROGRAMS := mm trace2json
 apps_LDADD    := libooc.a
 apps_CFLAGS   := -fopenmp
 apps_LDFLAGS  := -fopenmp
 
 mm_SOURCES := mm.c
-mm_LDLIBS  := -lrt
+mm_LDLIBS  := -lrt -lpthread
+
+trace2json_SOURCES := trace2json.c
@@ -66,6 +66,11 @@ __ooc_defn ( static void mm )(size_t const i, void * const state)
 #define b(R,C) b[R*p+C]
 #define c(R,C) c[R*p+C]
 
+  /* Row i of a and all of b are read, row i of c is written. */
+  ooc_reads(&a(i,0), n);
+  ooc_reads(b, n*p);
+  ooc_writes(&c(i,0), p);
+
   for (j=0; j<n; ++j) {
     c(i,j) = a(i,0)*b(0,j);
     for (k=1; k<p; ++k) {
@@ -82,7 +87,8 @@ __ooc_defn ( static void mm )(size_t const i, void * const state)
 int
 main(void)
 {
-  size_t m, n, p, i;
+  int ret;
+  size_t m, n, p;
   struct args args;
   double * a, * b, * c;
 
@@ -103,11 +109,8 @@ main(void)
   args.b = b;
   args.c = c;
 
-  #pragma omp parallel for num_threads(4)
-  for (i=0; i<m; ++i) {
-    mm(i, &args);
-  }
-  OOC_FINAL /* Only need this if we want to remove the signal handler. */
+  ret = ooc_parallel_for(mm, 0, m, 1, &args);
+  assert(!ret);
 
   ooc_free(a);
   ooc_free(b);
@@ -0,0 +1,138 @@
+/*
+Copyright (c) 2016 Jeremy Iverson
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+
+/* fopen, fread, fclose, printf, fprintf */
+#include <stdio.h>
+
+/* EXIT_SUCCESS, EXIT_FAILURE */
+#include <stdlib.h>
+
+/* memcmp */
+#include <string.h>
+
+/* OOC library */
+#include "src/ooc.h"
+
+
+/*! Convert a trace file, written by ooc_trace_dump(), to the Chrome trace event
+ *  JSON format, which can be loaded by chrome://tracing or Perfetto. Faults and
+ *  I/O requests become duration events, while fiber switches and evictions
+ *  become instant events. */
+static int
+S_convert(FILE * const fp)
+{
+  int first=1;
+  unsigned int i;
+  char const * name, * ph, * key;
+  struct ooc_trace_head th;
+  struct ooc_trace_thread tt;
+  struct ooc_trace_event ev;
+
+  if (1 != fread(&th, sizeof(th), 1, fp) ||\
+      memcmp(th.magic, OOC_TRACE_MAGIC, sizeof(th.magic)) ||\
+      OOC_TRACE_VERSION != th.version || sizeof(ev) != th.size)
+  {
+    fprintf(stderr, "trace2json: not a version %d trace file\n",\
+      OOC_TRACE_VERSION);
+    return -1;
+  }
+
+  printf("{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+
+  while (1 == fread(&tt, sizeof(tt), 1, fp)) {
+    for (i=0; i<tt.nr; ++i) {
+      if (1 != fread(&ev, sizeof(ev), 1, fp)) {
+        fprintf(stderr, "trace2json: truncated trace file\n");
+        return -1;
+      }
+
+      switch (ev.type) {
+      case OOC_TRACE_FAULT_BEG:
+        name = "fault", ph = "B", key = "addr";
+        break;
+      case OOC_TRACE_FAULT_END:
+        name = "fault", ph = "E", key = "addr";
+        break;
+      case OOC_TRACE_IO_BEG:
+        name = "io", ph = "B", key = "bytes";
+        break;
+      case OOC_TRACE_IO_END:
+        name = "io", ph = "E", key = "bytes";
+        break;
+      case OOC_TRACE_SWITCH:
+        name = "switch", ph = "i", key = "to";
+        break;
+      case OOC_TRACE_EVICT:
+        name = "evict", ph = "i", key = "pages";
+        break;
+      default:
+        continue;
+      }
+
+      /* Chrome trace time stamps are in microseconds. */
+      printf("%s\n{\"name\":\"%s\",\"ph\":\"%s\",\"pid\":0,\"tid\":%u,"\
+        "\"ts\":%llu.%03llu,", first ? "" : ",", name, ph, tt.tid,\
+        ev.ts/1000ULL, ev.ts%1000ULL);
+      if ('i' == ph[0]) {
+        printf("\"s\":\"t\",");
+      }
+      if (OOC_TRACE_SWITCH == ev.type && OOC_TRACE_MAIN == ev.arg) {
+        printf("\"args\":{\"fiber\":%d,\"%s\":\"main\"}}",\
+          OOC_TRACE_MAIN == ev.fiber ? -1 : (int)ev.fiber, key);
+      }
+      else {
+        printf("\"args\":{\"fiber\":%d,\"%s\":%llu}}",\
+          OOC_TRACE_MAIN == ev.fiber ? -1 : (int)ev.fiber, key, ev.arg);
+      }
+      first = 0;
+    }
+  }
+
+  printf("\n]}\n");
+
+  return 0;
+}
+
+
+int
+main(int argc, char * argv[])
+{
+  int ret;
+  FILE * fp;
+
+  if (2 != argc) {
+    fprintf(stderr, "usage: %s <trace file>\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  if (NULL == (fp=fopen(argv[1], "rb"))) {
+    fprintf(stderr, "trace2json: cannot open %s\n", argv[1]);
+    return EXIT_FAILURE;
+  }
+
+  ret = S_convert(fp);
+
+  (void)fclose(fp);
+
+  return ret ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,661 @@
+/*
+Copyright (c) 2016 Jeremy Iverson
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+
+#ifndef _GNU_SOURCE
+  #define _GNU_SOURCE /* Expose sysconf _SC_PHYS_PAGES */
+#endif
+
+/* assert */
+#include <assert.h>
+
+/* errno, ESRCH */
+#include <errno.h>
+
+/* open, O_* */
+#include <fcntl.h>
+
+/* kill */
+#include <signal.h>
+
+/* NULL, getenv */
+#include <stdlib.h>
+
+/* sched_yield */
+#include <sched.h>
+
+/* mmap, MAP_*, PROT_* */
+#include <sys/mman.h>
+
+/* S_IRUSR, S_IWUSR */
+#include <sys/stat.h>
+
+/* close, ftruncate, getpid, sysconf, _SC_PHYS_PAGES */
+#include <unistd.h>
+
+/* function prototypes */
+#include "include/ooc.h"
+
+/* */
+#include "common.h"
+
+
+/*
+ *  The broker is a file which the processes of a node map, so that no process
+ *  serves the others. Each process which has joined owns a slot, in which it
+ *  publishes its demand, the pages it has allocated, capped by the budget set
+ *  with ooc_set_budget(), and an estimate of its working set. The estimate is
+ *  driven by the page-fault frequency of the process: it grows while the
+ *  process makes many pages resident per interval, relative to its budget, and
+ *  shrinks while it makes few.
+ *
+ *  Whichever process ticks first once OOC_BROKER_INTERVAL has passed since the
+ *  last rebalance recomputes the budgets of all. The limit of the node is
+ *  water-filled, max-min fairly, first up to the working-set estimate of every
+ *  process, then up to its demand, and what is left is spread evenly. Each
+ *  process applies its own budget when it next ticks, from its fault path or
+ *  its flushers, so that its eviction path honors it. Slots of processes which
+ *  have exited without leaving are reclaimed at the next rebalance.
+ */
+
+
+/*! Slot of a process. */
+struct S_proc
+{
+  int pid;                    /* owner, 0 if the slot is free */
+  size_t demand;              /* pages allocated, capped by its own budget */
+  size_t want;                /* working-set estimate, in pages */
+  size_t budget;              /* pages assigned by the broker */
+};
+
+/*! The shared state of the broker. A zero-filled file is a valid, empty
+ *  broker. */
+struct S_node
+{
+  int lock;                   /* pid of the rebalancing process, or 0 */
+  size_t limit;               /* pages which the processes share */
+  unsigned long long stamp;   /* time of the last rebalance */
+  struct S_proc proc[OOC_BROKER_MAX_PROCS];
+};
+
+
+/*! The broker, once mapped, which it stays for the life of the process. */
+static struct S_node * S_node=NULL;
+
+/*! The slot of this process, NULL if it has not joined. */
+static struct S_proc * S_me=NULL;
+
+/*! Pages allocated by this process. */
+static size_t S_alloc=0;
+
+/*! Time of the last tick of this process. */
+static unsigned long long S_last=0;
+
+/*! Value of flush_usage()'s charged at the last tick. */
+static size_t S_charged=0;
+
+
+/*! Whether the process pid has exited. */
+static int
+S_dead(int const pid)
+{
+  return (-1 == kill(pid, 0) && ESRCH == errno);
+}
+
+
+/*! Try to take the broker lock for process pid, taking it over from a process
+ *  which died holding it. Returns non-zero if the lock was taken. */
+static int
+S_trylock(struct S_node * const node, int const pid)
+{
+  int owner;
+
+  owner = *(int volatile*)&(node->lock);
+
+  return (!owner && __sync_bool_compare_and_swap(&(node->lock), 0, pid)) ||\
+    (owner && S_dead(owner) &&\
+     __sync_bool_compare_and_swap(&(node->lock), owner, pid));
+}
+
+
+static void
+S_unlock(struct S_node * const node)
+{
+  __sync_synchronize();
+  node->lock = 0;
+}
+
+
+/*! Give each process up to share pages at a time, but no more than cap[i] in
+ *  total, until left is used up or every process has its cap. Returns the pages
+ *  which are left. */
+static size_t
+S_fill(size_t * const b, size_t const * const cap, int const * const live,
+       size_t left)
+{
+  int i, n;
+  size_t share, give;
+
+  for (n=0,i=0; i<OOC_BROKER_MAX_PROCS; ++i) {
+    n += (live[i] && b[i] < cap[i]) ? 1 : 0;
+  }
+
+  while (n && (share=left/(size_t)n)) {
+    for (n=0,i=0; i<OOC_BROKER_MAX_PROCS; ++i) {
+      if (!live[i] || b[i] >= cap[i]) {
+        continue;
+      }
+      give = cap[i]-b[i] < share ? cap[i]-b[i] : share;
+      b[i] += give;
+      left -= give;
+      n += (b[i] < cap[i]) ? 1 : 0;
+    }
+  }
+
+  return left;
+}
+
+
+/*! Reclaim the slots of dead processes and recompute the budgets of the
+ *  others. Called with the broker lock held. */
+static void
+S_rebalance(struct S_node * const node)
+{
+  int i, n;
+  int live[OOC_BROKER_MAX_PROCS];
+  size_t left, floor;
+  size_t b[OOC_BROKER_MAX_PROCS], want[OOC_BROKER_MAX_PROCS];
+  size_t demand[OOC_BROKER_MAX_PROCS], all[OOC_BROKER_MAX_PROCS];
+
+  for (n=0,i=0; i<OOC_BROKER_MAX_PROCS; ++i) {
+    live[i] = node->proc[i].pid;
+    if (live[i] && S_dead(live[i])) {
+      (void)__sync_bool_compare_and_swap(&(node->proc[i].pid), live[i], 0);
+      live[i] = 0;
+    }
+    n += live[i] ? 1 : 0;
+
+    demand[i] = node->proc[i].demand;
+    want[i]   = node->proc[i].want;
+    want[i]   = want[i] < demand[i] ? want[i] : demand[i];
+    all[i]    = (size_t)-1;
+  }
+  if (!n) {
+    return;
+  }
+
+  /* Every process is given a floor, so that none is starved. */
+  left  = node->limit;
+  floor = left/(size_t)n < OOC_BROKER_MIN ? left/(size_t)n : OOC_BROKER_MIN;
+  for (i=0; i<OOC_BROKER_MAX_PROCS; ++i) {
+    b[i] = live[i] ? floor : 0;
+    left -= b[i];
+  }
+
+  left = S_fill(b, want, live, left);
+  left = S_fill(b, demand, live, left);
+  (void)S_fill(b, all, live, left);
+
+  for (i=0; i<OOC_BROKER_MAX_PROCS; ++i) {
+    if (live[i]) {
+      node->proc[i].budget = b[i];
+    }
+  }
+}
+
+
+void
+broker_alloc(size_t const nr)
+{
+  (void)__sync_fetch_and_add(&S_alloc, nr);
+}
+
+
+void
+broker_free(size_t const nr)
+{
+  (void)__sync_fetch_and_sub(&S_alloc, nr);
+}
+
+
+void
+broker_tick(void)
+{
+  size_t cap, resident, charged, demand, want, base, nr;
+  unsigned long long now, last;
+  struct S_node * node;
+  struct S_proc * me;
+
+  if (NULL == (me=S_me)) {
+    return;
+  }
+
+  /* One thread per interval does the work. */
+  now  = stats_clock();
+  last = S_last;
+  if (now-last < OOC_BROKER_INTERVAL*1000000ULL ||\
+      !__sync_bool_compare_and_swap(&S_last, last, now))
+  {
+    return;
+  }
+
+  /* Update the demand and working-set estimate of this process. */
+  flush_usage(&cap, &resident, &charged);
+  nr = charged-S_charged;
+  S_charged = charged;
+
+  demand = S_alloc;
+  demand = (cap && cap < demand) ? cap : demand;
+  want   = me->want < demand ? me->want : demand;
+  base   = me->budget ? me->budget : want;
+  if (100*nr > OOC_BROKER_PFF_HI*base) {
+    want += want/4+1;
+  }
+  else if (100*nr < OOC_BROKER_PFF_LO*base) {
+    want -= want/8;
+  }
+  want = want < demand ? want : demand;
+  want = want < OOC_BROKER_MIN ? OOC_BROKER_MIN : want;
+  me->demand = demand;
+  me->want   = want;
+
+  /* Rebalance, unless another process has lately or is. */
+  node = S_node;
+  if (now-node->stamp >= OOC_BROKER_INTERVAL*1000000ULL &&\
+      S_trylock(node, (int)getpid()))
+  {
+    if (now-node->stamp >= OOC_BROKER_INTERVAL*1000000ULL) {
+      S_rebalance(node);
+      node->stamp = now;
+    }
+    S_unlock(node);
+  }
+
+  /* Honor the budget assigned to this process, but not beyond the one set with
+   * ooc_set_budget(), which the leftover of the limit may exceed. */
+  if (me->budget) {
+    flush_budget((cap && cap < me->budget) ? cap : me->budget);
+  }
+}
+
+
+int
+ooc_broker_join(size_t const limit)
+{
+  int ret, fd, i, pid;
+  long nphys;
+  size_t nr;
+  char const * path;
+  struct S_node * node;
+
+  if (S_me) {
+    return 0;
+  }
+
+  /* Map the broker, which a zero-filled file initializes. */
+  if (!S_node) {
+    if (NULL == (path=getenv("OOC_BROKER"))) {
+      path = OOC_BROKER_PATH;
+    }
+    if (-1 == (fd=open(path, O_RDWR|O_CREAT|O_CLOEXEC, S_IRUSR|S_IWUSR))) {
+      return -1;
+    }
+    ret = ftruncate(fd, (off_t)sizeof(struct S_node));
+    if (ret) {
+      ret = close(fd);
+      assert(!ret);
+      return -1;
+    }
+    node = mmap(NULL, sizeof(struct S_node), PROT_READ|PROT_WRITE, MAP_SHARED,
+                fd, 0);
+    ret = close(fd);
+    assert(!ret);
+    if (MAP_FAILED == node) {
+      return -1;
+    }
+    if (!__sync_bool_compare_and_swap(&S_node, NULL, node)) {
+      ret = munmap(node, sizeof(struct S_node));
+      assert(!ret);
+    }
+  }
+  node = S_node;
+
+  /* The limit, if none is given. */
+  nr = limit/(size_t)OOC_PAGE_SIZE;
+  if (!nr) {
+    nphys = sysconf(_SC_PHYS_PAGES);
+    assert(-1 != nphys);
+    nr = (size_t)nphys/100*OOC_BROKER_SHARE*(size_t)sysconf(_SC_PAGESIZE)/\
+      (size_t)OOC_PAGE_SIZE;
+  }
+
+  pid = (int)getpid();
+  while (!S_trylock(node, pid)) {
+    (void)sched_yield();
+  }
+
+  /* The first limit given sticks while any process which has joined is alive.
+   * The broker outlives them, but their limit does not. */
+  for (i=0; i<OOC_BROKER_MAX_PROCS; ++i) {
+    ret = node->proc[i].pid;
+    if (ret && !S_dead(ret)) {
+      break;
+    }
+  }
+  if (OOC_BROKER_MAX_PROCS == i || !node->limit) {
+    node->limit = nr;
+  }
+
+  /* Claim a slot, reclaiming those of dead processes. */
+  for (i=0; i<OOC_BROKER_MAX_PROCS; ++i) {
+    ret = node->proc[i].pid;
+    if (ret && S_dead(ret)) {
+      (void)__sync_bool_compare_and_swap(&(node->proc[i].pid), ret, 0);
+    }
+    if (__sync_bool_compare_and_swap(&(node->proc[i].pid), 0, pid)) {
+      break;
+    }
+  }
+
+  S_unlock(node);
+
+  if (OOC_BROKER_MAX_PROCS == i) {
+    return -1;
+  }
+
+  /* Until shown otherwise, the whole demand is the working set. */
+  node->proc[i].demand = 0;
+  node->proc[i].want   = (size_t)-1;
+  node->proc[i].budget = 0;
+  S_last = 0;
+  flush_usage(&nr, &nr, &S_charged);
+
+  __sync_synchronize();
+  S_me = &(node->proc[i]);
+  broker_tick();
+
+  return 0;
+}
+
+
+int
+ooc_broker_leave(void)
+{
+  size_t cap, resident, charged;
+  struct S_proc * me;
+
+  if (NULL == (me=S_me)) {
+    return -1;
+  }
+
+  S_me = NULL;
+  __sync_synchronize();
+  me->pid = 0;
+
+  /* Return to the budget set with ooc_set_budget(). */
+  flush_usage(&cap, &resident, &charged);
+  flush_budget(cap);
+
+  return 0;
+}
+
+
+#ifdef TEST
+/* assert */
+#include <assert.h>
+
+/* snprintf */
+#include <stdio.h>
+
+/* poll, struct pollfd, POLLIN */
+#include <poll.h>
+
+/* EXIT_SUCCESS, setenv */
+#include <stdlib.h>
+
+/* waitpid, WIFEXITED, WEXITSTATUS */
+#include <sys/wait.h>
+
+/* nanosleep, struct timespec */
+#include <time.h>
+
+/* fork, pipe, read, unlink, write */
+#include <unistd.h>
+
+#define N_PAGES 256
+#define N_LIMIT 64
+
+static void
+S_touch(size_t const i, void * const args)
+{
+  size_t ps, ip;
+  char * mem;
+
+  ps = (size_t)OOC_PAGE_SIZE;
+  mem = (char*)args;
+
+  for (ip=0; ip<N_PAGES; ++ip) {
+    mem[ip*ps] = (char)(ip+i);
+  }
+}
+
+/* Sum of the budgets of all processes. */
+static size_t
+S_total(void)
+{
+  int i;
+  size_t total;
+
+  for (total=0,i=0; i<OOC_BROKER_MAX_PROCS; ++i) {
+    total += S_node->proc[i].pid ? S_node->proc[i].budget : 0;
+  }
+
+  return total;
+}
+
+/* Keep touching mem, so that the process ticks, until its budget is
+ * budget. */
+static void
+S_wait(char * const mem, size_t const budget)
+{
+  int i;
+  struct timespec ts;
+
+  ts.tv_sec  = 0;
+  ts.tv_nsec = 10000000;
+
+  for (i=0; i<1000 && budget != S_me->budget; ++i) {
+    ooc_sched(&S_touch, 1, mem);
+    (void)nanosleep(&ts, NULL);
+  }
+  assert(budget == S_me->budget);
+}
+
+/* Another process, which joins once told to and publishes the demand of its
+ * allocation. It keeps touching the allocation until told to stop, then idles
+ * until told to exit, which it does without leaving. */
+static int
+S_child(int const rfd, int const wfd)
+{
+  int ret;
+  char c, * mem;
+  struct pollfd pfd;
+
+  ret = (int)read(rfd, &c, 1);
+  assert(1 == ret);
+
+  /* While idle, the flusher ticks for the process. */
+  ret = ooc_flush_start(1);
+  assert(!ret);
+  /* The limit of the process which joined first stands. */
+  ret = ooc_broker_join(0);
+  assert(!ret);
+  assert(N_LIMIT == S_node->limit);
+  mem = ooc_malloc(N_PAGES*(size_t)OOC_PAGE_SIZE);
+  assert(mem);
+
+  pfd.fd     = rfd;
+  pfd.events = POLLIN;
+  for (c=0;;) {
+    ooc_sched(&S_touch, 1, mem);
+    if (!c && N_PAGES == S_me->demand) {
+      ret = (int)write(wfd, "", 1);
+      assert(1 == ret);
+      c = 1;
+    }
+    if (c && 1 == poll(&pfd, 1, 0)) {
+      break;
+    }
+  }
+
+  ret = (int)read(rfd, &c, 1);
+  assert(1 == ret);
+  ret = (int)read(rfd, &c, 1);
+  assert(0 == ret);
+
+  return EXIT_SUCCESS;
+}
+
+int
+main(void)
+{
+  int ret, status, i, down[2], up[2];
+  size_t ps, cap, resident, charged;
+  pid_t pid;
+  char path[256], c, * mem;
+  struct timespec ts;
+
+  ps = (size_t)OOC_PAGE_SIZE;
+  ts.tv_sec  = 0;
+  ts.tv_nsec = 10000000;
+
+  ret = snprintf(path, sizeof(path), "%s/ooc-broker-test-%d", OOC_SWAP_DIR,
+                 (int)getpid());
+  assert(ret > 0 && (size_t)ret < sizeof(path));
+  ret = setenv("OOC_BROKER", path, 1);
+  assert(!ret);
+
+  /* Fork before the library is used, as independently started processes
+   * would be. */
+  ret = pipe(down);
+  assert(!ret);
+  ret = pipe(up);
+  assert(!ret);
+  pid = fork();
+  assert(-1 != pid);
+  if (!pid) {
+    ret = close(down[1]);
+    assert(!ret);
+    exit(S_child(down[0], up[1]));
+  }
+  ret = close(down[0]);
+  assert(!ret);
+  ret = close(up[1]);
+  assert(!ret);
+
+  /* Not having joined, there is nothing to leave. */
+  assert(-1 == ooc_broker_leave());
+
+  ret = ooc_set_budget(N_PAGES*ps);
+  assert(!ret);
+  ret = ooc_broker_join(N_LIMIT*ps);
+  assert(!ret);
+  assert(N_LIMIT == S_node->limit);
+  mem = ooc_malloc(N_PAGES*ps);
+  assert(mem);
+
+  /* Alone, the process is assigned the whole limit. */
+  S_wait(mem, N_LIMIT);
+
+  /* A process with as much demand joins, and the limit is split between the
+   * two, whose budgets the eviction path honors. */
+  ret = (int)write(down[1], "", 1);
+  assert(1 == ret);
+  ret = (int)read(up[0], &c, 1);
+  assert(1 == ret);
+
+  S_wait(mem, N_LIMIT/2);
+  assert(N_LIMIT == S_total());
+  ooc_sched(&S_touch, 1, mem);
+  flush_usage(&cap, &resident, &charged);
+  assert(N_PAGES == cap);
+  assert(resident <= N_LIMIT/2+1);
+
+  /* Once the child idles, its working-set estimate shrinks, and its share
+   * goes to this process, but for the floor. */
+  ret = (int)write(down[1], "", 1);
+  assert(1 == ret);
+
+  S_wait(mem, N_LIMIT-OOC_BROKER_MIN);
+  assert(N_LIMIT == S_total());
+
+  /* The child exits without leaving, and its share is returned. */
+  ret = close(down[1]);
+  assert(!ret);
+  ret = (int)waitpid(pid, &status, 0);
+  assert(pid == ret);
+  assert(WIFEXITED(status) && EXIT_SUCCESS == WEXITSTATUS(status));
+
+  S_wait(mem, N_LIMIT);
+  assert(N_LIMIT == S_total());
+
+  /* Leaving restores the budget set with ooc_set_budget(). */
+  ret = ooc_broker_leave();
+  assert(!ret);
+  assert(0 == S_total());
+  ooc_sched(&S_touch, 2, mem);
+  flush_usage(&cap, &resident, &charged);
+  assert(resident > N_LIMIT+1);
+
+  /* Once every process which joined has exited or left, the next process to
+   * join sets a new limit. */
+  ret = ooc_broker_join(2*N_LIMIT*ps);
+  assert(!ret);
+  assert(2*N_LIMIT == S_node->limit);
+  S_wait(mem, 2*N_LIMIT);
+
+  /* A budget set with ooc_set_budget() below the share of the process is
+   * honored, though the process is assigned the leftover of the limit. */
+  ret = ooc_set_budget(N_LIMIT/4*ps);
+  assert(!ret);
+  for (i=0; i<50; ++i) {
+    ooc_sched(&S_touch, 3, mem);
+    (void)nanosleep(&ts, NULL);
+  }
+  assert(2*N_LIMIT == S_me->budget);
+  flush_usage(&cap, &resident, &charged);
+  assert(N_LIMIT/4 == cap);
+  assert(resident <= N_LIMIT/4+1);
+
+  ret = ooc_broker_leave();
+  assert(!ret);
+
+  ooc_free(mem);
+  ret = unlink(path);
+  assert(!ret);
+
+  ret = ooc_finalize();
+  assert(!ret);
+
+  return EXIT_SUCCESS;
+}
+#endif
@@ -1,6 +1,8 @@
 src_LIBRARIES := libooc.a
 # If native aio were used instead of posix aio, then link against -laio
-src_LDLIBS    := -lrt
+src_LDLIBS    := -lrt -lpthread
 src_CFLAGS    := -fopenmp
 
-libooc.a_SOURCES := malloc.c sched.c sp_tree.c vma_alloc.c
+libooc.a_SOURCES := broker.c flush.c inflight.c lock.c malloc.c page.c \
+                    parallel.c prot.c sched.c shm.c sp_tree.c stats.c swap.c \
+                    sync.c task.c trace.c vma_alloc.c
@@ -25,6 +25,9 @@ THE SOFTWARE.
 #define OOC_COMMON_H
 
 
+/* struct iovec */
+#include <sys/uio.h>
+
 /* sysconf, _SC_PAGESIZE */
 #include <unistd.h>
 
@@ -35,44 +38,262 @@ THE SOFTWARE.
 /*! OOC page size. */
 #define OOC_PAGE_SIZE sysconf(_SC_PAGESIZE)
 
-/*! Maximum number of fibers per thread. */
+/*! Default number of fibers per thread, which $OOC_NUM_FIBERS overrides up to
+ *  OOC_MAX_FIBERS. */
 #define OOC_NUM_FIBERS 10
+#define OOC_MAX_FIBERS 4096
+
+/*! Size of the address range reserved for the stack of a fiber, including a
+ *  guard page. Only the pages of a stack which are touched are committed. */
+#define OOC_FIBER_STACK_SIZE (256*1024)
+
+/*! Maximum number of stacks which a thread keeps for reuse by its fibers. */
+#define OOC_FIBER_POOL 64
+
+/*! Size of a cache line, to which locks are padded. */
+#define OOC_CACHE_LINE 64
+
+/*! Maximum number of iterations that a lock waiter spins before sleeping. */
+#define OOC_LOCK_SPIN 100
+
+/*! Directory in which the backing store is created. */
+#define OOC_SWAP_DIR "/tmp"
+
+/*! Alignment of buffers, offsets and lengths for direct backing-store I/O. */
+#define OOC_SWAP_ALIGN OOC_PAGE_SIZE
+
+/*! Number and size of the aligned bounce buffers used for direct backing-store
+ *  I/O to or from unaligned memory. */
+#define OOC_SWAP_BOUNCE_NR   8
+#define OOC_SWAP_BOUNCE_SIZE (256*1024)
+
+/*! Resident page count, as a percentage of the memory budget, at which the
+ *  background flusher starts writing back cold dirty pages. */
+#define OOC_FLUSH_LOWAT 80
+
+/*! Resident page count, as a percentage of the memory budget, at which the
+ *  background flusher starts evicting cold pages. Eviction continues until the
+ *  resident page count drops below OOC_FLUSH_LOWAT. */
+#define OOC_FLUSH_HIWAT 95
+
+/*! Maximum number of pages examined by one step of the clock sweep. */
+#define OOC_FLUSH_BATCH 64
+
+/*! Microseconds that an idle flusher thread sleeps between checks. */
+#define OOC_FLUSH_INTERVAL 1000
+
+/*! Maximum number of background flusher threads. */
+#define OOC_FLUSH_MAX_THREADS 8
+
+/*! Number of empty vma_alloc() superblocks, above which the superblock cache is
+ *  shrunk to OOC_VMA_CACHE_LOWAT superblocks. */
+#define OOC_VMA_CACHE_HIWAT 8
+
+/*! Number of empty vma_alloc() superblocks retained when the superblock cache
+ *  is shrunk. */
+#define OOC_VMA_CACHE_LOWAT 2
+
+/*! Milliseconds after which a cached superblock is returned to the system by
+ *  vma_gpool_trim(), 0 means never. */
+#define OOC_VMA_CACHE_TIMEOUT 1000
+
+/*! Number of vmas cached per thread by vma_alloc(), before they are returned
+ *  to their blocks. */
+#define OOC_VMA_MAGAZINE_SIZE 64
+
+/*! Maximum number of threads with their own statistics counters. Any further
+ *  threads share the counters of the last one. */
+#define OOC_STATS_MAX_THREADS 256
+
+/*! Number of events retained per thread by the tracer, older events are
+ *  overwritten. Trace events are only recorded if OOC_TRACE is defined. */
+#define OOC_TRACE_SIZE 65536
+
+/*! Number of buckets in the table of in-flight page reads. */
+#define OOC_INFLIGHT_SIZE 64
+
+/*! Maximum number of worker threads of ooc_parallel_for(). */
+#define OOC_PARALLEL_MAX_THREADS 64
+
+/*! Capacity of a worker's deque of iteration ranges. */
+#define OOC_PARALLEL_DEQUE_SIZE 128
+
+/*! Number of iterations which ooc_parallel_for() reorders by the residency of
+ *  their footprints. */
+#define OOC_PARALLEL_BATCH 64
+
+/*! Maximum number of kernels with a registered footprint. */
+#define OOC_FOOTPRINT_MAX 32
+
+/*! Maximum number of ranges, declared with ooc_writes(), that are flushed when
+ *  a kernel iteration completes. */
+#define OOC_ACCESS_MAX 8
+
+/*! Maximum number of tasks, which are about to become ready, whose inputs are
+ *  prefetched when a task completes. */
+#define OOC_TASK_PREFETCH 8
+
+/*! Maximum number of distinct runs in a protection-change queue. */
+#define OOC_PROT_QUEUE_SIZE 16
+
+/*! Maximum number of extents in a backing-store I/O queue. */
+#define OOC_SWAP_QUEUE_SIZE 64
+
+/*! Default path of the file through which the processes of a node share their
+ *  memory, which $OOC_BROKER overrides. */
+#define OOC_BROKER_PATH "/dev/shm/ooc-broker"
+
+/*! Maximum number of processes which share the memory of a node. */
+#define OOC_BROKER_MAX_PROCS 64
+
+/*! Percentage of the physical memory of a node which its processes share,
+ *  unless the first one to join the broker gives a limit. */
+#define OOC_BROKER_SHARE 80
+
+/*! Milliseconds between updates of the demand and working-set estimate of a
+ *  process, and between rebalances of the budgets. */
+#define OOC_BROKER_INTERVAL 100
+
+/*! Number of pages which the broker assigns to every process, so that none is
+ *  starved, if the limit allows. */
+#define OOC_BROKER_MIN 16
+
+/*! Number of pages made resident in an interval, as a percentage of its
+ *  budget, above which the working-set estimate of a process grows, and
+ *  below which it shrinks. */
+#define OOC_BROKER_PFF_HI 5
+#define OOC_BROKER_PFF_LO 1
+
+/*! Maximum number of processes attached to a shared region at once. */
+#define OOC_SHM_MAX_PROCS 64
+
+/*! Milliseconds that ooc_shm_open() waits for the process which is creating a
+ *  shared region to publish it. */
+#define OOC_SHM_TIMEOUT 1000
+
+
+/*----------------------------------------------------------------------------*/
+/* Page flags */
+/*----------------------------------------------------------------------------*/
+/*! Page is resident, i.e., the y bit in the sched.c flow chart. */
+#define OOC_PAGE_SYNC   0x1
+/*! Page has been modified since it was last written to the backing store. */
+#define OOC_PAGE_DIRTY  0x2
+/*! Page has a valid copy in the backing store. */
+#define OOC_PAGE_ONDISK 0x4
+/*! Page has been faulted since the clock hand last passed it. */
+#define OOC_PAGE_REF    0x8
+/*! Page is locked, see page.c. The other flags of a page may only be changed
+ *  while it is locked, except for OOC_PAGE_REF, which may be cleared
+ *  atomically at any time. */
+#define OOC_PAGE_LOCK   0x10
 
 
 /*----------------------------------------------------------------------------*/
 /* Simple lock implementation */
 /*----------------------------------------------------------------------------*/
-#define lock_init ooc_lock_init
-#define lock_free ooc_lock_free
-#define lock_get  ooc_lock_get
-#define lock_let  ooc_lock_let
-#define lock_try  ooc_lock_try
-#define lock_t    ooc_lock_t
-#ifdef _OPENMP
-/* omp_lock_t */
-#include <omp.h>
-
-typedef omp_lock_t lock_t;
-
-#define ooc_lock_init(lock) (omp_init_lock(lock), 0)
-#define ooc_lock_free(lock) (omp_destroy_lock(lock), 0)
-#define ooc_lock_get(lock)  (omp_set_lock(lock), 0)
-#define ooc_lock_let(lock)  (omp_unset_lock(lock), 0)
-#define ooc_lock_try(lock)  (0 == omp_test_lock(lock))
+#define lock_init  ooc_lock_init
+#define lock_free  ooc_lock_free
+#define lock_get   ooc_lock_get
+#define lock_let   ooc_lock_let
+#define lock_try   ooc_lock_try
+#define lock_class ooc_lock_class
+#define lock_t     ooc_lock_t
+#define lock_raw_t ooc_lock_raw_t
+/*! Native lock, a short adaptive spin followed by a futex wait. The lock word
+ *  is 0 when unlocked, 1 when locked and 2 when locked with possible waiters,
+ *  so that an uncontended acquire and release is a single atomic operation
+ *  each, and a zero initialized lock is unlocked. Each lock is padded to a
+ *  cache line, to avoid false sharing between neighboring locks. */
+typedef struct
+{
+  int state;
+  int spin;                   /* estimate of iterations to spin */
+  char pad[OOC_CACHE_LINE-2*sizeof(int)];
+} __attribute__((aligned(OOC_CACHE_LINE))) lock_raw_t;
+
+#define ooc_lock_raw_init(lock) ((lock)->state=0, (lock)->spin=0, 0)
+#define ooc_lock_raw_free(lock) 0
+#define ooc_lock_raw_get(lock) \
+  (__sync_bool_compare_and_swap(&((lock)->state), 0, 1) ? 0 : lock_raw_wait(lock))
+#define ooc_lock_raw_let(lock) \
+  (1 == __sync_fetch_and_sub(&((lock)->state), 1) ? 0 : lock_raw_wake(lock))
+#define ooc_lock_raw_try(lock) \
+  (!__sync_bool_compare_and_swap(&((lock)->state), 0, 1))
+
+#define lock_raw_wait ooc_lock_raw_wait
+/*! Slow path of lock_get(), when the lock is held by another thread. */
+int lock_raw_wait(lock_raw_t * const lock);
+
+#define lock_raw_wake ooc_lock_raw_wake
+/*! Slow path of lock_let(), when there may be threads waiting for the lock. */
+int lock_raw_wake(lock_raw_t * const lock);
+
+#ifdef OOC_LOCK_STATS
+/*! Instrumented lock, which records acquisitions, contended acquisitions, wait
+ *  time and hold time for its class in the statistics of ooc_stats(). A zero
+ *  initialized lock belongs to OOC_LOCK_OTHER. */
+typedef struct
+{
+  lock_raw_t raw;
+  unsigned int cls;
+  unsigned long long ts;      /* time stamp of last acquisition */
+} lock_t;
+
+#define ooc_lock_init(lock) \
+  ((lock)->cls=OOC_LOCK_OTHER, (lock)->ts=0, ooc_lock_raw_init(&((lock)->raw)))
+#define ooc_lock_free(lock) ooc_lock_raw_free(&((lock)->raw))
+#define ooc_lock_get(lock)  lock_stats_get(lock)
+#define ooc_lock_let(lock)  lock_stats_let(lock)
+#define ooc_lock_try(lock)  lock_stats_try(lock)
+#define ooc_lock_class(lock,c) ((lock)->cls=(c), 0)
 #else
-typedef int lock_t;
-
-#define ooc_lock_init(lock) 0
-#define ooc_lock_free(lock) 0
-#define ooc_lock_get(lock)  0
-#define ooc_lock_let(lock)  0
-#define ooc_lock_try(lock)  0
+typedef lock_raw_t lock_t;
+
+#define ooc_lock_init(lock) ooc_lock_raw_init(lock)
+#define ooc_lock_free(lock) ooc_lock_raw_free(lock)
+#define ooc_lock_get(lock)  ooc_lock_raw_get(lock)
+#define ooc_lock_let(lock)  ooc_lock_raw_let(lock)
+#define ooc_lock_try(lock)  ooc_lock_raw_try(lock)
+#define ooc_lock_class(lock,c) 0
 #endif
 
 
 /*----------------------------------------------------------------------------*/
 /* */
 /*----------------------------------------------------------------------------*/
+#define shm_ctl ooc_shm_ctl
+/*! Control block of a shared region, at the start of its memfd, followed by
+ *  the per-page holder masks and then the per-page flags. The page flags are
+ *  those of every attached process, so that a page is read in, and resident,
+ *  once for all of them. */
+struct shm_ctl
+{
+  unsigned long magic;        /* set once the block is initialized */
+  size_t size;                /* size of the region in bytes */
+  size_t budget;              /* memory budget of the region in pages, 0 means
+                                 unlimited */
+  size_t resident;            /* number of resident pages of the region */
+  size_t hand;                /* clock hand, the next page to be examined */
+  int    pid[OOC_SHM_MAX_PROCS]; /* attached processes, 0 for a free slot */
+  char   path[256];           /* backing store */
+};
+
+#define shm ooc_shm
+/*! A process's attachment to a shared region. Protections are per process, so
+ *  bit i of holder[ip] is set while page ip may be accessible to the process
+ *  in slot i of the control block, and only a page which no other process
+ *  holds may be written back or evicted. */
+struct shm
+{
+  struct shm_ctl * ctl;       /* control block */
+  unsigned long long * holder; /* per-page masks of the holding processes */
+  unsigned long long me;      /* mask of the slot of this process */
+  size_t info_sz;             /* offset of the data in the memfd */
+  int    fd;                  /* memfd */
+  int    bfd;                 /* backing store */
+};
+
 #define vm_area ooc_vm_area
 #define sp_node ooc_vm_area
 /*! Virtual memory area. */
@@ -89,9 +310,48 @@ struct vm_area
   void *         vm_start;    /* VMA start, inclusive */
   void *         vm_end;      /* VMA end, exclusive */
 
+  unsigned char *vm_pflags;   /* per-page flags (for ooc_malloc() VMAs) */
+  size_t         vm_off;      /* offset of VMA in backing store */
+  struct shm *   vm_shm;      /* shared region, or NULL if VMA is private */
+
   lock_t         vm_lock;     /* struct lock */
 };
 
+#define prot_queue ooc_prot_queue
+/*! Protection-change queue -- adjacent ranges with the same target protection
+ *  (and advice) are merged into a single run, so that they can be applied
+ *  with a single system call. */
+struct prot_queue
+{
+  size_t n;                   /* number of runs */
+  struct
+  {
+    void * beg;               /* run start, inclusive */
+    void * end;               /* run end, exclusive */
+    int    prot;              /* target protection */
+    int    adv;               /* advice applied after protection, if any */
+  } run[OOC_PROT_QUEUE_SIZE];
+};
+
+/*! No advice for a protection-change queue run. */
+#define PROT_QUEUE_NOADV (-1)
+
+#define swap_queue ooc_swap_queue
+/*! Backing-store I/O queue -- extents which are adjacent in the backing store
+ *  are dispatched as a single vectored I/O, whether or not they are adjacent
+ *  in memory. */
+struct swap_queue
+{
+  int    write;               /* queued extents are written, rather than read */
+  size_t n;                   /* number of extents */
+  struct
+  {
+    void * buf;               /* extent memory */
+    size_t len;               /* extent length */
+    size_t off;               /* extent offset in backing store */
+  } ext[OOC_SWAP_QUEUE_SIZE];
+};
+
 #define sp_tree ooc_sp_tree
 /*! Splay tree. */
 struct sp_tree
@@ -131,6 +391,319 @@ int sp_tree_find_mod_and_lock(struct sp_tree * const sp, void * const vm_addr,\
 /*! Remove node with specified datum in the tree, if MUST exist. */
 int sp_tree_remove(struct sp_tree * const sp_tree, void * const vm_addr);
 
+#define sp_tree_find_next_and_lock ooc_sp_tree_find_next_and_lock
+/*! Find and lock the first unlocked node containing or following vm_addr. */
+int sp_tree_find_next_and_lock(struct sp_tree * const sp, void * const vm_addr,\
+                               struct sp_node ** const zp);
+
+#define sp_tree_find_first_and_lock ooc_sp_tree_find_first_and_lock
+/*! Find and lock the first node containing or following vm_addr, waiting for
+ *  its lock. */
+int sp_tree_find_first_and_lock(struct sp_tree * const sp,\
+                                void * const vm_addr,\
+                                struct sp_node ** const zp);
+
+
+/* inflight.c */
+/*! An in-flight page read, which other faults on the same page can wait for
+ *  instead of issuing their own read. */
+struct inflight
+{
+  void * addr;                /* page being read */
+  int done;                   /* read has completed */
+  int nwait;                  /* number of attached waiters */
+  struct inflight * next;     /* bucket chain */
+};
+
+#define inflight_begin ooc_inflight_begin
+/*! Register an in-flight read of the page at addr. */
+void inflight_begin(struct inflight * const req, void * const addr);
+
+#define inflight_end ooc_inflight_end
+/*! Complete an in-flight read, waking all of its waiters. */
+void inflight_end(struct inflight * const req);
+
+#define inflight_wait ooc_inflight_wait
+/*! Wait for an in-flight read of the page at addr, returns non-zero if there is
+ *  none. */
+int inflight_wait(void * const addr);
+
+
+/* page.c */
+#define page_trylock ooc_page_trylock
+/*! Try to lock page ip of vma, returns non-zero if it is already locked. */
+int page_trylock(struct vm_area * const vma, size_t const ip);
+
+#define page_lock ooc_page_lock
+/*! Lock page ip of vma, waiting for it to be unlocked if necessary. */
+void page_lock(struct vm_area * const vma, size_t const ip);
+
+#define page_unlock ooc_page_unlock
+/*! Unlock page ip of vma. */
+void page_unlock(struct vm_area * const vma, size_t const ip);
+
+#define page_read ooc_page_read
+/*! Read nr pages at addr from backing-store offset off, installing them with
+ *  read protection once they are complete. The pages are never accessible
+ *  while incomplete, and are left inaccessible if this fails. */
+int page_read(void * const addr, size_t const nr, size_t const off);
+
+#define page_missing ooc_page_missing
+/*! Count the pages of ooc_malloc() memory in [addr,addr+len) which are not
+ *  resident. */
+size_t page_missing(void * const addr, size_t const len);
+
+#define page_prefetch ooc_page_prefetch
+/*! Read in the pages of ooc_malloc() memory in [addr,addr+len) which are on
+ *  disk, with read protection. Busy pages are skipped. */
+void page_prefetch(void * const addr, size_t const len);
+
+#define page_dirty ooc_page_dirty
+/*! Make the resident or zero-fill pages of ooc_malloc() memory in
+ *  [addr,addr+len) writable, as if they had been written. If discard is
+ *  non-zero, then pages which are on disk are zero-filled too, rather than
+ *  being skipped. Busy pages are skipped. */
+void page_dirty(void * const addr, size_t const len, int discard);
+
+
+/* parallel.c */
+#define parallel_stop ooc_parallel_stop
+/*! Stop and join the worker pool of ooc_parallel_for(). */
+int parallel_stop(void);
+
+
+/* sched.c */
+#define sched_init ooc_sched_init
+/*! Install the SIGSEGV handler for the process, if it is not installed, and
+ *  initialize the fibers of the calling thread, if they are not. */
+int sched_init(void);
+
+#define sched_range_add ooc_sched_range_add
+/*! Claim faults in [beg,end) for the SIGSEGV handler, rather than passing them
+ *  on to the previously installed handler. Returns non-zero if the table of
+ *  claimed ranges cannot grow. */
+int sched_range_add(void * const beg, void * const end);
+
+#define sched_range_del ooc_sched_range_del
+/*! Release the range which starts at beg. */
+void sched_range_del(void * const beg);
+
+#define sched_poll ooc_sched_poll
+/*! Resume each fiber of the calling thread which yielded, once. Returns the
+ *  number of fibers which are still yielded. */
+int sched_poll(void);
+
+
+/* prot.c */
+#define prot_queue_init ooc_prot_queue_init
+/*! Initialize a protection-change queue to empty. */
+void prot_queue_init(struct prot_queue * const q);
+
+#define prot_queue_add ooc_prot_queue_add
+/*! Queue a protection change, merging it with an adjacent run if possible. */
+int prot_queue_add(struct prot_queue * const q, void * const addr,\
+                   size_t const len, int const prot, int const adv);
+
+#define prot_queue_flush ooc_prot_queue_flush
+/*! Apply all queued protection changes and empty the queue. */
+int prot_queue_flush(struct prot_queue * const q);
+
+
+/* swap.c */
+#define swap_alloc ooc_swap_alloc
+/*! Reserve a range of the backing store. */
+size_t swap_alloc(size_t const size);
+
+#define swap_free ooc_swap_free
+/*! Release a range of the backing store. */
+void swap_free(size_t const off, size_t const size);
+
+#define swap_read ooc_swap_read
+/*! Read a range of the backing store into memory. */
+int swap_read(void * const buf, size_t const size, size_t const off);
+
+#define swap_write ooc_swap_write
+/*! Write a range of memory to the backing store. */
+int swap_write(void const * const buf, size_t const size, size_t const off);
+
+#define swap_readv ooc_swap_readv
+/*! Read a contiguous range of the backing store into iovcnt buffers. The
+ *  contents of iov are consumed. */
+int swap_readv(struct iovec * const iov, int const iovcnt, size_t const off);
+
+#define swap_writev ooc_swap_writev
+/*! Write iovcnt buffers to a contiguous range of the backing store. The
+ *  contents of iov are consumed. */
+int swap_writev(struct iovec * const iov, int const iovcnt, size_t const off);
+
+#define swap_queue_init ooc_swap_queue_init
+/*! Initialize a backing-store I/O queue of reads or writes to empty. */
+void swap_queue_init(struct swap_queue * const q, int const write);
+
+#define swap_queue_add ooc_swap_queue_add
+/*! Queue an extent, merging it with an adjacent extent if possible. */
+int swap_queue_add(struct swap_queue * const q, void * const buf,\
+                   size_t const len, size_t const off);
+
+#define swap_queue_flush ooc_swap_queue_flush
+/*! Dispatch all queued extents and empty the queue. */
+int swap_queue_flush(struct swap_queue * const q);
+
+
+/* broker.c */
+#define broker_alloc ooc_broker_alloc
+/*! Account for nr pages which the process has allocated, i.e., its demand. */
+void broker_alloc(size_t const nr);
+
+#define broker_free ooc_broker_free
+/*! Account for nr pages which the process has freed. */
+void broker_free(size_t const nr);
+
+#define broker_tick ooc_broker_tick
+/*! If the process has joined the budget broker, and OOC_BROKER_INTERVAL has
+ *  passed since the last call which did, publish the demand and working-set
+ *  estimate of the process, rebalance the budgets of all processes if no
+ *  other process has lately, and apply the budget assigned to this one. */
+void broker_tick(void);
+
+
+/* flush.c */
+#define flush_charge ooc_flush_charge
+/*! Account for pages of vma that have become resident. */
+void flush_charge(struct vm_area const * const vma, size_t const nr);
+
+#define flush_uncharge ooc_flush_uncharge
+/*! Account for pages of vma that are no longer resident. */
+void flush_uncharge(struct vm_area const * const vma, size_t const nr);
+
+#define flush_clean ooc_flush_clean
+/*! Write back the dirty pages which lie entirely within ooc_malloc() memory in
+ *  [addr,addr+len), if a memory budget is set. Busy pages are skipped. */
+void flush_clean(void * const addr, size_t const len);
+
+#define flush_evict ooc_flush_evict
+/*! Write back and evict the resident pages which lie entirely within
+ *  ooc_malloc() memory in [addr,addr+len), if a memory budget is set. Busy
+ *  pages are skipped. */
+void flush_evict(void * const addr, size_t const len);
+
+#define flush_reclaim ooc_flush_reclaim
+/*! Synchronously evict pages until the resident count is within budget, that
+ *  of the shared region if vma is shared, or that of the process if it is not.
+ *  vma must not be locked. */
+int flush_reclaim(struct vm_area * const vma);
+
+#define flush_budget ooc_flush_budget
+/*! Set the memory budget of the process to nr pages, 0 meaning unlimited,
+ *  until it is set again. */
+void flush_budget(size_t const nr);
+
+#define flush_usage ooc_flush_usage
+/*! Get the memory budget set with ooc_set_budget(), the number of resident
+ *  pages, and the number of pages which have been made resident, ever. Shared
+ *  regions are not included. */
+void flush_usage(size_t * const cap, size_t * const resident,
+                 size_t * const charged);
+
+
+/* shm.c */
+#define shm_hold ooc_shm_hold
+/*! Mark page ip of shared vma as accessible to the calling process. */
+void shm_hold(struct vm_area const * const vma, size_t const ip);
+
+#define shm_drop ooc_shm_drop
+/*! Mark page ip of shared vma as inaccessible to the calling process. */
+void shm_drop(struct vm_area const * const vma, size_t const ip);
+
+#define shm_held ooc_shm_held
+/*! Returns non-zero if page ip of shared vma is held by the calling
+ *  process. */
+int shm_held(struct vm_area const * const vma, size_t const ip);
+
+#define shm_busy ooc_shm_busy
+/*! Returns non-zero if page ip of shared vma is held by another process. */
+int shm_busy(struct vm_area const * const vma, size_t const ip);
+
+#define shm_read ooc_shm_read
+/*! Read nr pages of shared vma, starting at page ip, from its backing store
+ *  into its memfd, and install them with read protection, as page_read()
+ *  does. */
+int shm_read(struct vm_area const * const vma, size_t const ip,
+             size_t const nr);
+
+#define shm_write ooc_shm_write
+/*! Write nr pages of shared vma, starting at page ip, from its memfd to its
+ *  backing store. */
+int shm_write(struct vm_area const * const vma, size_t const ip,
+              size_t const nr);
+
+#define shm_punch ooc_shm_punch
+/*! Release the memory of nr pages of shared vma, starting at page ip, for
+ *  every attached process. */
+int shm_punch(struct vm_area const * const vma, size_t const ip,
+              size_t const nr);
+
+#define shm_free ooc_shm_free
+/*! Detach the calling process from the shared region of vma, which must be
+ *  locked, as ooc_free() does for a private one. */
+void shm_free(struct vm_area * const vma);
+
+
+/* stats.c */
+struct ooc_stats;
+
+#define stats_local ooc_stats_local
+/*! Get the calling thread's statistics counters. */
+struct ooc_stats * stats_local(void);
+
+#define stats_clock ooc_stats_clock
+/*! Get a monotonic time stamp in nanoseconds. */
+unsigned long long stats_clock(void);
+
+#define stats_hist ooc_stats_hist
+/*! Count a latency of ns nanoseconds in a histogram. */
+void stats_hist(unsigned long long * const hist, unsigned long long const ns);
+
+#define stats_io_begin ooc_stats_io_begin
+/*! Account for an I/O request being submitted, returns its start time. */
+unsigned long long stats_io_begin(void);
+
+#define stats_io_end ooc_stats_io_end
+/*! Account for an I/O request of size bytes, started at beg, completing. */
+void stats_io_end(unsigned long long const beg, size_t const size,\
+                  int const write);
+
+#ifdef OOC_LOCK_STATS
+#define lock_stats_get ooc_lock_stats_get
+/*! Acquire an instrumented lock. */
+int lock_stats_get(lock_t * const lock);
+
+#define lock_stats_let ooc_lock_stats_let
+/*! Release an instrumented lock. */
+int lock_stats_let(lock_t * const lock);
+
+#define lock_stats_try ooc_lock_stats_try
+/*! Try to acquire an instrumented lock, returns non-zero if it is held. */
+int lock_stats_try(lock_t * const lock);
+#endif
+
+/*! Add n to a counter of the calling thread. */
+#define STATS_ADD(field,n) \
+  (void)__sync_fetch_and_add(&(stats_local()->field), (unsigned long long)(n))
+
+
+/* trace.c */
+#define trace_event ooc_trace_event
+/*! Record an event in the calling thread's trace ring buffer. */
+void trace_event(unsigned int const type, unsigned long long const arg);
+
+/*! Record a trace event, if tracing is enabled at compile-time. */
+#ifdef OOC_TRACE
+  #define TRACE_EVENT(type,arg) trace_event(type, (unsigned long long)(arg))
+#else
+  #define TRACE_EVENT(type,arg) (void)0
+#endif
+
 
 /* vma_alloc.c */
 #define vma_alloc ooc_vma_alloc
@@ -141,6 +714,11 @@ struct vm_area * vma_alloc(void);
 /*! Return a vm_area struct to the system. */
 void vma_free(struct vm_area * const vma);
 
+#define vma_mpool_flush ooc_vma_mpool_flush
+/*! Return the vm_area structs cached by the calling thread, including those
+ *  freed by other threads, to the memory pool. */
+void vma_mpool_flush(void);
+
 #define vma_gpool_init ooc_vma_gpool_init
 /*! Initialize the vm_area struct memory pool. */
 void vma_gpool_init(void);
@@ -149,6 +727,10 @@ void vma_gpool_init(void);
 /*! Free the vm_area struct memory pool. */
 void vma_gpool_free(void);
 
+#define vma_gpool_trim ooc_vma_gpool_trim
+/*! Return superblocks which have been cached for too long to the system. */
+void vma_gpool_trim(void);
+
 #define vma_gpool_gather ooc_vma_gpool_gather
 /*! Gather statistics runtime statistics. */
 void vma_gpool_gather(void);
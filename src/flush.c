@@ -0,0 +1,931 @@
+/*
+Copyright (c) 2016 Jeremy Iverson
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+
+/* assert */
+#include <assert.h>
+
+/* pthread_t, pthread_create, pthread_join */
+#include <pthread.h>
+
+/* size_t */
+#include <stddef.h>
+
+/* uintptr_t */
+#include <stdint.h>
+
+/* NULL */
+#include <stdlib.h>
+
+/* PROT_NONE, PROT_READ, MADV_DONTNEED */
+#include <sys/mman.h>
+
+/* nanosleep, struct timespec */
+#include <time.h>
+
+/* function prototypes */
+#include "include/ooc.h"
+
+/* */
+#include "common.h"
+
+
+/*
+ *  The background flusher is modeled after the kernel's kswapd/pdflush. A
+ *  small pool of threads shares a single clock hand which sweeps over the
+ *  pages of all VMAs in vma_tree.
+ *
+ *    resident < LOWAT          -- flusher threads sleep
+ *    LOWAT <= resident < HIWAT -- cold dirty pages are written back, but remain
+ *                                 resident, so that a later eviction is cheap
+ *    HIWAT <= resident         -- cold pages are evicted until resident drops
+ *                                 below LOWAT
+ *
+ *  A page is considered cold if it has not been faulted since the clock hand
+ *  last passed over it, i.e., OOC_PAGE_REF is used as a second chance bit. If
+ *  the flusher threads cannot keep up, or none are running, a faulting thread
+ *  will evict pages synchronously in flush_reclaim() once the budget is
+ *  reached.
+ */
+
+
+/*! Sweep actions. S_ACT_DROP only revokes the access of this process to a
+ *  page of a shared region which another process holds. */
+#define S_ACT_NONE  0
+#define S_ACT_CLEAN 1
+#define S_ACT_EVICT 2
+#define S_ACT_DROP  3
+
+/*! Whether action a writes back a dirty page. */
+#define S_ACT_WRITES(a) (S_ACT_CLEAN == (a) || S_ACT_EVICT == (a))
+
+
+/*! Memory budget in pages, 0 means unlimited. It is the one set with
+ *  ooc_set_budget(), unless the budget broker has assigned another. */
+static size_t S_budget=0;
+
+/*! Memory budget set with ooc_set_budget(), in pages. */
+static size_t S_cap=0;
+
+/*! Number of pages which have been made resident, ever. */
+static size_t S_charged=0;
+
+/*! Number of resident pages. */
+static size_t S_resident=0;
+
+/*! Clock hand -- the next address to be examined by a sweep. Races on the hand
+ *  are benign, they only cause two sweeps to examine the same pages. */
+static void * S_hand=NULL;
+
+/*! Flusher threads. */
+static pthread_t S_thread[OOC_FLUSH_MAX_THREADS];
+
+/*! Number of running flusher threads. */
+static unsigned int S_nthreads=0;
+
+/*! Indicator variable for flusher thread shutdown. */
+static volatile int S_stop=0;
+
+
+/*! Apply the actions chosen by S_sweep() to pages [beg,end) of vma. vma must
+ *  be locked. Protection changes are batched, so that each contiguous run of
+ *  pages with the same target protection costs one mprotect(), and each
+ *  contiguous run of dirty pages is written with one I/O. */
+static int
+S_sweep_apply(struct vm_area * const vma, size_t const beg, size_t const end,
+              unsigned char const * const act)
+{
+  int ret;
+  size_t ps, ip, nr=0;
+  char * addr;
+  struct prot_queue q;
+  struct swap_queue sq;
+
+  ps = (size_t)OOC_PAGE_SIZE;
+  addr = (char*)vma->vm_start;
+
+  prot_queue_init(&q);
+
+  /* Revoke write protection from dirty pages first, so that they cannot be
+   * modified while they are being written. A page of a shared region which
+   * this process does not hold is inaccessible to it already. */
+  for (ip=beg; ip<end; ++ip) {
+    if (S_ACT_WRITES(act[ip-beg]) && (vma->vm_pflags[ip]&OOC_PAGE_DIRTY) &&\
+        (!vma->vm_shm || shm_held(vma, ip)))
+    {
+      ret = prot_queue_add(&q, addr+ip*ps, ps, PROT_READ, PROT_QUEUE_NOADV);
+      if (ret) {
+        return ret;
+      }
+    }
+  }
+  ret = prot_queue_flush(&q);
+  if (ret) {
+    return ret;
+  }
+
+  /* Write back dirty pages. */
+  swap_queue_init(&sq, 1);
+  for (ip=beg; ip<end; ++ip) {
+    if (S_ACT_WRITES(act[ip-beg]) && (vma->vm_pflags[ip]&OOC_PAGE_DIRTY)) {
+      if (vma->vm_shm) {
+        ret = shm_write(vma, ip, 1);
+      }
+      else {
+        ret = swap_queue_add(&sq, addr+ip*ps, ps, vma->vm_off+ip*ps);
+      }
+      if (ret) {
+        return ret;
+      }
+
+      vma->vm_pflags[ip] &= (unsigned char)~OOC_PAGE_DIRTY;
+      vma->vm_pflags[ip] |= OOC_PAGE_ONDISK;
+    }
+  }
+  ret = swap_queue_flush(&sq);
+  if (ret) {
+    return ret;
+  }
+
+  /* Evict pages. The memory of a shared region is released by punching it out
+   * of the memfd instead, since madvise() would only drop this process's
+   * mapping of it. */
+  for (ip=beg; ip<end; ++ip) {
+    if (S_ACT_EVICT == act[ip-beg]) {
+      ret = prot_queue_add(&q, addr+ip*ps, ps, PROT_NONE,\
+                           vma->vm_shm ? PROT_QUEUE_NOADV : MADV_DONTNEED);
+      if (ret) {
+        return ret;
+      }
+
+      vma->vm_pflags[ip] &= (unsigned char)~(OOC_PAGE_SYNC|OOC_PAGE_REF);
+      nr++;
+    }
+    else if (S_ACT_DROP == act[ip-beg]) {
+      ret = prot_queue_add(&q, addr+ip*ps, ps, PROT_NONE, PROT_QUEUE_NOADV);
+      if (ret) {
+        return ret;
+      }
+    }
+  }
+  ret = prot_queue_flush(&q);
+  if (ret) {
+    return ret;
+  }
+
+  for (ip=beg; vma->vm_shm && ip<end; ++ip) {
+    if (S_ACT_EVICT == act[ip-beg]) {
+      ret = shm_punch(vma, ip, 1);
+      if (ret) {
+        return ret;
+      }
+    }
+    if (S_ACT_EVICT == act[ip-beg] || S_ACT_DROP == act[ip-beg]) {
+      shm_drop(vma, ip);
+    }
+  }
+
+  flush_uncharge(vma, nr);
+  STATS_ADD(evictions, nr);
+  TRACE_EVENT(OOC_TRACE_EVICT, nr);
+
+  return 0;
+}
+
+
+/*! Advance the clock hand over at most OOC_FLUSH_BATCH pages. Cold dirty pages
+ *  are written back and, if nr is not NULL, up to *nr cold pages are evicted.
+ *  Returns the number of pages whose flags were changed, or -1 if the hand
+ *  wrapped around. */
+static int
+S_sweep(size_t * const nr)
+{
+  int ret, chg=0;
+  size_t ps, ip, beg, end, npages;
+  unsigned char f;
+  unsigned char act[OOC_FLUSH_BATCH];
+  struct vm_area * vma;
+
+  ps = (size_t)OOC_PAGE_SIZE;
+
+  ret = sp_tree_find_next_and_lock(&vma_tree, S_hand, (void*)&vma);
+  if (ret) {
+    S_hand = NULL;
+    return -1;
+  }
+
+  /* Shared regions are kept within their own budgets, by S_shm_sweep(). */
+  if (vma->vm_shm) {
+    S_hand = vma->vm_end;
+
+    ret = lock_let(&(vma->vm_lock));
+    assert(!ret);
+    return 0;
+  }
+
+  npages = ((uintptr_t)vma->vm_end-(uintptr_t)vma->vm_start+ps-1)/ps;
+  if ((uintptr_t)vma->vm_start < (uintptr_t)S_hand) {
+    beg = ((uintptr_t)S_hand-(uintptr_t)vma->vm_start)/ps;
+  }
+  else {
+    beg = 0;
+  }
+  end = beg+OOC_FLUSH_BATCH < npages ? beg+OOC_FLUSH_BATCH : npages;
+
+  S_hand = end == npages ? vma->vm_end : (char*)vma->vm_start+end*ps;
+
+  for (ip=beg; vma->vm_pflags && ip<end; ++ip) {
+    f = vma->vm_pflags[ip];
+    act[ip-beg] = S_ACT_NONE;
+
+    if (!(f&OOC_PAGE_SYNC)) {
+      continue;
+    }
+
+    if (f&OOC_PAGE_REF) {
+      /* Second chance. */
+      (void)__sync_fetch_and_and(&(vma->vm_pflags[ip]),\
+        (unsigned char)~OOC_PAGE_REF);
+    }
+    else if (!(nr && *nr) && !(f&OOC_PAGE_DIRTY)) {
+      continue;
+    }
+    else if (page_trylock(vma, ip)) {
+      /* Page is busy being faulted, so skip it. */
+      continue;
+    }
+    else if (!(vma->vm_pflags[ip]&OOC_PAGE_SYNC)) {
+      /* Page was evicted before it was locked. */
+      page_unlock(vma, ip);
+      continue;
+    }
+    else if (nr && *nr) {
+      act[ip-beg] = S_ACT_EVICT;
+      (*nr)--;
+    }
+    else {
+      act[ip-beg] = S_ACT_CLEAN;
+    }
+
+    chg++;
+  }
+
+  /* The pages with an action are locked, so vma can be unlocked before they
+   * are written and evicted, and faults on other pages of vma can proceed.
+   * ooc_free() waits for all page locks before vma is released. */
+  ret = lock_let(&(vma->vm_lock));
+  assert(!ret);
+
+  if (vma->vm_pflags) {
+    ret = S_sweep_apply(vma, beg, end, act);
+    assert(!ret);
+
+    for (ip=beg; ip<end; ++ip) {
+      if (S_ACT_NONE != act[ip-beg]) {
+        page_unlock(vma, ip);
+      }
+    }
+  }
+
+  return chg;
+}
+
+
+/*! Flusher thread main loop. */
+static void *
+S_flush_thread(void * const arg)
+{
+  int ret, evict=0;
+  size_t budget, resident, nr;
+  struct timespec ts;
+
+  ts.tv_sec = 0;
+  ts.tv_nsec = OOC_FLUSH_INTERVAL*1000L;
+
+  while (!S_stop) {
+    broker_tick();
+
+    budget = S_budget;
+    resident = S_resident;
+
+    /* Hysteresis -- once HIWAT is crossed, keep evicting until LOWAT. */
+    if (!budget || resident*100 < budget*OOC_FLUSH_LOWAT) {
+      evict = 0;
+    }
+    else if (resident*100 >= budget*OOC_FLUSH_HIWAT) {
+      evict = 1;
+    }
+
+    if (!budget || resident*100 < budget*OOC_FLUSH_LOWAT) {
+      ret = 0;
+    }
+    else if (evict) {
+      nr = resident-(budget*OOC_FLUSH_LOWAT)/100;
+      ret = S_sweep(&nr);
+    }
+    else {
+      ret = S_sweep(NULL);
+    }
+
+    if (!ret) {
+      /* While idle, return long unused vma_alloc() superblocks to the
+       * system. */
+      vma_gpool_trim();
+
+      (void)nanosleep(&ts, NULL);
+    }
+  }
+
+  return arg;
+}
+
+
+/*! Advance the clock hand of the shared region of vma over at most
+ *  OOC_FLUSH_BATCH pages, and evict up to *nr cold pages which no other process
+ *  holds. This process's access to cold pages which another process holds is
+ *  dropped instead, so that whichever process drops a page last can evict it.
+ *  vma must not be locked, the caller's access to vma keeps it alive. Returns
+ *  the number of pages whose flags were changed, or -1 if the hand wrapped
+ *  around. */
+static int
+S_shm_sweep(struct vm_area * const vma, size_t * const nr)
+{
+  int ret, chg=0;
+  size_t ps, ip, beg, end, npages;
+  unsigned char f;
+  unsigned char act[OOC_FLUSH_BATCH];
+  struct shm_ctl * ctl;
+
+  ps  = (size_t)OOC_PAGE_SIZE;
+  ctl = vma->vm_shm->ctl;
+
+  npages = ((uintptr_t)vma->vm_end-(uintptr_t)vma->vm_start+ps-1)/ps;
+  beg    = ctl->hand < npages ? ctl->hand : 0;
+  end    = beg+OOC_FLUSH_BATCH < npages ? beg+OOC_FLUSH_BATCH : npages;
+
+  /* Races on the hand are benign, as for S_hand. */
+  ctl->hand = end;
+
+  for (ip=beg; ip<end; ++ip) {
+    f = vma->vm_pflags[ip];
+    act[ip-beg] = S_ACT_NONE;
+
+    if (!(f&OOC_PAGE_SYNC)) {
+      continue;
+    }
+
+    if (f&OOC_PAGE_REF) {
+      /* Second chance. */
+      (void)__sync_fetch_and_and(&(vma->vm_pflags[ip]),\
+        (unsigned char)~OOC_PAGE_REF);
+    }
+    else if (!*nr || page_trylock(vma, ip)) {
+      continue;
+    }
+    else if (!(vma->vm_pflags[ip]&OOC_PAGE_SYNC)) {
+      /* Page was evicted before it was locked. */
+      page_unlock(vma, ip);
+      continue;
+    }
+    else if (!shm_busy(vma, ip)) {
+      act[ip-beg] = S_ACT_EVICT;
+      (*nr)--;
+    }
+    else if (shm_held(vma, ip)) {
+      act[ip-beg] = S_ACT_DROP;
+    }
+    else {
+      page_unlock(vma, ip);
+      continue;
+    }
+
+    chg++;
+  }
+
+  if (chg) {
+    ret = S_sweep_apply(vma, beg, end, act);
+    assert(!ret);
+
+    for (ip=beg; ip<end; ++ip) {
+      if (S_ACT_NONE != act[ip-beg]) {
+        page_unlock(vma, ip);
+      }
+    }
+  }
+
+  return end == npages ? -1 : chg;
+}
+
+
+void
+flush_charge(struct vm_area const * const vma, size_t const nr)
+{
+  if (vma->vm_shm) {
+    (void)__sync_fetch_and_add(&(vma->vm_shm->ctl->resident), nr);
+  }
+  else {
+    (void)__sync_fetch_and_add(&S_resident, nr);
+    (void)__sync_fetch_and_add(&S_charged, nr);
+  }
+}
+
+
+void
+flush_uncharge(struct vm_area const * const vma, size_t const nr)
+{
+  if (vma->vm_shm) {
+    (void)__sync_fetch_and_sub(&(vma->vm_shm->ctl->resident), nr);
+  }
+  else {
+    (void)__sync_fetch_and_sub(&S_resident, nr);
+  }
+}
+
+
+/*! Apply action to the pages of ooc_malloc() memory in [p,e), with p page
+ *  aligned. S_ACT_CLEAN applies to dirty pages, S_ACT_EVICT to resident pages.
+ *  Busy pages, and the pages of memory without a budget, are skipped. */
+static void
+S_flush_range(uintptr_t p, uintptr_t const e, unsigned char const action)
+{
+  int ret, chg;
+  size_t ps, ip, beg, end, npages, budget;
+  uintptr_t vs;
+  unsigned char f, want;
+  unsigned char act[OOC_FLUSH_BATCH];
+  struct vm_area * vma;
+
+  ps   = (size_t)OOC_PAGE_SIZE;
+  want = S_ACT_EVICT == action ? OOC_PAGE_SYNC : OOC_PAGE_DIRTY;
+
+  while (p < e) {
+    ret = sp_tree_find_and_lock(&vma_tree, (void*)p, (void*)&vma);
+    assert(!ret);
+
+    /* Without a budget, pages are never evicted, so writing them back early
+     * would only cost I/O, and write faults once they are written again. */
+    budget = vma->vm_shm ? vma->vm_shm->ctl->budget : S_budget;
+
+    if (!vma->vm_pflags || !budget) {
+      p = (uintptr_t)vma->vm_end;
+
+      ret = lock_let(&(vma->vm_lock));
+      assert(!ret);
+      continue;
+    }
+
+    vs     = (uintptr_t)vma->vm_start;
+    npages = ((uintptr_t)vma->vm_end-vs+ps-1)/ps;
+    beg    = (p-vs)/ps;
+    end    = (e-vs+ps-1)/ps < npages ? (e-vs+ps-1)/ps : npages;
+    if (end-beg > OOC_FLUSH_BATCH) {
+      end = beg+OOC_FLUSH_BATCH;
+    }
+    p = vs+end*ps;
+
+    /* Lock the pages to act on, as S_sweep() does. Pages of a shared region
+     * which another process holds are busy too. */
+    for (chg=0,ip=beg; ip<end; ++ip) {
+      act[ip-beg] = S_ACT_NONE;
+
+      f = vma->vm_pflags[ip];
+      if (!(f&want) || page_trylock(vma, ip)) {
+        continue;
+      }
+      if (!(vma->vm_pflags[ip]&want) || (vma->vm_shm && shm_busy(vma, ip))) {
+        page_unlock(vma, ip);
+        continue;
+      }
+
+      act[ip-beg] = action;
+      chg++;
+    }
+
+    ret = lock_let(&(vma->vm_lock));
+    assert(!ret);
+
+    /* If no page is locked, vma may already have been released. */
+    if (!chg) {
+      continue;
+    }
+
+    ret = S_sweep_apply(vma, beg, end, act);
+    assert(!ret);
+
+    for (ip=beg; ip<end; ++ip) {
+      if (S_ACT_NONE != act[ip-beg]) {
+        page_unlock(vma, ip);
+      }
+    }
+  }
+}
+
+
+void
+flush_clean(void * const addr, size_t const len)
+{
+  uintptr_t ps;
+
+  ps = (uintptr_t)OOC_PAGE_SIZE;
+
+  /* Only whole pages, since the rest of a partial page may still be written,
+   * e.g., by the next iteration. */
+  S_flush_range(((uintptr_t)addr+ps-1)&~(ps-1),
+                ((uintptr_t)addr+len)&~(ps-1), S_ACT_CLEAN);
+}
+
+
+void
+flush_evict(void * const addr, size_t const len)
+{
+  uintptr_t ps;
+
+  ps = (uintptr_t)OOC_PAGE_SIZE;
+
+  /* Only whole pages, since the rest of a partial page may still be in use. */
+  S_flush_range(((uintptr_t)addr+ps-1)&~(ps-1),
+                ((uintptr_t)addr+len)&~(ps-1), S_ACT_EVICT);
+}
+
+
+int
+flush_reclaim(struct vm_area * const vma)
+{
+  int ret, wrap=0;
+  size_t budget, resident, nr;
+
+  /* Pick up the budget which the broker assigns, if it has changed. */
+  broker_tick();
+
+  if (vma->vm_shm) {
+    budget = vma->vm_shm->ctl->budget;
+    resident = vma->vm_shm->ctl->resident;
+  }
+  else {
+    budget = S_budget;
+    resident = S_resident;
+  }
+
+  if (!budget || resident < budget) {
+    return 0;
+  }
+
+  /* Make room for one page. Give up after two complete passes of the clock
+   * hand, e.g., if all pages are referenced or locked by other threads, or
+   * held by other processes, in which case the budget is temporarily
+   * exceeded. The hand starts wherever it was left, so its first wrap ends a
+   * partial pass, and the third ends the second complete one. */
+  nr = resident-budget+1;
+  while (nr && wrap < 3) {
+    ret = vma->vm_shm ? S_shm_sweep(vma, &nr) : S_sweep(&nr);
+    if (-1 == ret) {
+      wrap++;
+    }
+  }
+
+  return 0;
+}
+
+
+void
+flush_budget(size_t const nr)
+{
+  S_budget = nr;
+}
+
+
+void
+flush_usage(size_t * const cap, size_t * const resident, size_t * const charged)
+{
+  *cap      = S_cap;
+  *resident = S_resident;
+  *charged  = S_charged;
+}
+
+
+int
+ooc_set_budget(size_t const size)
+{
+  S_cap = size/(size_t)OOC_PAGE_SIZE;
+  S_budget = S_cap;
+
+  return 0;
+}
+
+
+int
+ooc_flush_start(unsigned int const nr)
+{
+  int ret;
+  unsigned int i;
+
+  if (S_nthreads || !nr || nr > OOC_FLUSH_MAX_THREADS) {
+    return -1;
+  }
+
+  S_stop = 0;
+
+  for (i=0; i<nr; ++i) {
+    ret = pthread_create(&(S_thread[i]), NULL, &S_flush_thread, NULL);
+    if (ret) {
+      break;
+    }
+  }
+  S_nthreads = i;
+
+  if (i != nr) {
+    (void)ooc_flush_stop();
+    return -1;
+  }
+
+  return 0;
+}
+
+
+int
+ooc_flush_stop(void)
+{
+  int ret;
+  unsigned int i;
+
+  S_stop = 1;
+
+  for (i=0; i<S_nthreads; ++i) {
+    ret = pthread_join(S_thread[i], NULL);
+    assert(!ret);
+  }
+  S_nthreads = 0;
+
+  return 0;
+}
+
+
+#ifdef TEST
+/* assert */
+#include <assert.h>
+
+/* EXIT_SUCCESS */
+#include <stdlib.h>
+
+/* nanosleep, struct timespec */
+#include <time.h>
+
+/* omp_get_thread_num */
+#include <omp.h>
+
+#define N_PAGES  64
+#define N_BUDGET 16
+#define N_THREAD 4
+
+static void
+S_fill(size_t const i, void * const args)
+{
+  size_t ps, ip;
+  char * mem;
+
+  ps = (size_t)OOC_PAGE_SIZE;
+  mem = (char*)args;
+
+  for (ip=0; ip<N_PAGES; ++ip) {
+    mem[ip*ps] = (char)(ip+i);
+
+    /* Faulting thread must keep resident count within (soft) budget. */
+    assert(S_resident <= N_BUDGET+1);
+  }
+}
+
+static void
+S_check(size_t const i, void * const args)
+{
+  size_t ps, ip;
+  char * mem;
+
+  ps = (size_t)OOC_PAGE_SIZE;
+  mem = (char*)args;
+
+  for (ip=0; ip<N_PAGES; ++ip) {
+    assert((char)(ip+i) == mem[ip*ps]);
+  }
+}
+
+static void
+S_check_part(size_t const i, void * const args)
+{
+  size_t ps, ip;
+  char * mem;
+
+  ps = (size_t)OOC_PAGE_SIZE;
+  mem = (char*)args;
+
+  for (ip=i; ip<N_PAGES; ip+=N_THREAD) {
+    assert((char)(ip+1) == mem[ip*ps]);
+  }
+}
+
+static unsigned char
+S_pflags(void * const addr)
+{
+  int ret;
+  unsigned char f;
+  struct vm_area * vma;
+
+  ret = sp_tree_find_and_lock(&vma_tree, addr, (void*)&vma);
+  assert(!ret);
+  f = vma->vm_pflags[((char*)addr-(char*)vma->vm_start)/OOC_PAGE_SIZE];
+  ret = lock_let(&(vma->vm_lock));
+  assert(!ret);
+
+  return f;
+}
+
+static void
+S_annotate(size_t const i, void * const args)
+{
+  size_t ps, ip;
+  char * mem;
+
+  ps = (size_t)OOC_PAGE_SIZE;
+  mem = (char*)args;
+
+  ooc_reads(mem, N_BUDGET/2*ps);
+  ooc_writes(mem+N_PAGES/2*ps, N_BUDGET/2*ps);
+
+  for (ip=0; ip<N_BUDGET/2; ++ip) {
+    mem[(N_PAGES/2+ip)*ps] = mem[ip*ps];
+  }
+
+  if (i) {}
+}
+
+static void
+S_overwrite(size_t const i, void * const args)
+{
+  size_t ps, ip;
+  char * mem;
+
+  ps = (size_t)OOC_PAGE_SIZE;
+  mem = (char*)args;
+
+  ooc_overwrites(mem, N_PAGES*ps);
+
+  for (ip=0; ip<N_PAGES; ++ip) {
+    mem[ip*ps] = (char)(ip+i);
+  }
+}
+
+int
+main(void)
+{
+  int ret, i;
+  size_t ps;
+  char * mem;
+  struct timespec ts;
+  struct ooc_stats stats, before;
+
+  ps = (size_t)OOC_PAGE_SIZE;
+
+  mem = ooc_malloc(N_PAGES*ps);
+  assert(mem);
+
+  /* Synchronous eviction. */
+  ret = ooc_set_budget(N_BUDGET*ps);
+  assert(!ret);
+
+  ooc_sched(&S_fill, 1, mem);
+  ooc_sched(&S_check, 1, mem);
+
+  /* Every evicted dirty page was written, and read back by S_check. */
+  ret = ooc_stats(&stats);
+  assert(!ret);
+  assert(stats.evictions >= N_PAGES-N_BUDGET);
+  assert(stats.mj_faults > 0);
+  assert(stats.wr_bytes >= stats.mj_faults*ps);
+  assert(stats.rd_bytes == stats.mj_faults*ps);
+
+  /* Concurrent faults on disjoint pages of the same vma. */
+  #pragma omp parallel num_threads(N_THREAD)
+  ooc_sched(&S_check_part, (size_t)omp_get_thread_num(), mem);
+
+  /* Concurrent faults on the same pages, none of which may observe a page
+   * before it has been completely read in. */
+  #pragma omp parallel num_threads(N_THREAD)
+  ooc_sched(&S_check, 1, mem);
+
+  /* Background eviction, the flusher must bring the resident count below the
+   * low watermark. All pages are made resident first, so that the high
+   * watermark is crossed, however many pages the faults above left
+   * resident. */
+  ret = ooc_set_budget(2*N_PAGES*ps);
+  assert(!ret);
+  ooc_sched(&S_check, 1, mem);
+  ret = ooc_set_budget(N_BUDGET*ps);
+  assert(!ret);
+  assert(S_resident == N_PAGES);
+
+  ret = ooc_flush_start(2);
+  assert(!ret);
+
+  ts.tv_sec = 0;
+  ts.tv_nsec = 10000000L;
+  for (i=0; i<500 && S_resident*100 >= N_BUDGET*OOC_FLUSH_LOWAT; ++i) {
+    (void)nanosleep(&ts, NULL);
+  }
+  assert(S_resident*100 < N_BUDGET*OOC_FLUSH_LOWAT);
+
+  ooc_sched(&S_check, 1, mem);
+
+  ret = ooc_flush_stop();
+  assert(!ret);
+
+  /* With annotations, inputs are prefetched and outputs neither fault nor
+   * stay dirty once the kernel returns. */
+  ooc_sched(&S_fill, 1, mem);
+  ret = ooc_set_budget(2*N_PAGES*ps);
+  assert(!ret);
+  ret = ooc_stats(&before);
+  assert(!ret);
+  ooc_sched(&S_annotate, 0, mem);
+  ret = ooc_stats(&stats);
+  assert(!ret);
+  assert(stats.rd_faults+stats.wr_faults == before.rd_faults+before.wr_faults);
+  assert(stats.prefetches > before.prefetches);
+  assert(stats.wr_bytes >= before.wr_bytes+N_BUDGET/2*ps);
+  for (i=0; i<N_BUDGET/2; ++i) {
+    assert(!(S_pflags(mem+(N_PAGES/2+(size_t)i)*ps)&OOC_PAGE_DIRTY));
+  }
+
+  /* Without a budget, outputs are not written back early. */
+  ret = ooc_set_budget(0);
+  assert(!ret);
+  ret = ooc_stats(&before);
+  assert(!ret);
+  ooc_sched(&S_annotate, 0, mem);
+  ret = ooc_stats(&stats);
+  assert(!ret);
+  assert(stats.wr_bytes == before.wr_bytes);
+  for (i=0; i<N_BUDGET/2; ++i) {
+    assert(S_pflags(mem+(N_PAGES/2+(size_t)i)*ps)&OOC_PAGE_DIRTY);
+  }
+
+  /* Overwritten pages are not read in, even when they are on disk. */
+  ret = ooc_set_budget(N_BUDGET*ps);
+  assert(!ret);
+  ooc_sched(&S_fill, 1, mem);
+  ret = ooc_set_budget(2*N_PAGES*ps);
+  assert(!ret);
+  ret = ooc_stats(&before);
+  assert(!ret);
+  ooc_sched(&S_overwrite, 2, mem);
+  ret = ooc_stats(&stats);
+  assert(!ret);
+  assert(stats.rd_bytes == before.rd_bytes);
+  assert(stats.rd_faults+stats.wr_faults == before.rd_faults+before.wr_faults);
+  assert(stats.discards >= before.discards+N_PAGES-N_BUDGET);
+  ooc_sched(&S_check, 2, mem);
+
+  /* Neither are the pages of a write-only allocation, but what is written to
+   * it is still read back once the flag is cleared. */
+  ret = ooc_set_budget(N_BUDGET*ps);
+  assert(!ret);
+  ooc_sched(&S_fill, 1, mem);
+  ret = ooc_set_flags(mem, OOC_WRONLY);
+  assert(!ret);
+  ret = ooc_stats(&before);
+  assert(!ret);
+  ooc_sched(&S_fill, 3, mem);
+  ret = ooc_stats(&stats);
+  assert(!ret);
+  assert(stats.rd_bytes == before.rd_bytes);
+  assert(stats.discards > before.discards);
+  ret = ooc_set_flags(mem, 0);
+  assert(!ret);
+  ooc_sched(&S_check, 3, mem);
+
+  ooc_free(mem);
+  assert(0 == S_resident);
+
+  ret = ooc_finalize();
+  assert(!ret);
+
+  return EXIT_SUCCESS;
+}
+#endif
@@ -67,18 +67,273 @@ THE SOFTWARE.
 #define __ooc_decl                  __ooc_decl_scope
 
 
+/*! Number of buckets in a latency histogram of struct ooc_stats. */
+#define OOC_STATS_HIST 32
+
+/*! Lock classes of struct ooc_stats. Lock statistics are only recorded if the
+ *  library is compiled with OOC_LOCK_STATS defined. */
+#define OOC_LOCK_OTHER      0
+#define OOC_LOCK_VMA        1 /* per-VMA lock */
+#define OOC_LOCK_TREE       2 /* VMA splay-tree lock */
+#define OOC_LOCK_BLOCK      3 /* vma allocator locks ... */
+#define OOC_LOCK_SUPERBLOCK 4 /* ... */
+#define OOC_LOCK_MPOOL      5 /* ... */
+#define OOC_LOCK_GPOOL      6 /* ... */
+#define OOC_LOCK_CLASSES    7
+
+/*! Runtime statistics, aggregated over all threads by ooc_stats(). Bucket i of
+ *  a latency histogram counts latencies in [2^i,2^(i+1)) nanoseconds, except
+ *  for the last bucket, which also counts all larger latencies. */
+struct ooc_stats
+{
+  unsigned long long rd_faults;     /* faults which made a page readable */
+  unsigned long long wr_faults;     /* faults which made a page writable */
+  unsigned long long mn_faults;     /* faults serviced without I/O */
+  unsigned long long mj_faults;     /* faults serviced by reading from disk */
+  unsigned long long rd_shared;     /* faults which waited for another's read */
+  unsigned long long prefetches;    /* pages read in ahead of their faults */
+  unsigned long long discards;      /* on-disk pages zero-filled, not read */
+  unsigned long long rd_bytes;      /* bytes read from the backing store */
+  unsigned long long wr_bytes;      /* bytes written to the backing store */
+  unsigned long long evictions;     /* pages evicted */
+  unsigned long long switches;      /* switches into a fiber */
+  unsigned long long steals;        /* ooc_parallel_for() ranges stolen */
+  unsigned long long io_depth;      /* I/O requests in flight */
+  unsigned long long io_depth_max;  /* maximum I/O requests in flight */
+  unsigned long long fault_ns[OOC_STATS_HIST]; /* fault-service latency */
+  unsigned long long io_ns[OOC_STATS_HIST];    /* I/O request latency */
+  struct
+  {
+    unsigned long long acquired;    /* acquisitions */
+    unsigned long long contended;   /* acquisitions which had to wait */
+    unsigned long long wait_ns;     /* time spent waiting to acquire */
+    unsigned long long hold_ns;     /* time spent holding */
+  } locks[OOC_LOCK_CLASSES];
+};
+
+
+/*! Maximum number of address ranges in the footprint of an iteration. */
+#define OOC_FOOTPRINT_RANGES 8
+
+/*! An address range in the footprint of an iteration. A footprint callback,
+ *  see ooc_footprint(), fills in at most nr ranges which iteration i of the
+ *  kernel will access, and returns the number filled in. */
+struct ooc_range
+{
+  void * addr;
+  size_t len;
+};
+
+
+/*! Access modes of ooc_access(). */
+#define OOC_READ    0x1
+#define OOC_WRITE   0x2
+#define OOC_DISCARD 0x4 /* whole pages are overwritten, never read them in */
+
+/*! Declare, from within a kernel iteration, that it reads or writes the n
+ *  elements starting at p. Inputs are prefetched, and outputs are made
+ *  writable without faulting. If a memory budget is set, the pages which lie
+ *  entirely within an output are written back as soon as the iteration
+ *  returns, so that evicting them later is cheap. */
+#define ooc_reads(p, n)  ooc_access((void*)(p), (n)*sizeof(*(p)), OOC_READ)
+#define ooc_writes(p, n) ooc_access((void*)(p), (n)*sizeof(*(p)), OOC_WRITE)
+
+/*! Declare, from within a kernel iteration, that it overwrites the n elements
+ *  starting at p, without reading them first. The pages which lie entirely
+ *  within the range are mapped zero-filled and writable, rather than read from
+ *  the backing store. */
+#define ooc_overwrites(p, n)\
+  ooc_access((void*)(p), (n)*sizeof(*(p)), OOC_WRITE|OOC_DISCARD)
+
+/*! Allocation flags of ooc_set_flags(). While an allocation is OOC_WRONLY, a
+ *  fault on a page which is not resident maps it zero-filled and writable,
+ *  without reading the backing store, i.e., its previous contents are
+ *  discarded. Clear the flag before reading the allocation back. */
+#define OOC_WRONLY 0x1
+
+/*! Budget broker. The processes of a node which have called ooc_broker_join()
+ *  share the limit given by the first of them to join while none of the others
+ *  is alive, in bytes, or, if it gave 0, OOC_BROKER_SHARE percent of physical
+ *  memory. Later processes do not change the limit. Each publishes its demand,
+ *  i.e., how much it has allocated, capped by ooc_set_budget(), and an
+ *  estimate of its working set, and its budget is rebalanced periodically, so
+ *  that together they stay within the limit. Until ooc_broker_leave(), the
+ *  assigned budget replaces that of ooc_set_budget(). A process applies its
+ *  budget as it faults, or from its flushers, which a process that may sit
+ *  idle should start. The budgets of shared regions are not brokered. */
+
+
+/*! Shared regions. ooc_shm_open() returns a descriptor of the region called
+ *  name, creating it with size bytes if no process has, and
+ *  ooc_malloc_shared() maps the region of a descriptor into the calling
+ *  process, as memory which ooc_free() releases. Every process which maps a
+ *  region shares its resident pages, and ooc_shm_set_budget() sets the memory
+ *  budget of the region for all of them. A region is opened by name through
+ *  its creator, while it keeps its descriptor open, or through any process
+ *  which has it mapped. If such processes are alive, but the region cannot be
+ *  opened through any of them, ooc_shm_open() fails with errno EBUSY; the
+ *  region is only replaced once all of them have exited. A child process must
+ *  map the region itself, rather than use a mapping inherited across fork(). */
+
+
+/*! Maximum number of data handles of a task. */
+#define OOC_TASK_DATA 8
+
+/*! A data handle of a task, i.e., an address range which the task accesses
+ *  with mode, a combination of the ooc_access() modes. ooc_task() adds a task,
+ *  which runs kern(i, args) on a fiber, to a graph, ordered after the tasks
+ *  added before it whose handles conflict with its own. ooc_task_wait() runs
+ *  the graph and releases it. kern is a plain function, rather than one
+ *  defined with __ooc_defn, and it must not add tasks. */
+struct ooc_data
+{
+  void * addr;
+  size_t len;
+  int mode;
+};
+
+
+/*! ooc_yield() suspends the fiber of the calling kernel, so that ooc_sched()
+ *  can start another iteration on the thread. A yielded fiber is resumed by
+ *  later calls to ooc_sched() and ooc_wait(), so ooc_sched() may return before
+ *  its iteration has completed. ooc_wait() resumes the thread's yielded fibers
+ *  until they have all completed. */
+
+/*! Fiber-aware synchronization primitives. A kernel which blocks on one of
+ *  them yields its fiber, see ooc_yield(), rather than blocking its thread, so
+ *  that the thread's other fibers can run in the meantime. They may also be
+ *  used outside of a kernel, and between threads. A zero initialized
+ *  primitive is an unlocked mutex, a condition variable, or a barrier which
+ *  must still be given its count with ooc_barrier_init(). */
+struct ooc_mutex
+{
+  int lock;
+};
+
+struct ooc_cond
+{
+  unsigned int seq;         /* incremented by each signal */
+};
+
+struct ooc_barrier
+{
+  unsigned int count;       /* fibers which must arrive */
+  unsigned int arrived;     /* fibers which have arrived */
+  unsigned int gen;         /* incremented as the last one arrives */
+};
+
+/*! Return value of ooc_barrier_wait() in exactly one of the fibers. */
+#define OOC_BARRIER_SERIAL 1
+
+
+/*! Trace event types, see ooc_trace_dump(). */
+#define OOC_TRACE_FAULT_BEG 1 /* arg is the faulting address */
+#define OOC_TRACE_FAULT_END 2 /* ... */
+#define OOC_TRACE_IO_BEG    3 /* arg is the request size in bytes */
+#define OOC_TRACE_IO_END    4 /* ... */
+#define OOC_TRACE_SWITCH    5 /* arg is the fiber switched to, or ... */
+#define OOC_TRACE_MAIN      0xFFFFFFFFU /* ... this for the main context */
+#define OOC_TRACE_EVICT     6 /* arg is the number of pages evicted */
+
+/*! Trace file format, as written by ooc_trace_dump(). The file starts with a
+ *  struct ooc_trace_head, which is followed, for each thread, by a struct
+ *  ooc_trace_thread and then its events, oldest first. */
+#define OOC_TRACE_MAGIC   "OOCTRACE"
+#define OOC_TRACE_VERSION 1
+
+struct ooc_trace_head
+{
+  char magic[8];
+  unsigned int version;
+  unsigned int size;        /* sizeof(struct ooc_trace_event) */
+};
+
+struct ooc_trace_thread
+{
+  unsigned int tid;
+  unsigned int nr;          /* number of events which follow */
+};
+
+struct ooc_trace_event
+{
+  unsigned long long ts;    /* monotonic time stamp in nanoseconds */
+  unsigned long long arg;
+  unsigned int type;
+  unsigned int fiber;
+};
+
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+/* broker.c */
+int ooc_broker_join(size_t const limit);
+int ooc_broker_leave(void);
+
+
+/* flush.c */
+int ooc_set_budget(size_t const size);
+int ooc_flush_start(unsigned int const nr);
+int ooc_flush_stop(void);
+
+
 /* malloc.c */
 void * ooc_malloc(size_t const size);
 void ooc_free(void * ptr);
+int ooc_set_flags(void * const ptr, unsigned long const flags);
+
+
+/* shm.c */
+int ooc_shm_open(char const * const name, size_t const size);
+void * ooc_malloc_shared(int const fd);
+int ooc_shm_set_budget(void * const ptr, size_t const size);
+
+
+/* parallel.c */
+int ooc_parallel_for(void (*kern)(size_t const, void * const),
+                     size_t const begin, size_t const end, size_t const grain,
+                     void * const args);
+int ooc_footprint(void (*kern)(size_t const, void * const),
+                  size_t (*fp)(size_t const, void * const,
+                               struct ooc_range * const, size_t const));
+
+
+/* task.c */
+int ooc_task(void (*kern)(size_t const, void * const), size_t const i,
+             void * const args, struct ooc_data const * const data,
+             size_t const nr);
+int ooc_task_wait(void);
+
+
+/* stats.c */
+int ooc_stats(struct ooc_stats * const stats);
+
+
+/* trace.c */
+int ooc_trace_dump(char const * const fname);
 
 
 /* sched.c */
+void ooc_access(void * const addr, size_t const len, int const mode);
 void ooc_sched(void (*kern)(size_t const, void * const), size_t const i,
                void * const args);
+void ooc_wait(void);
+void ooc_yield(void);
+
+
+/* sync.c */
+int ooc_mutex_init(struct ooc_mutex * const mutex);
+int ooc_mutex_lock(struct ooc_mutex * const mutex);
+int ooc_mutex_trylock(struct ooc_mutex * const mutex);
+int ooc_mutex_unlock(struct ooc_mutex * const mutex);
+int ooc_cond_init(struct ooc_cond * const cond);
+int ooc_cond_wait(struct ooc_cond * const cond, struct ooc_mutex * const mutex);
+int ooc_cond_signal(struct ooc_cond * const cond);
+int ooc_cond_broadcast(struct ooc_cond * const cond);
+int ooc_barrier_init(struct ooc_barrier * const barrier,
+                     unsigned int const count);
+int ooc_barrier_wait(struct ooc_barrier * const barrier);
 
 #ifdef __cplusplus
 }
@@ -88,7 +343,11 @@ void ooc_sched(void (*kern)(size_t const, void * const), size_t const i,
 /*----------------------------------------------------------------------------*/
 
 
-/* TODO remove after transparent finalization is implemented. */
+/* The library is finalized transparently at exit. ooc_finalize() stops the
+ * worker and flusher threads earlier and removes the SIGSEGV handler, though
+ * not before every allocation has been freed, since their faults must still be
+ * handled; it may be called from any thread, and the library is initialized
+ * again by its next use. */
 int ooc_finalize(void);
 #define OOC_FINAL \
   {\
@@ -0,0 +1,228 @@
+/*
+Copyright (c) 2016 Jeremy Iverson
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+
+/* assert */
+#include <assert.h>
+
+/* FUTEX_WAIT_PRIVATE, FUTEX_WAKE_PRIVATE */
+#include <linux/futex.h>
+
+/* INT_MAX */
+#include <limits.h>
+
+/* uintptr_t */
+#include <stdint.h>
+
+/* NULL */
+#include <stdlib.h>
+
+/* SYS_futex */
+#include <sys/syscall.h>
+
+/* syscall */
+#include <unistd.h>
+
+/* OOC_LOCK_* */
+#include "include/ooc.h"
+
+/* */
+#include "common.h"
+
+
+/*
+ *  The in-flight table holds one entry per page which is currently being
+ *  read from the backing store. The faulting thread which issues the read
+ *  registers it with inflight_begin() while it holds the page lock. Other
+ *  faults on the same page find the page locked and, instead of spinning on
+ *  the page lock for the duration of the I/O, look the page up here and
+ *  sleep until inflight_end() wakes them, after which they find the page
+ *  resident. Entries live on the stack of the issuing fault, since the table
+ *  is used from within the SIGSEGV handler, so inflight_end() does not return
+ *  until every waiter has detached from its entry.
+ */
+
+
+/*! Table of in-flight reads, hashed by page. */
+static struct
+{
+  lock_t lock;
+  struct inflight * head;
+} S_table[OOC_INFLIGHT_SIZE];
+
+
+/*! Hash a page address to a bucket. */
+static size_t
+S_hash(void * const addr)
+{
+  uintptr_t page;
+
+  page = (uintptr_t)addr/(uintptr_t)OOC_PAGE_SIZE;
+
+  return (size_t)((page*UINT64_C(0x9E3779B97F4A7C15))>>32)%OOC_INFLIGHT_SIZE;
+}
+
+
+void
+inflight_begin(struct inflight * const req, void * const addr)
+{
+  int ret;
+  size_t h;
+
+  req->addr  = addr;
+  req->done  = 0;
+  req->nwait = 0;
+
+  h = S_hash(addr);
+
+  ret = lock_get(&(S_table[h].lock));
+  assert(!ret);
+
+  req->next = S_table[h].head;
+  S_table[h].head = req;
+
+  ret = lock_let(&(S_table[h].lock));
+  assert(!ret);
+}
+
+
+void
+inflight_end(struct inflight * const req)
+{
+  int ret;
+  size_t h;
+  struct inflight ** p;
+
+  h = S_hash(req->addr);
+
+  ret = lock_get(&(S_table[h].lock));
+  assert(!ret);
+
+  /* Remove req from its bucket, so that no more waiters attach to it. */
+  for (p=&(S_table[h].head); *p!=req; p=&((*p)->next)) {
+    assert(NULL != *p);
+  }
+  *p = req->next;
+
+  ret = lock_let(&(S_table[h].lock));
+  assert(!ret);
+
+  /* Wake all waiters. */
+  __sync_lock_test_and_set(&(req->done), 1);
+  (void)syscall(SYS_futex, &(req->done), FUTEX_WAKE_PRIVATE, INT_MAX, NULL,\
+    NULL, 0);
+
+  /* req lives on the caller's stack, so wait for the waiters to detach. */
+  while (*(int volatile*)&(req->nwait)) {
+    __sync_synchronize();
+  }
+}
+
+
+int
+inflight_wait(void * const addr)
+{
+  int ret;
+  size_t h;
+  struct inflight * req;
+
+  h = S_hash(addr);
+
+  ret = lock_get(&(S_table[h].lock));
+  assert(!ret);
+
+  for (req=S_table[h].head; NULL!=req && req->addr!=addr; req=req->next);
+  if (NULL != req) {
+    (void)__sync_fetch_and_add(&(req->nwait), 1);
+  }
+
+  ret = lock_let(&(S_table[h].lock));
+  assert(!ret);
+
+  if (NULL == req) {
+    return -1;
+  }
+
+  while (!*(int volatile*)&(req->done)) {
+    (void)syscall(SYS_futex, &(req->done), FUTEX_WAIT_PRIVATE, 0, NULL, NULL,\
+      0);
+  }
+
+  (void)__sync_fetch_and_sub(&(req->nwait), 1);
+  /* req may no longer be accessed. */
+
+  return 0;
+}
+
+
+#ifdef TEST
+/* assert */
+#include <assert.h>
+
+/* EXIT_SUCCESS */
+#include <stdlib.h>
+
+/* omp_get_thread_num */
+#include <omp.h>
+
+#define N_THREAD 4
+
+int
+main(void)
+{
+  int ret, woken=0;
+  char * page=(char*)(uintptr_t)(4*OOC_PAGE_SIZE);
+  struct inflight req;
+
+  /* Nothing is in flight. */
+  ret = inflight_wait(page);
+  assert(ret);
+
+  /* One reader, and N_THREAD-1 waiters. */
+  inflight_begin(&req, page);
+
+  #pragma omp parallel num_threads(N_THREAD)
+  {
+    if (0 == omp_get_thread_num()) {
+      /* Give the waiters a chance to attach. */
+      while (*(int volatile*)&(req.nwait) < N_THREAD-1) {
+        __sync_synchronize();
+      }
+      assert(!woken);
+      inflight_end(&req);
+      assert(0 == req.nwait);
+    }
+    else {
+      ret = inflight_wait(page);
+      assert(!ret);
+      (void)__sync_fetch_and_add(&woken, 1);
+    }
+  }
+  assert(N_THREAD-1 == woken);
+
+  /* The completed read is no longer in the table. */
+  ret = inflight_wait(page);
+  assert(ret);
+
+  return EXIT_SUCCESS;
+}
+#endif
@@ -0,0 +1,177 @@
+/*
+Copyright (c) 2016 Jeremy Iverson
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+
+/* FUTEX_WAIT_PRIVATE, FUTEX_WAKE_PRIVATE */
+#include <linux/futex.h>
+
+/* SYS_futex */
+#include <sys/syscall.h>
+
+/* syscall */
+#include <unistd.h>
+
+/* OOC_LOCK_* */
+#include "include/ooc.h"
+
+/* */
+#include "common.h"
+
+
+/*! Hint to the processor that this is a spin-wait loop. */
+static inline void
+S_pause(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+  __asm__ __volatile__("pause" ::: "memory");
+#else
+  __sync_synchronize();
+#endif
+}
+
+
+/*! The lock word, read afresh on each access. */
+#define S_STATE(lock) (*(int volatile*)&((lock)->state))
+
+
+int
+lock_raw_wait(lock_raw_t * const lock)
+{
+  int i, c, spin, max;
+
+  /* Spin for at most twice the recent number of iterations needed to acquire
+   * the lock, as in glibc's adaptive mutexes. The estimate is a heuristic, so
+   * racy updates to it by concurrent waiters are harmless. */
+  spin = lock->spin;
+  if ((max=2*spin+10) > OOC_LOCK_SPIN) {
+    max = OOC_LOCK_SPIN;
+  }
+
+  for (i=0; i<max; ++i) {
+    S_pause();
+    if (0 == S_STATE(lock) &&\
+        __sync_bool_compare_and_swap(&(lock->state), 0, 1))
+    {
+      lock->spin = spin+(i-spin)/8;
+      return 0;
+    }
+  }
+  lock->spin = spin+(max-spin)/8;
+
+  /* Mark the lock as contended and sleep until it is released. Once a waiter
+   * has slept, it must leave the lock marked as contended when it acquires it,
+   * since there may be other waiters. */
+  while (0 != (c=__sync_lock_test_and_set(&(lock->state), 2))) {
+    (void)syscall(SYS_futex, &(lock->state), FUTEX_WAIT_PRIVATE, 2, NULL,\
+      NULL, 0);
+  }
+
+  return 0;
+}
+
+
+int
+lock_raw_wake(lock_raw_t * const lock)
+{
+  /* The lock was contended, so release it and wake one waiter. */
+  __sync_lock_release(&(lock->state));
+  (void)syscall(SYS_futex, &(lock->state), FUTEX_WAKE_PRIVATE, 1, NULL, NULL,\
+    0);
+
+  return 0;
+}
+
+
+#ifdef TEST
+/* assert */
+#include <assert.h>
+
+/* pthread_t, pthread_create, pthread_join */
+#include <pthread.h>
+
+/* NULL, EXIT_SUCCESS */
+#include <stdlib.h>
+
+#define N_THREAD 4
+#define N_ITER   100000
+
+static lock_t S_lock;
+static unsigned long S_ctr;
+
+static void *
+S_worker(void * const arg)
+{
+  int ret, i;
+
+  for (i=0; i<N_ITER; ++i) {
+    ret = lock_get(&S_lock);
+    assert(!ret);
+    S_ctr++;
+    ret = lock_let(&S_lock);
+    assert(!ret);
+  }
+
+  return arg;
+}
+
+int
+main(void)
+{
+  int ret, i;
+  lock_t lock;
+  pthread_t thread[N_THREAD];
+
+  /* Locks are padded to a cache line. */
+  assert(OOC_CACHE_LINE == sizeof(lock_raw_t));
+
+  /* Uncontended acquire and release. */
+  ret = lock_init(&lock);
+  assert(!ret);
+  assert(!lock_try(&lock));
+  assert(lock_try(&lock));
+  ret = lock_let(&lock);
+  assert(!ret);
+  ret = lock_get(&lock);
+  assert(!ret);
+  ret = lock_let(&lock);
+  assert(!ret);
+  ret = lock_free(&lock);
+  assert(!ret);
+
+  /* Contended acquire and release from plain pthreads, using a zero
+   * initialized lock. */
+  for (i=0; i<N_THREAD; ++i) {
+    ret = pthread_create(&(thread[i]), NULL, &S_worker, NULL);
+    assert(!ret);
+  }
+  for (i=0; i<N_THREAD; ++i) {
+    ret = pthread_join(thread[i], NULL);
+    assert(!ret);
+  }
+  assert((unsigned long)N_THREAD*N_ITER == S_ctr);
+  assert(!lock_try(&S_lock));
+  ret = lock_let(&S_lock);
+  assert(!ret);
+
+  return EXIT_SUCCESS;
+}
+#endif
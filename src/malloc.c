@@ -49,41 +49,71 @@ ooc_malloc(size_t const size)
 {
   int ret;
   size_t info_sz, data_sz, mmap_sz;
+  void * info;
   struct vm_area * vma;
 
-  /* Compute segment sizes. */
+  /* Faults on the memory must be handled, whichever thread touches it. */
+  if (sched_init()) {
+    goto fn_fail;
+  }
+
+  /* Compute segment sizes. The info segment holds one flag byte per page. */
   data_sz = ALIGN(size);
-  info_sz = ALIGN(sizeof(struct vm_area));
+  info_sz = ALIGN(data_sz/(size_t)OOC_PAGE_SIZE);
   mmap_sz = info_sz+data_sz;
 
   /* Allocate memory for new vma with read-only protection. */
-  vma = mmap(NULL, mmap_sz, PROT_READ, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
-  if (MAP_FAILED == vma) {
+  info = mmap(NULL, mmap_sz, PROT_READ, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+  if (MAP_FAILED == info) {
     goto fn_fail;
   }
 
   /* Make info segment readable and writeable. */
-  ret = mprotect(vma, info_sz, PROT_READ|PROT_WRITE);
+  ret = mprotect(info, info_sz, PROT_READ|PROT_WRITE);
   if (ret) {
     goto fn_cleanup;
   }
 
+  /* Get new vma. */
+  vma = vma_alloc();
+  if (NULL == vma) {
+    goto fn_cleanup;
+  }
+
   /* Setup vma */
-  vma->vm_start = (void*)((char*)vma+info_sz);
-  vma->vm_end   = (void*)((char*)vma->vm_start+size);
+  vma->vm_flags  = 0;
+  vma->vm_start  = (void*)((char*)info+info_sz);
+  vma->vm_end    = (void*)((char*)vma->vm_start+size);
+  vma->vm_pflags = (unsigned char*)info;
+  vma->vm_off    = swap_alloc(data_sz);
+  vma->vm_shm    = NULL;
+
+  /* Claim faults on the data segment. */
+  ret = sched_range_add(vma->vm_start, vma->vm_end);
+  if (ret) {
+    swap_free(vma->vm_off, data_sz);
+    vma_free(vma);
+    goto fn_cleanup;
+  }
 
   /* Insert new vma into page table. */
   ret = sp_tree_insert(&vma_tree, vma);
   if (ret) {
+    sched_range_del(vma->vm_start);
+    swap_free(vma->vm_off, data_sz);
+    vma_free(vma);
     goto fn_cleanup;
   }
 
+  /* Account for the demand of the process. */
+  broker_alloc(data_sz/(size_t)OOC_PAGE_SIZE);
+
   /* Return pointer to data segment. */
   return vma->vm_start;
 
   fn_cleanup:
   /* Deallocate memory that was allocated for new vma. */
-  ret = munmap(vma, mmap_sz);
+  ret = munmap(info, mmap_sz);
   assert(!ret);
 
   fn_fail:
@@ -96,38 +126,239 @@ void
 ooc_free(void * ptr)
 {
   int ret;
-  size_t info_sz, data_sz, mmap_sz;
+  size_t info_sz, data_sz, mmap_sz, off, ip, nr;
+  void * info;
   struct vm_area * vma;
 
   /* Find the node corresponding to the offending address. */
   ret = sp_tree_find_and_lock(&vma_tree, ptr, (void*)&vma);
   assert(!ret);
 
-  /* Remove from splay tree. This will be fast, since sp_tree_find_and_lock will
-   * splay vma to top of tree. */
-  ret = sp_tree_remove(&vma_tree, vma->vm_start);
-  assert(!ret);
+  if (vma->vm_shm) {
+    shm_free(vma);
+    return;
+  }
 
   /* Compute segment sizes. */
   data_sz = ALIGN((uintptr_t)vma->vm_end-(uintptr_t)vma->vm_start);
-  info_sz = ALIGN(sizeof(struct vm_area));
+  info_sz = ALIGN(data_sz/(size_t)OOC_PAGE_SIZE);
   mmap_sz = info_sz+data_sz;
+  info    = vma->vm_pflags;
+  off     = vma->vm_off;
+
+  /* Count resident pages. Each page is locked first, to wait for the flusher,
+   * which does not hold the vma lock while it works on locked pages. */
+  for (nr=0,ip=0; ip<data_sz/(size_t)OOC_PAGE_SIZE; ++ip) {
+    page_lock(vma, ip);
+    nr += (vma->vm_pflags[ip]&OOC_PAGE_SYNC) ? 1 : 0;
+  }
+  flush_uncharge(vma, nr);
+
+  /* Remove from splay tree. This will be fast, since sp_tree_find_and_lock will
+   * splay vma to top of tree. This releases vma. */
+  ret = sp_tree_remove(&vma_tree, ptr);
+  assert(!ret);
+
+  /* Faults on the memory are no longer ours. */
+  sched_range_del((char*)info+info_sz);
+
+  /* Release backing store. */
+  swap_free(off, data_sz);
+  broker_free(data_sz/(size_t)OOC_PAGE_SIZE);
+
+  /* Deallocate memory for vma. */
+  ret = munmap(info, mmap_sz);
+  assert(!ret);
+}
+
 
-  /* Allocate memory for new vma. */
-  ret = munmap(vma, mmap_sz);
+int
+ooc_set_flags(void * const ptr, unsigned long const flags)
+{
+  int ret;
+  struct vm_area * vma;
+
+  ret = sp_tree_find_and_lock(&vma_tree, ptr, (void*)&vma);
   assert(!ret);
+
+  if (vma->vm_pflags) {
+    vma->vm_flags = flags;
+  }
+  else {
+    /* Not an ooc_malloc() allocation. */
+    ret = -1;
+  }
+
+  if (lock_let(&(vma->vm_lock))) {
+    ret = -1;
+  }
+
+  return ret;
 }
 
 
 #ifdef TEST
-/* EXIT_SUCCESS */
+/* assert */
+#include <assert.h>
+
+/* EXIT_SUCCESS, malloc, free */
 #include <stdlib.h>
 
-struct sp_tree vma_tree;
+/* pthread_create, pthread_join */
+#include <pthread.h>
+
+/* struct sigaction, sigaction */
+#include <signal.h>
+
+/* memset */
+#include <string.h>
+
+#define N_PAGES  8
+#define N_THREAD 4
+#define N_ALLOCS 2500
+
+/* Faults passed on to the handler which was installed before the library's,
+ * and the guard page which it unprotects. */
+static volatile sig_atomic_t S_foreign=0;
+static char * S_guard;
+
+static void
+S_foreign_handler(int const sig, siginfo_t * const si, void * const uc)
+{
+  int ret;
+
+  assert(SIGSEGV == sig);
+  assert(S_guard == si->si_addr);
+
+  ret = mprotect(S_guard, (size_t)OOC_PAGE_SIZE, PROT_READ|PROT_WRITE);
+  assert(!ret);
+  S_foreign++;
+
+  if (uc) {}
+}
+
+/* Touch each page, from a thread which has never called ooc_sched(). */
+static void *
+S_touch(void * const arg)
+{
+  size_t ps, ip;
+  char * mem;
+
+  ps  = (size_t)OOC_PAGE_SIZE;
+  mem = (char*)arg;
+
+  for (ip=0; ip<N_PAGES; ++ip) {
+    mem[ip*ps] = (char)ip;
+    assert((char)ip == mem[ip*ps]);
+  }
+
+  return NULL;
+}
 
 int
 main(void)
 {
+  int ret, i;
+  char * mem, ** many;
+  pthread_t thread[N_THREAD];
+  struct sigaction act;
+  struct ooc_stats stats;
+
+  /* Another user of guard pages, which installs its handler first. */
+  memset(&act, 0, sizeof(act));
+  act.sa_sigaction = &S_foreign_handler;
+  act.sa_flags = SA_SIGINFO;
+  ret = sigaction(SIGSEGV, &act, NULL);
+  assert(!ret);
+
+  S_guard = mmap(NULL, (size_t)OOC_PAGE_SIZE, PROT_NONE,\
+    MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+  assert(MAP_FAILED != S_guard);
+
+  mem = ooc_malloc(N_PAGES*(size_t)OOC_PAGE_SIZE);
+  assert(mem);
+
+  /* A fault which is not on ooc_malloc() memory is passed on. */
+  S_guard[0] = 1;
+  assert(1 == S_foreign);
+  assert(1 == S_guard[0]);
+
+  /* Faults on several threads at once, none of which has any fibers yet. */
+  for (i=0; i<N_THREAD; ++i) {
+    ret = pthread_create(&(thread[i]), NULL, &S_touch, mem);
+    assert(!ret);
+  }
+  for (i=0; i<N_THREAD; ++i) {
+    ret = pthread_join(thread[i], NULL);
+    assert(!ret);
+  }
+
+  ret = ooc_stats(&stats);
+  assert(!ret);
+  assert(stats.wr_faults >= N_PAGES);
+
+  /* Finalization is idempotent, and the handler is reinstalled by the next
+   * use. */
+  ret = ooc_finalize();
+  assert(!ret);
+  ret = ooc_finalize();
+  assert(!ret);
+  ooc_free(mem);
+
+  mem = ooc_malloc(N_PAGES*(size_t)OOC_PAGE_SIZE);
+  assert(mem);
+  (void)S_touch(mem);
+  ooc_free(mem);
+
+  /* The handler which was replaced is restored by ooc_finalize(). */
+  ret = ooc_finalize();
+  assert(!ret);
+  ret = sigaction(SIGSEGV, NULL, &act);
+  assert(!ret);
+  assert(&S_foreign_handler == act.sa_sigaction);
+
+  /* Faults on an allocation which is live when the library is finalized are
+   * still handled, and the replaced handler is restored once it is freed. */
+  mem = ooc_malloc(N_PAGES*(size_t)OOC_PAGE_SIZE);
+  assert(mem);
+  ret = ooc_finalize();
+  assert(!ret);
+  (void)S_touch(mem);
+  ret = sigaction(SIGSEGV, NULL, &act);
+  assert(!ret);
+  assert(&S_foreign_handler != act.sa_sigaction);
+  ooc_free(mem);
+  ret = sigaction(SIGSEGV, NULL, &act);
+  assert(!ret);
+  assert(&S_foreign_handler == act.sa_sigaction);
+
+  ret = munmap(S_guard, (size_t)OOC_PAGE_SIZE);
+  assert(!ret);
+
+  /* The number of live allocations is not limited, and faults on each are
+   * handled, whichever have been freed. */
+  many = malloc(N_ALLOCS*sizeof(*many));
+  assert(many);
+  for (i=0; i<N_ALLOCS; ++i) {
+    many[i] = ooc_malloc((size_t)OOC_PAGE_SIZE);
+    assert(many[i]);
+  }
+  for (i=0; i<N_ALLOCS; i+=2) {
+    ooc_free(many[i]);
+  }
+  for (i=1; i<N_ALLOCS; i+=2) {
+    many[i][0] = (char)i;
+    assert((char)i == many[i][0]);
+    ooc_free(many[i]);
+  }
+  free(many);
+
+  /* The handler is removed at exit, without calling ooc_finalize(). */
+  mem = ooc_malloc(N_PAGES*(size_t)OOC_PAGE_SIZE);
+  assert(mem);
+  (void)S_touch(mem);
+  ooc_free(mem);
+
   return EXIT_SUCCESS;
 }
-#endif
+#endif
\ No newline at end of file
@@ -0,0 +1,653 @@
+/*
+Copyright (c) 2016 Jeremy Iverson
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+
+#ifndef _GNU_SOURCE
+  #define _GNU_SOURCE /* Expose mremap, MREMAP_* */
+#endif
+
+/* assert */
+#include <assert.h>
+
+/* open, O_RDWR, O_CLOEXEC */
+#include <fcntl.h>
+
+/* pthread_mutex_t, pthread_mutex_lock, pthread_mutex_unlock */
+#include <pthread.h>
+
+/* sched_yield */
+#include <sched.h>
+
+/* size_t */
+#include <stddef.h>
+
+/* uintptr_t */
+#include <stdint.h>
+
+/* mmap, mremap, mprotect, munmap */
+#include <sys/mman.h>
+
+/* pid_t */
+#include <sys/types.h>
+
+/* close, getpid, pwrite */
+#include <unistd.h>
+
+/* struct ooc_stats */
+#include "include/ooc.h"
+
+/* */
+#include "common.h"
+
+
+/*
+ *  Page locks are range locks of single page granularity within a VMA. They
+ *  are kept as the OOC_PAGE_LOCK bit of each page's flags, so they cost no
+ *  memory and a whole range of pages can be locked by locking each page in
+ *  turn. A VMA's vm_lock is only held long enough to find the VMA and lock the
+ *  pages of interest, so that faults on disjoint pages of one VMA, and the
+ *  flusher, proceed in parallel. A thread which faults on a page that is
+ *  being read in by another thread waits for its page lock, and then finds
+ *  the page resident, so both faults are served by a single I/O.
+ */
+
+
+/*
+ *  A page which is read in from the backing store must not become accessible
+ *  until its contents are complete, since only the faulting thread holds its
+ *  page lock, and other threads which touch the page while it is writable do
+ *  not fault. So the page is read into a private ghost page, whose contents
+ *  are written into the target page through /proc/self/mem, which ignores the
+ *  page's protection, so that it stays PROT_NONE until it is complete and is
+ *  then made read-only.
+ *
+ *  Where /proc/self/mem cannot be opened, the ghost page is instead made
+ *  read-only and moved over the target page with mremap(), atomically
+ *  replacing the PROT_NONE page with the complete one. Each page so moved
+ *  becomes a mapping of its own, which does not merge with its neighbours, so
+ *  a process which reads in more pages than vm.max_map_count (65530 by
+ *  default) allows runs out of mappings, after which page_read() fails rather
+ *  than expose incomplete pages.
+ */
+
+
+/*! Number of times that page_lock() spins before yielding the processor. */
+#define S_SPIN 128
+
+/*! Maximum number of pages that page_prefetch() and page_dirty() lock at a
+ *  time. */
+#define S_PREFETCH 64
+
+/*! Descriptor of /proc/self/mem, or -1, and the process which opened it, since
+ *  a child inherits the descriptor, which refers to the memory of its parent,
+ *  and must open its own. */
+static int S_mem_fd=-1;
+static pid_t S_mem_pid=0;
+static pthread_mutex_t S_mem_lock=PTHREAD_MUTEX_INITIALIZER;
+
+/*! Whether page_dirty() applies to a page with flags f, i.e., it is resident
+ *  and clean, or it has never been written, or it is not resident and its
+ *  contents are being discarded. */
+#define S_DIRTYABLE(f, discard)\
+  (OOC_PAGE_SYNC == ((f)&(OOC_PAGE_SYNC|OOC_PAGE_DIRTY)) ||\
+   0 == ((f)&(OOC_PAGE_SYNC|OOC_PAGE_ONDISK)) ||\
+   ((discard) && !((f)&OOC_PAGE_SYNC)))
+
+
+int
+page_trylock(struct vm_area * const vma, size_t const ip)
+{
+  return __sync_fetch_and_or(&(vma->vm_pflags[ip]), OOC_PAGE_LOCK)&\
+    OOC_PAGE_LOCK;
+}
+
+
+void
+page_lock(struct vm_area * const vma, size_t const ip)
+{
+  int i;
+
+  for (i=0; page_trylock(vma, ip); ++i) {
+    /* Wait for the page to appear unlocked before trying again. Pages are
+     * locked across I/O, so yield once spinning has not been enough. */
+    while ((*(unsigned char volatile*)&(vma->vm_pflags[ip]))&OOC_PAGE_LOCK) {
+      if (++i > S_SPIN) {
+        (void)sched_yield();
+      }
+    }
+  }
+}
+
+
+void
+page_unlock(struct vm_area * const vma, size_t const ip)
+{
+  assert(vma->vm_pflags[ip]&OOC_PAGE_LOCK);
+
+  (void)__sync_fetch_and_and(&(vma->vm_pflags[ip]),\
+    (unsigned char)~OOC_PAGE_LOCK);
+}
+
+
+/*! Descriptor of /proc/self/mem for the calling process, or -1 if it cannot
+ *  be opened. */
+static int
+S_mem_open(void)
+{
+  int ret, fd;
+  pid_t pid;
+
+  pid = getpid();
+  if (pid == *(pid_t volatile*)&S_mem_pid) {
+    return *(int volatile*)&S_mem_fd;
+  }
+
+  ret = pthread_mutex_lock(&S_mem_lock);
+  assert(!ret);
+
+  if (pid != S_mem_pid) {
+    if (-1 != S_mem_fd) {
+      (void)close(S_mem_fd);
+    }
+    S_mem_fd = open("/proc/self/mem", O_RDWR|O_CLOEXEC);
+    __sync_synchronize();
+    S_mem_pid = pid;
+  }
+  fd = S_mem_fd;
+
+  ret = pthread_mutex_unlock(&S_mem_lock);
+  assert(!ret);
+
+  return fd;
+}
+
+
+int
+page_read(void * const addr, size_t const nr, size_t const off)
+{
+  int ret, fd;
+  size_t len;
+  void * ghost;
+
+  len = nr*(size_t)OOC_PAGE_SIZE;
+
+  ghost = mmap(NULL, len, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1,\
+               0);
+  if (MAP_FAILED == ghost) {
+    return -1;
+  }
+
+  ret = swap_read(ghost, len, off);
+  if (ret) {
+    goto unmap;
+  }
+
+  /* Fill the pages while they are still inaccessible. */
+  if (-1 != (fd=S_mem_open()) &&\
+      (ssize_t)len == pwrite(fd, ghost, len, (off_t)(uintptr_t)addr))
+  {
+    ret = mprotect(addr, len, PROT_READ);
+    goto unmap;
+  }
+
+  ret = mprotect(ghost, len, PROT_READ);
+  if (ret) {
+    goto unmap;
+  }
+
+  /* The move fails once the process has run out of mappings, in which case
+   * the pages are left inaccessible. */
+  if (MAP_FAILED != mremap(ghost, len, len, MREMAP_MAYMOVE|MREMAP_FIXED,\
+                           addr))
+  {
+    return 0;
+  }
+  ret = -1;
+
+  unmap:
+  if (munmap(ghost, len)) {
+    ret = -1;
+  }
+
+  return ret;
+}
+
+
+/*! Apply fn to each VMA overlapping [addr,addr+len), with the VMA locked and
+ *  the range clipped to page indices [beg,end) of the VMA. fn unlocks the VMA
+ *  and returns the index of the first page that it did not process, which is
+ *  looked up again. Memory which the library does not manage is skipped. */
+static void
+S_page_walk(void * const addr, size_t const len,
+            size_t (*fn)(struct vm_area * const, size_t const, size_t const,\
+                         void * const),
+            void * const arg)
+{
+  int ret;
+  size_t ps;
+  uintptr_t p, e, vs, ve;
+  struct vm_area * vma;
+
+  ps = (size_t)OOC_PAGE_SIZE;
+  p  = (uintptr_t)addr&~(uintptr_t)(ps-1);
+  e  = (uintptr_t)addr+len;
+
+  while (p < e) {
+    /* Memory which the library does not manage is skipped. */
+    if (sp_tree_find_first_and_lock(&vma_tree, (void*)p, (void*)&vma)) {
+      break;
+    }
+    if ((uintptr_t)vma->vm_start >= e) {
+      ret = lock_let(&(vma->vm_lock));
+      assert(!ret);
+      break;
+    }
+    if ((uintptr_t)vma->vm_start > p) {
+      p = (uintptr_t)vma->vm_start;
+    }
+
+    vs = (uintptr_t)vma->vm_start;
+    ve = (uintptr_t)vma->vm_end < e ? (uintptr_t)vma->vm_end : e;
+
+    if (vma->vm_pflags) {
+      p = vs+fn(vma, (p-vs)/ps, (ve-vs+ps-1)/ps, arg)*ps;
+    }
+    else {
+      p = (uintptr_t)vma->vm_end;
+
+      ret = lock_let(&(vma->vm_lock));
+      assert(!ret);
+    }
+  }
+}
+
+
+/*! Count the pages [beg,end) of vma which are not resident. */
+static size_t
+S_page_missing(struct vm_area * const vma, size_t const beg, size_t const end,
+               void * const arg)
+{
+  int ret;
+  size_t ip;
+
+  for (ip=beg; ip<end; ++ip) {
+    if (!(vma->vm_pflags[ip]&OOC_PAGE_SYNC)) {
+      (*(size_t*)arg)++;
+    }
+  }
+
+  ret = lock_let(&(vma->vm_lock));
+  assert(!ret);
+
+  return end;
+}
+
+
+/*! Read in those of up to S_PREFETCH pages [beg,end) of vma which are on
+ *  disk. */
+static size_t
+S_page_prefetch(struct vm_area * const vma, size_t const beg, size_t end,
+                void * const arg)
+{
+  int ret;
+  size_t ps, ip, jp, off;
+  unsigned long long mask=0;
+  char * addr;
+
+  ps   = (size_t)OOC_PAGE_SIZE;
+  addr = (char*)vma->vm_start;
+  off  = vma->vm_off;
+
+  /* The contents of write-only memory are never read in. */
+  if (vma->vm_flags&OOC_WRONLY) {
+    ret = lock_let(&(vma->vm_lock));
+    assert(!ret);
+    return end;
+  }
+
+  if (end-beg > S_PREFETCH) {
+    end = beg+S_PREFETCH;
+  }
+
+  /* Lock the pages to read in, skipping any which are busy, so that vma can be
+   * unlocked while they are read. The locked pages keep vma from being
+   * released. */
+  for (ip=beg; ip<end; ++ip) {
+    if (OOC_PAGE_ONDISK !=\
+        (vma->vm_pflags[ip]&(OOC_PAGE_SYNC|OOC_PAGE_ONDISK)))
+    {
+      continue;
+    }
+    if (page_trylock(vma, ip)) {
+      continue;
+    }
+    if (OOC_PAGE_ONDISK !=\
+        (vma->vm_pflags[ip]&(OOC_PAGE_SYNC|OOC_PAGE_ONDISK)))
+    {
+      /* Page was read in before it was locked. */
+      page_unlock(vma, ip);
+      continue;
+    }
+    mask |= 1ULL<<(ip-beg);
+  }
+
+  ret = lock_let(&(vma->vm_lock));
+  assert(!ret);
+
+  /* Read each run of locked pages with a single I/O. */
+  for (ip=beg; mask; ip=jp) {
+    for (; !(mask&(1ULL<<(ip-beg))); ++ip);
+    for (jp=ip; jp<end && (mask&(1ULL<<(jp-beg))); ++jp) {
+      /* Make room for the page, before it is charged. */
+      ret = flush_reclaim(vma);
+      assert(!ret);
+      flush_charge(vma, 1);
+
+      if (vma->vm_shm) {
+        shm_hold(vma, jp);
+      }
+    }
+
+    if (vma->vm_shm) {
+      ret = shm_read(vma, ip, jp-ip);
+    }
+    else {
+      ret = page_read(addr+ip*ps, jp-ip, off+ip*ps);
+    }
+    assert(!ret);
+
+    STATS_ADD(prefetches, jp-ip);
+
+    for (; ip<jp; ++ip) {
+      vma->vm_pflags[ip] |= OOC_PAGE_SYNC|OOC_PAGE_REF;
+      mask &= ~(1ULL<<(ip-beg));
+      page_unlock(vma, ip);
+    }
+  }
+
+  if (arg) {}
+
+  return end;
+}
+
+
+/*! Make writable those of up to S_PREFETCH pages [beg,end) of vma which are
+ *  resident and clean, or which have never been written, or, if *arg is
+ *  non-zero or vma is write-only, which are not resident. */
+static size_t
+S_page_dirty(struct vm_area * const vma, size_t const beg, size_t end,
+             void * const arg)
+{
+  int ret, discard;
+  size_t ps, ip, nd=0;
+  unsigned char f;
+  unsigned long long mask=0;
+  char * addr;
+  struct prot_queue q;
+
+  ps   = (size_t)OOC_PAGE_SIZE;
+  addr = (char*)vma->vm_start;
+
+  discard = *(int*)arg || (vma->vm_flags&OOC_WRONLY);
+
+  if (end-beg > S_PREFETCH) {
+    end = beg+S_PREFETCH;
+  }
+
+  /* Lock the pages to make writable, skipping any which are busy. */
+  for (ip=beg; ip<end; ++ip) {
+    f = vma->vm_pflags[ip];
+    if (!S_DIRTYABLE(f, discard) || page_trylock(vma, ip)) {
+      continue;
+    }
+    f = vma->vm_pflags[ip];
+    if (!S_DIRTYABLE(f, discard)) {
+      page_unlock(vma, ip);
+      continue;
+    }
+    mask |= 1ULL<<(ip-beg);
+  }
+
+  ret = lock_let(&(vma->vm_lock));
+  assert(!ret);
+
+  prot_queue_init(&q);
+
+  for (ip=beg; ip<end; ++ip) {
+    if (!(mask&(1ULL<<(ip-beg)))) {
+      continue;
+    }
+
+    if (!(vma->vm_pflags[ip]&OOC_PAGE_SYNC)) {
+      /* Zero-fill page, or on-disk page being discarded, which is also
+       * zero-filled since it was evicted. Make room for it. */
+      ret = flush_reclaim(vma);
+      assert(!ret);
+      flush_charge(vma, 1);
+
+      if (vma->vm_pflags[ip]&OOC_PAGE_ONDISK) {
+        nd++;
+      }
+    }
+    vma->vm_pflags[ip] |= OOC_PAGE_SYNC|OOC_PAGE_DIRTY|OOC_PAGE_REF;
+
+    if (vma->vm_shm) {
+      shm_hold(vma, ip);
+    }
+
+    ret = prot_queue_add(&q, addr+ip*ps, ps, PROT_READ|PROT_WRITE,\
+                         PROT_QUEUE_NOADV);
+    assert(!ret);
+  }
+
+  ret = prot_queue_flush(&q);
+  assert(!ret);
+
+  STATS_ADD(discards, nd);
+
+  for (ip=beg; mask; ++ip) {
+    if (mask&(1ULL<<(ip-beg))) {
+      mask &= ~(1ULL<<(ip-beg));
+      page_unlock(vma, ip);
+    }
+  }
+
+  return end;
+}
+
+
+size_t
+page_missing(void * const addr, size_t const len)
+{
+  size_t nr=0;
+
+  S_page_walk(addr, len, &S_page_missing, &nr);
+
+  return nr;
+}
+
+
+void
+page_prefetch(void * const addr, size_t const len)
+{
+  S_page_walk(addr, len, &S_page_prefetch, NULL);
+}
+
+
+void
+page_dirty(void * const addr, size_t const len, int discard)
+{
+  S_page_walk(addr, len, &S_page_dirty, &discard);
+}
+
+
+#ifdef TEST
+/* assert */
+#include <assert.h>
+
+/* fopen, fgetc, fclose, FILE, EOF */
+#include <stdio.h>
+
+/* EXIT_SUCCESS, exit */
+#include <stdlib.h>
+
+/* waitpid, WIFEXITED, WEXITSTATUS */
+#include <sys/wait.h>
+
+#define N_THREAD 4
+#define N_ITER   10000
+#define N_PAGES  64
+
+/* Number of mappings of the process. */
+static size_t
+S_maps(void)
+{
+  int c;
+  size_t nr=0;
+  FILE * fp;
+
+  fp = fopen("/proc/self/maps", "r");
+  assert(fp);
+  while (EOF != (c=fgetc(fp))) {
+    nr += ('\n' == c);
+  }
+  (void)fclose(fp);
+
+  return nr;
+}
+
+int
+main(void)
+{
+  int i, ret, status;
+  unsigned long ctr=0;
+  size_t ps, off, j, nmaps;
+  pid_t pid;
+  char * mem;
+  unsigned char pflags[2]={OOC_PAGE_SYNC, 0};
+  struct vm_area vma, * vp;
+
+  vma.vm_pflags = pflags;
+
+  /* Locking a page leaves its other flags, and other pages, alone. */
+  assert(!page_trylock(&vma, 0));
+  assert((OOC_PAGE_SYNC|OOC_PAGE_LOCK) == pflags[0]);
+  assert(page_trylock(&vma, 0));
+  assert(!page_trylock(&vma, 1));
+  page_unlock(&vma, 0);
+  page_unlock(&vma, 1);
+  assert(OOC_PAGE_SYNC == pflags[0]);
+  assert(0 == pflags[1]);
+
+  /* Mutual exclusion. */
+  #pragma omp parallel for num_threads(N_THREAD)
+  for (i=0; i<N_THREAD*N_ITER; ++i) {
+    page_lock(&vma, 1);
+    ctr++;
+    page_unlock(&vma, 1);
+  }
+  assert((unsigned long)N_THREAD*N_ITER == ctr);
+  assert(0 == pflags[1]);
+
+  /* Read a page into the middle of an inaccessible range. */
+  ps = (size_t)OOC_PAGE_SIZE;
+
+  mem = mmap(NULL, 3*ps, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1,\
+             0);
+  assert(MAP_FAILED != mem);
+  for (j=0; j<ps; ++j) {
+    mem[j] = (char)j;
+  }
+  off = swap_alloc(ps);
+  ret = swap_write(mem, ps, off);
+  assert(!ret);
+  ret = mprotect(mem, 3*ps, PROT_NONE);
+  assert(!ret);
+
+  ret = page_read(mem+ps, 1, off);
+  assert(!ret);
+  for (j=0; j<ps; ++j) {
+    assert((char)j == mem[ps+j]);
+  }
+
+  /* Memory which the library does not manage is skipped. */
+  ret = sp_tree_init(&vma_tree);
+  assert(!ret);
+  assert(0 == page_missing(mem, 3*ps));
+
+  vp = vma_alloc();
+  assert(vp);
+  vp->vm_start  = mem+ps;
+  vp->vm_end    = mem+2*ps;
+  vp->vm_pflags = pflags+1;
+  vp->vm_off    = 0;
+  vp->vm_shm    = NULL;
+  ret = sp_tree_insert(&vma_tree, vp);
+  assert(!ret);
+
+  assert(1 == page_missing(mem, 3*ps));
+  assert(0 == page_missing(mem, ps));
+  assert(0 == page_missing(mem+2*ps, ps));
+
+  ret = sp_tree_free(&vma_tree);
+  assert(!ret);
+
+  ret = munmap(mem, 3*ps);
+  assert(!ret);
+
+  /* Pages read in one at a time do not each become a mapping of their own. */
+  mem = mmap(NULL, N_PAGES*ps, PROT_NONE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+  assert(MAP_FAILED != mem);
+  nmaps = S_maps();
+  for (j=0; j<N_PAGES; ++j) {
+    ret = page_read(mem+j*ps, 1, off);
+    assert(!ret);
+  }
+  assert(S_maps() <= nmaps+1);
+  assert(1 == mem[(N_PAGES-1)*ps+1]);
+
+  /* A child reads into its own memory, not that of its parent. */
+  ret = mprotect(mem, ps, PROT_READ|PROT_WRITE);
+  assert(!ret);
+  mem[1] = 0;
+  ret = mprotect(mem, ps, PROT_NONE);
+  assert(!ret);
+  pid = fork();
+  assert(-1 != pid);
+  if (!pid) {
+    ret = page_read(mem, 1, off);
+    exit(ret || 1 != mem[1] ? EXIT_FAILURE : EXIT_SUCCESS);
+  }
+  ret = (int)waitpid(pid, &status, 0);
+  assert(pid == ret);
+  assert(WIFEXITED(status) && EXIT_SUCCESS == WEXITSTATUS(status));
+  ret = mprotect(mem, ps, PROT_READ);
+  assert(!ret);
+  assert(0 == mem[1]);
+
+  ret = munmap(mem, N_PAGES*ps);
+  assert(!ret);
+  swap_free(off, ps);
+
+  return EXIT_SUCCESS;
+}
+#endif
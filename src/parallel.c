@@ -0,0 +1,686 @@
+/*
+Copyright (c) 2016 Jeremy Iverson
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+
+/* assert */
+#include <assert.h>
+
+/* FUTEX_WAIT_PRIVATE, FUTEX_WAKE_PRIVATE */
+#include <linux/futex.h>
+
+/* INT_MAX */
+#include <limits.h>
+
+/* pthread_create, pthread_join */
+#include <pthread.h>
+
+/* sched_yield */
+#include <sched.h>
+
+/* uintptr_t */
+#include <stdint.h>
+
+/* getenv, strtoul, NULL */
+#include <stdlib.h>
+
+/* SYS_futex */
+#include <sys/syscall.h>
+
+/* syscall, sysconf */
+#include <unistd.h>
+
+/* ooc_parallel_for */
+#include "include/ooc.h"
+
+/* */
+#include "common.h"
+
+
+/*
+ *  ooc_parallel_for() runs a loop on a pool of worker threads, which is
+ *  created the first time that it is needed and parked between loops. The
+ *  iteration range is divided evenly among the workers' deques. A worker pops
+ *  the most recently pushed range from the bottom of its own deque and, until
+ *  the range is no larger than the grain size, pushes its upper half back for
+ *  thieves. A worker whose deque is empty steals the oldest, and so largest,
+ *  range from the top of another worker's deque. Since a worker stalled on
+ *  I/O is not popping, its remaining work flows to workers which are not.
+ *
+ *  If the kernel has a footprint, see ooc_footprint(), then each range is run
+ *  in batches, within which the iterations whose data is resident are run
+ *  first, and the rest are deferred in order of how much of their data is
+ *  missing. The missing data of a deferred iteration is prefetched, in runs
+ *  of adjacent pages, just before it is run, rather than faulted in one page
+ *  at a time.
+ */
+
+
+/*! Work-stealing deque of iteration ranges. Ranges on a deque at least halve
+ *  in size from top to bottom, so the number of ranges is bounded by the
+ *  number of bits in a size_t. */
+struct S_deque
+{
+  lock_t lock;
+  size_t top;                 /* index of oldest range */
+  size_t bot;                 /* index one past newest range */
+  struct
+  {
+    size_t beg;               /* first iteration, inclusive */
+    size_t end;               /* last iteration, exclusive */
+  } r[OOC_PARALLEL_DEQUE_SIZE];
+} __attribute__((aligned(OOC_CACHE_LINE)));
+
+/*! Per-worker deques. */
+static struct S_deque S_deque[OOC_PARALLEL_MAX_THREADS];
+
+/*! Footprint callbacks registered with ooc_footprint(). */
+static struct
+{
+  void (*kern)(size_t const, void * const);
+  size_t (*fp)(size_t const, void * const, struct ooc_range * const,\
+               size_t const);
+} S_footprint[OOC_FOOTPRINT_MAX];
+
+/*! Number of registered footprint callbacks. */
+static size_t S_nfootprint=0;
+
+/*! The loop currently being run. */
+static struct
+{
+  void (*kern)(size_t const, void * const);
+  size_t (*fp)(size_t const, void * const, struct ooc_range * const,\
+               size_t const);
+  void * args;
+  size_t grain;
+  size_t left;                /* iterations not yet completed */
+  int active;                 /* workers which have not finished the loop */
+  int gen;                    /* loop generation, workers wait for a change */
+  int stop;                   /* workers should exit */
+} S_loop;
+
+/*! Serializes loops. */
+static lock_t S_lock;
+
+/*! Worker pool, S_thread[0] is unused, since the calling thread is worker 0. */
+static pthread_t S_thread[OOC_PARALLEL_MAX_THREADS];
+
+/*! Number of workers, including the calling thread. */
+static unsigned int S_nthreads=0;
+
+/*! Loop generation when the pool was created. */
+static int S_gen0=0;
+
+
+static void
+S_futex_wait(int * const addr, int const val)
+{
+  (void)syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+}
+
+
+static void
+S_futex_wake(int * const addr)
+{
+  (void)syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+}
+
+
+/*! Push a range onto the bottom of deque id. */
+static void
+S_push(unsigned int const id, size_t const beg, size_t const end)
+{
+  int ret;
+  struct S_deque * const dq=&(S_deque[id]);
+
+  ret = lock_get(&(dq->lock));
+  assert(!ret);
+
+  assert(dq->bot-dq->top < OOC_PARALLEL_DEQUE_SIZE);
+  dq->r[dq->bot%OOC_PARALLEL_DEQUE_SIZE].beg = beg;
+  dq->r[dq->bot%OOC_PARALLEL_DEQUE_SIZE].end = end;
+  dq->bot++;
+
+  ret = lock_let(&(dq->lock));
+  assert(!ret);
+}
+
+
+/*! Pop a range from the bottom (own == 1) or top (own == 0) of deque id,
+ *  returns non-zero if the deque is empty. */
+static int
+S_pop(unsigned int const id, int const own, size_t * const beg,
+      size_t * const end)
+{
+  int ret, empty;
+  size_t k;
+  struct S_deque * const dq=&(S_deque[id]);
+
+  /* Avoid taking the lock of an empty deque. */
+  if (*(size_t volatile*)&(dq->top) == *(size_t volatile*)&(dq->bot)) {
+    return -1;
+  }
+
+  ret = lock_get(&(dq->lock));
+  assert(!ret);
+
+  empty = dq->top == dq->bot;
+  if (!empty) {
+    k = own ? --dq->bot : dq->top++;
+    *beg = dq->r[k%OOC_PARALLEL_DEQUE_SIZE].beg;
+    *end = dq->r[k%OOC_PARALLEL_DEQUE_SIZE].end;
+  }
+
+  ret = lock_let(&(dq->lock));
+  assert(!ret);
+
+  return empty;
+}
+
+
+/*! Count the pages of nr footprint ranges which are not resident. */
+static size_t
+S_missing(struct ooc_range const * const range, size_t const nr)
+{
+  size_t j, miss=0;
+
+  for (j=0; j<nr; ++j) {
+    miss += page_missing(range[j].addr, range[j].len);
+  }
+
+  return miss;
+}
+
+
+/*! Run iterations [beg,end) of the current loop. */
+static void
+S_exec(size_t const beg, size_t const end)
+{
+  size_t i, j, k, n, b, t, nr;
+  size_t idx[OOC_PARALLEL_BATCH], miss[OOC_PARALLEL_BATCH];
+  struct ooc_range range[OOC_FOOTPRINT_RANGES];
+
+  if (NULL == S_loop.fp) {
+    for (i=beg; i<end; ++i) {
+      S_loop.kern(i, S_loop.args);
+    }
+    return;
+  }
+
+  for (b=beg; b<end; b+=n) {
+    n = end-b < OOC_PARALLEL_BATCH ? end-b : OOC_PARALLEL_BATCH;
+
+    /* Order the batch by the number of missing pages, keeping iterations with
+     * the same number in their original order. */
+    for (k=0; k<n; ++k) {
+      nr = S_loop.fp(b+k, S_loop.args, range, OOC_FOOTPRINT_RANGES);
+      miss[k] = S_missing(range, nr);
+
+      for (j=k; j>0 && miss[idx[j-1]]>miss[k]; --j) {
+        idx[j] = idx[j-1];
+      }
+      idx[j] = k;
+    }
+
+    for (k=0; k<n; ++k) {
+      i = b+idx[k];
+
+      if (miss[idx[k]]) {
+        nr = S_loop.fp(i, S_loop.args, range, OOC_FOOTPRINT_RANGES);
+        for (t=0; t<nr; ++t) {
+          page_prefetch(range[t].addr, range[t].len);
+        }
+      }
+
+      S_loop.kern(i, S_loop.args);
+    }
+  }
+}
+
+
+/*! Run iterations of the current loop as worker id, until none are left. */
+static void
+S_run(unsigned int const id)
+{
+  unsigned int v;
+  size_t beg=0, end=0, mid;
+
+  while (*(size_t volatile*)&(S_loop.left)) {
+    if (S_pop(id, 1, &beg, &end)) {
+      /* Own deque is empty, so try to steal. */
+      for (v=1; v<S_nthreads; ++v) {
+        if (!S_pop((id+v)%S_nthreads, 0, &beg, &end)) {
+          STATS_ADD(steals, 1);
+          break;
+        }
+      }
+      if (v == S_nthreads) {
+        /* Nothing to steal, but other workers are still running iterations,
+         * some of which may yet be split. */
+        (void)sched_yield();
+        continue;
+      }
+    }
+
+    /* Split off the upper half of the range for thieves, until the range is
+     * no larger than the grain size. */
+    while (end-beg > S_loop.grain) {
+      mid = beg+(end-beg)/2;
+      S_push(id, mid, end);
+      end = mid;
+    }
+
+    S_exec(beg, end);
+
+    (void)__sync_fetch_and_sub(&(S_loop.left), end-beg);
+  }
+}
+
+
+static void *
+S_worker(void * const arg)
+{
+  int gen;
+  unsigned int id;
+
+  id  = (unsigned int)(uintptr_t)arg;
+  gen = S_gen0;
+
+  for (;;) {
+    /* Park until the next loop is posted. */
+    while (gen == *(int volatile*)&(S_loop.gen)) {
+      S_futex_wait(&(S_loop.gen), gen);
+    }
+    gen = S_loop.gen;
+    __sync_synchronize();
+
+    if (S_loop.stop) {
+      break;
+    }
+
+    S_run(id);
+
+    /* Finish the iterations whose fibers yielded. */
+    ooc_wait();
+
+    if (0 == __sync_sub_and_fetch(&(S_loop.active), 1)) {
+      S_futex_wake(&(S_loop.active));
+    }
+  }
+
+  return NULL;
+}
+
+
+/*! Create the worker pool. The number of workers is $OOC_NUM_THREADS, if set,
+ *  or else the number of online processors. */
+static void
+S_pool_init(void)
+{
+  int ret;
+  unsigned int i, nr;
+  long nproc;
+  char const * env;
+
+  if (NULL != (env=getenv("OOC_NUM_THREADS"))) {
+    nr = (unsigned int)strtoul(env, NULL, 10);
+  }
+  else {
+    nproc = sysconf(_SC_NPROCESSORS_ONLN);
+    nr = nproc > 0 ? (unsigned int)nproc : 1;
+  }
+  if (0 == nr) {
+    nr = 1;
+  }
+  if (nr > OOC_PARALLEL_MAX_THREADS) {
+    nr = OOC_PARALLEL_MAX_THREADS;
+  }
+
+  S_loop.stop = 0;
+  S_gen0 = S_loop.gen;
+
+  for (i=1; i<nr; ++i) {
+    ret = pthread_create(&(S_thread[i]), NULL, &S_worker, (void*)(uintptr_t)i);
+    if (ret) {
+      break;
+    }
+  }
+  S_nthreads = i;
+}
+
+
+int
+ooc_parallel_for(void (*kern)(size_t const, void * const), size_t const begin,
+                 size_t const end, size_t const grain, void * const args)
+{
+  int ret, active;
+  unsigned int i;
+  size_t n, beg;
+
+  if (begin >= end) {
+    return 0;
+  }
+
+  ret = lock_get(&S_lock);
+  assert(!ret);
+
+  S_loop.fp = NULL;
+  for (n=0; n<S_nfootprint; ++n) {
+    if (kern == S_footprint[n].kern) {
+      S_loop.fp = S_footprint[n].fp;
+    }
+  }
+
+  if (!S_nthreads) {
+    S_pool_init();
+  }
+
+  S_loop.kern   = kern;
+  S_loop.args   = args;
+  S_loop.grain  = grain ? grain : 1;
+  S_loop.left   = end-begin;
+  S_loop.active = (int)S_nthreads-1;
+
+  /* Divide the iterations evenly among the workers. */
+  n = end-begin;
+  for (beg=begin,i=0; i<S_nthreads; ++i) {
+    if (n/S_nthreads+(i<n%S_nthreads) > 0) {
+      S_push(i, beg, beg+n/S_nthreads+(i<n%S_nthreads));
+    }
+    beg += n/S_nthreads+(i<n%S_nthreads);
+  }
+  assert(end == beg);
+
+  /* Post the loop and join in as worker 0. */
+  __sync_synchronize();
+  (void)__sync_fetch_and_add(&(S_loop.gen), 1);
+  S_futex_wake(&(S_loop.gen));
+
+  S_run(0);
+  ooc_wait();
+
+  while ((active=*(int volatile*)&(S_loop.active))) {
+    S_futex_wait(&(S_loop.active), active);
+  }
+
+  ret = lock_let(&S_lock);
+  assert(!ret);
+
+  return 0;
+}
+
+
+int
+ooc_footprint(void (*kern)(size_t const, void * const),
+              size_t (*fp)(size_t const, void * const,\
+                           struct ooc_range * const, size_t const))
+{
+  int ret, err=0;
+  size_t i;
+
+  ret = lock_get(&S_lock);
+  assert(!ret);
+
+  for (i=0; i<S_nfootprint && kern!=S_footprint[i].kern; ++i);
+
+  if (i < S_nfootprint && NULL == fp) {
+    /* Unregister. */
+    S_footprint[i] = S_footprint[--S_nfootprint];
+  }
+  else if (i < S_nfootprint) {
+    S_footprint[i].fp = fp;
+  }
+  else if (NULL != fp && OOC_FOOTPRINT_MAX == S_nfootprint) {
+    err = -1;
+  }
+  else if (NULL != fp) {
+    S_footprint[i].kern = kern;
+    S_footprint[i].fp   = fp;
+    S_nfootprint++;
+  }
+
+  ret = lock_let(&S_lock);
+  assert(!ret);
+
+  return err;
+}
+
+
+int
+parallel_stop(void)
+{
+  int ret, err=0;
+  unsigned int i;
+
+  ret = lock_get(&S_lock);
+  assert(!ret);
+
+  S_loop.stop = 1;
+  __sync_synchronize();
+  (void)__sync_fetch_and_add(&(S_loop.gen), 1);
+  S_futex_wake(&(S_loop.gen));
+
+  for (i=1; i<S_nthreads; ++i) {
+    if (pthread_join(S_thread[i], NULL)) {
+      err = -1;
+    }
+  }
+  S_nthreads = 0;
+
+  ret = lock_let(&S_lock);
+  assert(!ret);
+
+  return err;
+}
+
+
+#ifdef TEST
+/* assert */
+#include <assert.h>
+
+/* EXIT_SUCCESS, setenv */
+#include <stdlib.h>
+
+/* nanosleep, struct timespec */
+#include <time.h>
+
+#define N_THREAD 4
+#define N_ITER   1000
+#define N_PAGES  64
+#define N_BUDGET 16
+
+static int S_hits[N_ITER];
+
+static void
+S_count(size_t const i, void * const args)
+{
+  (void)__sync_fetch_and_add(&(S_hits[i]), 1);
+
+  if (args) {}
+}
+
+static void
+S_slow(size_t const i, void * const args)
+{
+  struct timespec ts;
+
+  /* The first worker's share of the iterations is much more expensive. */
+  if (i < N_ITER/N_THREAD) {
+    ts.tv_sec = 0;
+    ts.tv_nsec = 100000L;
+    (void)nanosleep(&ts, NULL);
+  }
+
+  S_count(i, args);
+}
+
+__ooc_decl ( static void S_touch )(size_t const i, void * const args);
+
+__ooc_defn ( static void S_touch )(size_t const i, void * const args)
+{
+  char * mem;
+
+  mem = (char*)args;
+  mem[i*(size_t)OOC_PAGE_SIZE] = (char)(i+1);
+}
+
+__ooc_decl ( static void S_check )(size_t const i, void * const args);
+
+__ooc_defn ( static void S_check )(size_t const i, void * const args)
+{
+  char * mem;
+
+  mem = (char*)args;
+  assert((char)(i+1) == mem[i*(size_t)OOC_PAGE_SIZE]);
+}
+
+__ooc_decl ( static void S_touch_even )(size_t const i, void * const args);
+
+__ooc_defn ( static void S_touch_even )(size_t const i, void * const args)
+{
+  char * mem;
+
+  mem = (char*)args;
+  if (0 == i%2) {
+    mem[i*(size_t)OOC_PAGE_SIZE] = (char)(i+1);
+  }
+}
+
+static size_t S_order[N_PAGES];
+static size_t S_norder=0;
+
+__ooc_decl ( static void S_record )(size_t const i, void * const args);
+
+__ooc_defn ( static void S_record )(size_t const i, void * const args)
+{
+  S_order[S_norder++] = i;
+
+  if (args) {}
+}
+
+static size_t
+S_page_fp(size_t const i, void * const args, struct ooc_range * const range,
+          size_t const nr)
+{
+  assert(nr >= 1);
+
+  range[0].addr = (char*)args+i*(size_t)OOC_PAGE_SIZE;
+  range[0].len  = 1;
+
+  return 1;
+}
+
+int
+main(void)
+{
+  int ret, i;
+  size_t ps;
+  unsigned long long nr;
+  char * mem;
+  struct ooc_stats stats;
+
+  ret = setenv("OOC_NUM_THREADS", "4", 1);
+  assert(!ret);
+
+  /* Every iteration runs exactly once, for any grain size. */
+  ret = ooc_parallel_for(&S_count, 0, N_ITER, 1, NULL);
+  assert(!ret);
+  assert(N_THREAD == S_nthreads);
+  ret = ooc_parallel_for(&S_count, 0, N_ITER/2, 7, NULL);
+  assert(!ret);
+  ret = ooc_parallel_for(&S_count, N_ITER/2, N_ITER, N_ITER, NULL);
+  assert(!ret);
+  ret = ooc_parallel_for(&S_count, 5, 5, 1, NULL);
+  assert(!ret);
+  for (i=0; i<N_ITER; ++i) {
+    assert(2 == S_hits[i]);
+  }
+
+  /* Idle workers steal from a worker with expensive iterations. */
+  ret = ooc_parallel_for(&S_slow, 0, N_ITER, 1, NULL);
+  assert(!ret);
+  for (i=0; i<N_ITER; ++i) {
+    assert(3 == S_hits[i]);
+  }
+  ret = ooc_stats(&stats);
+  assert(!ret);
+  assert(stats.steals > 0);
+
+  /* Out-of-core kernels fault on the pool's threads. */
+  ps = (size_t)OOC_PAGE_SIZE;
+  ret = ooc_set_budget(N_BUDGET*ps);
+  assert(!ret);
+  mem = ooc_malloc(N_PAGES*ps);
+  assert(mem);
+  ret = ooc_parallel_for(S_touch, 0, N_PAGES, 4, mem);
+  assert(!ret);
+  ret = ooc_parallel_for(S_check, 0, N_PAGES, 4, mem);
+  assert(!ret);
+
+  /* With a footprint, evicted pages are prefetched rather than faulted. */
+  ret = ooc_footprint(S_check, &S_page_fp);
+  assert(!ret);
+  ret = ooc_stats(&stats);
+  assert(!ret);
+  nr = stats.prefetches;
+  ret = ooc_parallel_for(S_check, 0, N_PAGES, 4, mem);
+  assert(!ret);
+  ret = ooc_stats(&stats);
+  assert(!ret);
+  assert(stats.prefetches > nr);
+  ret = ooc_footprint(S_check, NULL);
+  assert(!ret);
+  assert(0 == S_nfootprint);
+  ooc_free(mem);
+
+  /* Iterations whose pages are resident run first. */
+  mem = ooc_malloc(8*ps);
+  assert(mem);
+  ret = ooc_parallel_for(S_touch_even, 0, 8, 1, mem);
+  assert(!ret);
+  S_loop.kern = S_record;
+  S_loop.fp   = &S_page_fp;
+  S_loop.args = mem;
+  S_exec(0, 8);
+  assert(8 == S_norder);
+  for (i=0; i<8; ++i) {
+    assert((size_t)(i<4 ? 2*i : 2*(i-4)+1) == S_order[i]);
+  }
+  ooc_free(mem);
+
+  ret = parallel_stop();
+  assert(!ret);
+  assert(0 == S_nthreads);
+
+  /* The pool is recreated on demand. */
+  ret = ooc_parallel_for(&S_count, 0, N_ITER, 1, NULL);
+  assert(!ret);
+  assert(N_THREAD == S_nthreads);
+  for (i=0; i<N_ITER; ++i) {
+    assert(4 == S_hits[i]);
+  }
+
+  ret = ooc_finalize();
+  assert(!ret);
+
+  return EXIT_SUCCESS;
+}
+#endif
@@ -0,0 +1,231 @@
+/*
+Copyright (c) 2016 Jeremy Iverson
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+
+/* assert */
+#include <assert.h>
+
+/* size_t */
+#include <stddef.h>
+
+/* mprotect, madvise */
+#include <sys/mman.h>
+
+/* */
+#include "common.h"
+
+
+/*
+ *  mprotect() and the TLB shootdowns that it triggers are expensive, so
+ *  protection downgrades are not applied as each page is examined. Instead,
+ *  they are queued until a batch boundary, at which point all contiguous pages
+ *  with the same target protection are changed with one system call.
+ *
+ *  Upgrades in the fault path are applied immediately, since the faulting
+ *  thread cannot make progress until they are.
+ */
+
+
+void
+prot_queue_init(struct prot_queue * const q)
+{
+  q->n = 0;
+}
+
+
+int
+prot_queue_add(struct prot_queue * const q, void * const addr,
+               size_t const len, int const prot, int const adv)
+{
+  int ret;
+  size_t i, j;
+  void * end;
+
+  end = (void*)((char*)addr+len);
+
+  /* Try to merge with an existing run. */
+  for (i=0; i<q->n; ++i) {
+    if (prot != q->run[i].prot || adv != q->run[i].adv) {
+      continue;
+    }
+
+    if (q->run[i].end == addr) {
+      q->run[i].end = end;
+      break;
+    }
+    if (q->run[i].beg == end) {
+      q->run[i].beg = addr;
+      break;
+    }
+  }
+
+  if (i < q->n) {
+    /* The range may have filled the gap to another run, in which case the
+     * two are merged, and the last run takes the place of the other. */
+    for (j=0; j<q->n; ++j) {
+      if (j == i || prot != q->run[j].prot || adv != q->run[j].adv) {
+        continue;
+      }
+
+      if (q->run[j].beg == q->run[i].end) {
+        q->run[i].end = q->run[j].end;
+        break;
+      }
+      if (q->run[j].end == q->run[i].beg) {
+        q->run[i].beg = q->run[j].beg;
+        break;
+      }
+    }
+    if (j < q->n) {
+      q->run[j] = q->run[--q->n];
+    }
+
+    return 0;
+  }
+
+  /* Queue is full, so apply what has been queued so far. */
+  if (OOC_PROT_QUEUE_SIZE == q->n) {
+    ret = prot_queue_flush(q);
+    if (ret) {
+      return ret;
+    }
+  }
+
+  /* Start a new run. */
+  q->run[q->n].beg = addr;
+  q->run[q->n].end = end;
+  q->run[q->n].prot = prot;
+  q->run[q->n].adv = adv;
+  q->n++;
+
+  return 0;
+}
+
+
+int
+prot_queue_flush(struct prot_queue * const q)
+{
+  int ret, err=0;
+  size_t i, len;
+
+  for (i=0; i<q->n; ++i) {
+    len = (size_t)((char*)q->run[i].end-(char*)q->run[i].beg);
+
+    ret = mprotect(q->run[i].beg, len, q->run[i].prot);
+    if (ret) {
+      err = ret;
+      continue;
+    }
+
+    if (PROT_QUEUE_NOADV != q->run[i].adv) {
+      ret = madvise(q->run[i].beg, len, q->run[i].adv);
+      if (ret) {
+        err = ret;
+      }
+    }
+  }
+
+  q->n = 0;
+
+  return err;
+}
+
+
+#ifdef TEST
+/* assert */
+#include <assert.h>
+
+/* EXIT_SUCCESS */
+#include <stdlib.h>
+
+/* mmap, munmap */
+#include <sys/mman.h>
+
+int
+main(void)
+{
+  int ret;
+  size_t ps, i;
+  char * mem;
+  struct prot_queue q;
+
+  ps = (size_t)OOC_PAGE_SIZE;
+
+  mem = mmap(NULL, 8*ps, PROT_NONE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+  assert(MAP_FAILED != mem);
+
+  prot_queue_init(&q);
+
+  /* Pages 0-3 ascending, page 5, page 7 with a different protection, and
+   * page 4, which joins the runs of pages 0-3 and 5. */
+  for (i=0; i<4; ++i) {
+    ret = prot_queue_add(&q, mem+i*ps, ps, PROT_READ|PROT_WRITE,\
+                         PROT_QUEUE_NOADV);
+    assert(!ret);
+  }
+  assert(1 == q.n);
+  ret = prot_queue_add(&q, mem+5*ps, ps, PROT_READ|PROT_WRITE,\
+                       PROT_QUEUE_NOADV);
+  assert(!ret);
+  assert(2 == q.n);
+  ret = prot_queue_add(&q, mem+7*ps, ps, PROT_READ, PROT_QUEUE_NOADV);
+  assert(!ret);
+  assert(3 == q.n);
+  ret = prot_queue_add(&q, mem+4*ps, ps, PROT_READ|PROT_WRITE,\
+                       PROT_QUEUE_NOADV);
+  assert(!ret);
+  assert(2 == q.n);
+  assert(mem == q.run[0].beg && mem+6*ps == q.run[0].end);
+
+  ret = prot_queue_flush(&q);
+  assert(!ret);
+  assert(0 == q.n);
+
+  /* Should not raise SIGSEGV. */
+  for (i=0; i<6; ++i) {
+    mem[i*ps] = (char)i;
+  }
+  assert(0 == mem[7*ps]);
+
+  /* Downgrade with advice discards contents. */
+  ret = prot_queue_add(&q, mem, 6*ps, PROT_READ, MADV_DONTNEED);
+  assert(!ret);
+  ret = prot_queue_flush(&q);
+  assert(!ret);
+  for (i=0; i<6; ++i) {
+    assert(0 == mem[i*ps]);
+  }
+
+  /* Overflow the queue, which must flush implicitly. */
+  for (i=0; i<=OOC_PROT_QUEUE_SIZE; ++i) {
+    ret = prot_queue_add(&q, mem+(i%4)*2*ps, ps, (int)(i%2), PROT_QUEUE_NOADV);
+    assert(!ret);
+  }
+  ret = prot_queue_flush(&q);
+  assert(!ret);
+
+  ret = munmap(mem, 8*ps);
+  assert(!ret);
+
+  return EXIT_SUCCESS;
+}
+#endif
@@ -30,24 +30,37 @@ THE SOFTWARE.
 /* uintptr_t */
 #include <inttypes.h>
 
-/* struct sigaction, sigaction */
+/* pthread_key_create, pthread_setspecific, pthread_mutex_lock,
+ * pthread_mutex_unlock, PTHREAD_MUTEX_INITIALIZER */
+#include <pthread.h>
+
+/* sched_yield */
+#include <sched.h>
+
+/* struct sigaction, sigaction, raise */
 #include <signal.h>
 
 /* size_t */
 #include <stddef.h>
 
-/* NULL, abort */
+/* NULL, abort, atexit, getenv, strtoul */
 #include <stdlib.h>
 
-/* memcpy, memset */
+/* memcpy, memmove, memset */
 #include <string.h>
 
-/* mprotect, PROT_READ, PROT_WRITE */
+/* mmap, mprotect, munmap, PROT_READ, PROT_WRITE, MAP_NORESERVE, MAP_STACK */
 #include <sys/mman.h>
 
 /* ucontext_t, getcontext, makecontext, swapcontext, setcontext */
 #include <ucontext.h>
 
+/* Index of the page fault error code in the x86-64 ucontext_t general
+ * purpose registers, which is only exposed by ucontext.h for _GNU_SOURCE. */
+#if defined(__x86_64__) && !defined(REG_ERR)
+  #define REG_ERR 19
+#endif
+
 /* OOC_NUM_FIBERS, function prototypes */
 #include "include/ooc.h"
 
@@ -93,33 +106,119 @@ THE SOFTWARE.
 /* Together these arrays make up an out-of-core execution context, henceforth
  * known simply as a fiber. Multiple arrays are used instead of a struct with
  * the various fields to simplify things like passing all fibers' async-io
- * requests to library functions, i.e., aio_suspend(). */
-static __thread size_t S_iter[OOC_NUM_FIBERS];
-static __thread void * S_args[OOC_NUM_FIBERS];
-static __thread void (*S_kernel[OOC_NUM_FIBERS])(size_t const, void * const);
-static __thread void * S_addr[OOC_NUM_FIBERS];
-static __thread ucontext_t S_handler[OOC_NUM_FIBERS];
-static __thread ucontext_t S_trampoline[OOC_NUM_FIBERS];
-static __thread ucontext_t S_kern[OOC_NUM_FIBERS];
-static __thread char S_stack[OOC_NUM_FIBERS][SIGSTKSZ];
+ * requests to library functions, i.e., aio_suspend(). The arrays of a thread
+ * are allocated by S_fibers_init(), in memory which is only committed as it is
+ * touched, so a thread may have thousands of fibers, of which only those which
+ * have been used cost memory. */
+static __thread size_t * S_iter;
+static __thread void ** S_args;
+static __thread void (**S_kernel)(size_t const, void * const);
+static __thread void ** S_addr;
+static __thread int * S_write;
+static __thread ucontext_t * S_handler;
+static __thread ucontext_t * S_trampoline;
+static __thread ucontext_t * S_kern;
+static __thread char ** S_stack;
+
+/* Ranges which the kernel running on each fiber declared with ooc_writes(),
+ * which are flushed when it returns. */
+static __thread void * (*S_wr_addr)[OOC_ACCESS_MAX];
+static __thread size_t (*S_wr_len)[OOC_ACCESS_MAX];
+static __thread int * S_wr_nr;
+
+/* State of each fiber. A fiber which yielded, see ooc_yield(), is resumed from
+ * S_handler. */
+#define S_IDLE  0
+#define S_RUN   1
+#define S_YIELD 2
+static __thread int * S_state;
+
+/* Number of fibers of this thread. */
+static __thread int S_nfibers;
+
+/* Idle fibers, the most recently used last, so that it is reused first. */
+static __thread int * S_idle;
+static __thread int S_nidle;
+
+/* Ring of fibers which yielded, in the order in which they are resumed. */
+static __thread int * S_ring;
+static __thread int S_ring_head;
+static __thread int S_nring;
+
+/* Stacks, which are only held by fibers which are running or yielded, and are
+ * otherwise kept here for reuse, the most recently used, and so the most
+ * likely to be committed and cached, last. */
+static __thread char * S_pool[OOC_FIBER_POOL];
+static __thread int S_npool;
 
 /* My fiber id. */
 static __thread int S_me;
 
+/* Whether the calling context is a fiber, rather than the main context. */
+static __thread int S_fiber;
+
 /* The old sigaction to be replaced when we are done. */
-static __thread struct sigaction S_old_act;
+static struct sigaction S_old_act;
 
 /* System page size. */
-static __thread uintptr_t S_ps;
+static uintptr_t S_ps;
+
+/* State of process-wide initialization: 0 if the library is not initialized,
+ * 1 while it is being initialized or finalized, and 2 once it is
+ * initialized. */
+static int S_global=0;
+
+/* Whether the SIGSEGV handler is installed, and whether it is to be removed
+ * once the last claimed range is released, since the library was finalized
+ * while allocations were live, whose faults must still be handled. Both are
+ * protected by S_range_lock. */
+static int S_hooked=0;
+static int S_unhook=0;
+
+/* Whether S_key has been created and S_atexit() registered, which is only done
+ * once per process. */
+static int S_once=0;
+
+/* Key whose destructor releases the fibers of a thread as it exits. */
+static pthread_key_t S_key;
+
+/* Address ranges whose faults are handled, rather than passed on to S_old_act,
+ * sorted by address, so that the handler finds a fault's range with a binary
+ * search. The handler takes no locks; writers serialize on S_range_lock and
+ * keep S_range_seq odd while they change the table, and a search which
+ * overlapped a change is repeated. A table which has been outgrown is never
+ * unmapped, since the handler may still be searching it, which costs no more
+ * than the table in use, as each is twice the size of the last. Each table
+ * records its own capacity, since the handler may pair a table with the count
+ * of a newer, larger one, and must not search past its end before it notices
+ * the change and repeats the search. */
+struct S_range
+{
+  uintptr_t beg;
+  uintptr_t end;
+};
+struct S_range_tab
+{
+  size_t cap;
+  struct S_range range[];
+};
+static struct S_range_tab * S_range=NULL;
+static size_t S_nrange=0;
+static unsigned long S_range_seq=0;
+static pthread_mutex_t S_range_lock=PTHREAD_MUTEX_INITIALIZER;
 
 /* The main context, i.e., the context which spawned all of the fibers. */
 /* TODO Need to convince myself that we don't need a main context for each
  * fiber? */
 static __thread ucontext_t S_main;
 
-/* Indicator variable for library initialization. */
+/* Indicator variable for initialization of this thread's fibers. */
 static __thread int S_is_init=0;
 
+/* The memory of this thread's fiber arrays. */
+static __thread void * S_fibers_mem;
+static __thread size_t S_fibers_len;
+
 /* System page table. */
 struct sp_tree vma_tree;
 
@@ -127,9 +226,15 @@ struct sp_tree vma_tree;
 static void
 S_sigsegv_handler(void)
 {
-  int ret, prot;
+  int ret, prot, held, inflight=0;
+  size_t ip;
   uintptr_t addr;
+  unsigned long long beg;
   struct vm_area * vma;
+  struct inflight req;
+
+  beg = stats_clock();
+  TRACE_EVENT(OOC_TRACE_FAULT_BEG, (uintptr_t)S_addr[S_me]);
 
   /* TODO Because we may be splitting/merging vma after locking it, we may need
    * to hold a lock with a greater scope, like maybe vma_tree lock until
@@ -145,20 +250,61 @@ S_sigsegv_handler(void)
    * lock is all done atomically (while holding the vma_tree lock inside the
    * function called). */
 
-  /* FIXME The unit test is passing right now because after the first page in an
-   * vma gets faulted, since no splitting/merging happens, the vma is marked
-   * with read flag. After that, any other page in the vma that faults, will see
-   * that its vma has read flag and be automatically granted read/write flags.
-   * This allows the code to work, but also means that after the first page
-   * fault in a vma, every other page fault, even read accesses will cause the
-   * vma to be marked dirty. */
-
   /* Find the vma corresponding to the offending address and lock it. */
   ret = sp_tree_find_and_lock(&vma_tree, S_addr[S_me], (void*)&vma);
   assert(!ret);
 
-  if (!(vma->vm_flags&0x1)) {
-    if (vma->vm_flags&0x10) {
+  addr = (uintptr_t)S_addr[S_me]&(~(S_ps-1)); /* page align */
+  ip   = (addr-(uintptr_t)vma->vm_start)/S_ps;
+
+  /* Only the page is locked while the fault is serviced, so that faults on
+   * other pages of vma can proceed in parallel. */
+  ret = lock_let(&(vma->vm_lock));
+  assert(!ret);
+
+  /* If the page is busy because another fault is reading it in, then sleep
+   * until that read completes, rather than spinning on the page lock for the
+   * duration of the I/O. */
+  if (page_trylock(vma, ip)) {
+    if (!inflight_wait((void*)addr)) {
+      STATS_ADD(rd_shared, 1);
+    }
+    page_lock(vma, ip);
+  }
+
+  /* A page of a shared region may be resident, but not yet accessible to this
+   * process. Mark it as held before it becomes accessible, so that no other
+   * process evicts it from under this one. */
+  held = 1;
+  if (vma->vm_shm) {
+    held = shm_held(vma, ip);
+    shm_hold(vma, ip);
+  }
+
+  /* Make room for the page, if the memory budget has been reached. This must
+   * be done while vma is unlocked, since it may choose to evict pages from
+   * vma, but not the page itself, which is locked. */
+  ret = flush_reclaim(vma);
+  assert(!ret);
+
+  if (!(vma->vm_pflags[ip]&OOC_PAGE_SYNC) && (vma->vm_flags&OOC_WRONLY)) {
+    /* Write-only allocation, so the previous contents of the page are
+     * discarded rather than read, and the evicted, and so zero-filled, page is
+     * made writable directly. */
+    if (vma->vm_pflags[ip]&OOC_PAGE_ONDISK) {
+      STATS_ADD(discards, 1);
+    }
+    STATS_ADD(mn_faults, 1);
+    STATS_ADD(wr_faults, 1);
+
+    /* Update page flags. */
+    vma->vm_pflags[ip] |= OOC_PAGE_SYNC|OOC_PAGE_DIRTY|OOC_PAGE_REF;
+    flush_charge(vma, 1);
+
+    prot = PROT_READ|PROT_WRITE;
+  }
+  else if (!(vma->vm_pflags[ip]&OOC_PAGE_SYNC)) {
+    if (vma->vm_pflags[ip]&OOC_PAGE_ONDISK) {
       /* TODO Post an async-io request. */
       /*aio_read(...);*/
 
@@ -166,30 +312,82 @@ S_sigsegv_handler(void)
         ret = swapcontext(&(S_handler[S_me]), &S_main);
         assert(!ret);
       }
+
+      /* Read page from backing store, letting other faults on the page wait
+       * for this read. */
+      inflight_begin(&req, (void*)addr);
+      inflight = 1;
+
+      if (vma->vm_shm) {
+        ret = shm_read(vma, ip, 1);
+      }
+      else {
+        ret = page_read((void*)addr, 1, vma->vm_off+ip*S_ps);
+      }
+      assert(!ret);
+
+      STATS_ADD(mj_faults, 1);
+
+      /* page_read() installs the page with read protection. */
+      prot = -1;
+    }
+    else {
+      STATS_ADD(mn_faults, 1);
+
+      /* Grant read protection to page containing offending address. */
+      prot = PROT_READ;
     }
+    STATS_ADD(rd_faults, 1);
 
     /* Update page flags. */
-    vma->vm_flags |= 0x1;
+    vma->vm_pflags[ip] |= OOC_PAGE_SYNC|OOC_PAGE_REF;
+    flush_charge(vma, 1);
+  }
+  else if (0 == S_write[S_me] && held) {
+    /* The page was read in by another thread, while this thread waited for
+     * the page lock, so there is nothing left to do. */
+    STATS_ADD(mn_faults, 1);
+    STATS_ADD(rd_faults, 1);
+
+    prot = -1;
+  }
+  else if (0 == S_write[S_me]) {
+    /* The page was read in by another process, so it only has to be made
+     * accessible to this one. */
+    STATS_ADD(mn_faults, 1);
+    STATS_ADD(rd_faults, 1);
+
+    vma->vm_pflags[ip] |= OOC_PAGE_REF;
 
-    /* Grant read protection to page containing offending address. */
     prot = PROT_READ;
   }
   else {
+    STATS_ADD(mn_faults, 1);
+    STATS_ADD(wr_faults, 1);
+
     /* Update page flags. */
-    vma->vm_flags |= 0x10;
+    vma->vm_pflags[ip] |= OOC_PAGE_DIRTY|OOC_PAGE_REF;
 
     /* Grant write protection to page containing offending address. */
     prot = PROT_READ|PROT_WRITE;
   }
 
   /* Apply updates to page containing offending address. */
-  addr = (uintptr_t)S_addr[S_me]&(~(S_ps-1)); /* page align */
-  ret = mprotect((void*)addr, S_ps, prot);
-  assert(!ret);
+  if (-1 != prot) {
+    ret = mprotect((void*)addr, S_ps, prot);
+    assert(!ret);
+  }
 
-  /* Unlock the vma. */
-  ret = lock_let(&(vma->vm_lock));
-  assert(!ret);
+  /* Unlock the page. */
+  page_unlock(vma, ip);
+
+  /* Wake any faults which are waiting for the read. */
+  if (inflight) {
+    inflight_end(&req);
+  }
+
+  stats_hist(stats_local()->fault_ns, stats_clock()-beg);
+  TRACE_EVENT(OOC_TRACE_FAULT_END, (uintptr_t)S_addr[S_me]);
 
   /* Switch back to trampoline context, so that it may return. */
   setcontext(&(S_trampoline[S_me]));
@@ -199,6 +397,317 @@ S_sigsegv_handler(void)
 }
 
 
+static void
+S_flush(void)
+{
+  int i;
+
+  /* Write back the kernel's outputs now, rather than when they are evicted,
+   * so that evicting them later is cheap. */
+  for (i=0; i<S_wr_nr[S_me]; ++i) {
+    flush_clean(S_wr_addr[S_me][i], S_wr_len[S_me][i]);
+  }
+  S_wr_nr[S_me] = 0;
+}
+
+
+static void
+S_kernel_trampoline(int const i)
+{
+  S_kernel[i](S_iter[i], S_args[i]);
+
+  /* Before this context returns, flush the data it declared that it writes. */
+  S_flush();
+
+  S_state[i] = S_IDLE;
+  S_fiber = 0;
+
+  TRACE_EVENT(OOC_TRACE_SWITCH, OOC_TRACE_MAIN);
+
+  /* Switch back to main context, so that a new fiber gets scheduled. */
+  setcontext(&S_main);
+
+  /* It is erroneous to reach this point. */
+  abort();
+}
+
+
+/* Moved this into its own function to prevent the following gcc error:
+   variable ‘i’ might be clobbered by ‘longjmp’ or ‘vfork’ [-Werror=clobbered]
+ */
+static int
+S_kern_init(int const i)
+{
+  int ret;
+
+  ret = getcontext(&(S_kern[i]));
+  assert(!ret);
+  S_kern[i].uc_stack.ss_sp = S_stack[i];
+  S_kern[i].uc_stack.ss_size = OOC_FIBER_STACK_SIZE;
+  S_kern[i].uc_stack.ss_flags = 0;
+
+  makecontext(&(S_kern[i]), (void (*)(void))&S_kernel_trampoline, 1, i);
+
+  return 0;
+}
+
+
+/*! Get a stack for a fiber, reusing one if possible. A new stack is reserved
+ *  without committing any memory to it, and grows on demand, as its pages are
+ *  touched, down to a guard page. */
+static char *
+S_stack_get(void)
+{
+  int ret;
+  char * stack;
+
+  if (S_npool) {
+    return S_pool[--S_npool];
+  }
+
+  stack = mmap(NULL, OOC_FIBER_STACK_SIZE, PROT_READ|PROT_WRITE,\
+    MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE|MAP_STACK, -1, 0);
+  if (MAP_FAILED == stack) {
+    return NULL;
+  }
+
+  ret = mprotect(stack, S_ps, PROT_NONE);
+  assert(!ret);
+
+  return stack;
+}
+
+
+/*! Put back the stack of a fiber which completed. */
+static void
+S_stack_put(char * const stack)
+{
+  int ret;
+
+  if (S_npool < OOC_FIBER_POOL) {
+    S_pool[S_npool++] = stack;
+  }
+  else {
+    ret = munmap(stack, OOC_FIBER_STACK_SIZE);
+    assert(!ret);
+  }
+}
+
+
+/*! Allocate the fiber arrays of this thread, for $OOC_NUM_FIBERS fibers, if
+ *  set, or else OOC_NUM_FIBERS. */
+static int
+S_fibers_init(void)
+{
+  int i, pass;
+  size_t n, off=0;
+  uintptr_t base=0;
+  char const * env;
+  void * mem;
+
+  if (NULL != (env=getenv("OOC_NUM_FIBERS"))) {
+    n = (size_t)strtoul(env, NULL, 10);
+  }
+  else {
+    n = OOC_NUM_FIBERS;
+  }
+  if (0 == n) {
+    n = 1;
+  }
+  if (n > OOC_MAX_FIBERS) {
+    n = OOC_MAX_FIBERS;
+  }
+  S_nfibers = (int)n;
+
+/* Lay out array arr, of n elements, at offset off from base. */
+#define S_CARVE(arr)\
+  (arr = (void*)(base+off),\
+   off += (n*sizeof(*(arr))+OOC_CACHE_LINE-1)&~(size_t)(OOC_CACHE_LINE-1))
+
+  /* Compute the layout of the arrays, then allocate and lay them out. */
+  for (pass=0; pass<2; ++pass) {
+    if (pass) {
+      mem = mmap(NULL, off, PROT_READ|PROT_WRITE,\
+        MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+      if (MAP_FAILED == mem) {
+        return -1;
+      }
+      S_fibers_mem = mem;
+      S_fibers_len = off;
+      base = (uintptr_t)mem;
+      off  = 0;
+    }
+
+    S_CARVE(S_iter);
+    S_CARVE(S_args);
+    S_CARVE(S_kernel);
+    S_CARVE(S_addr);
+    S_CARVE(S_write);
+    S_CARVE(S_handler);
+    S_CARVE(S_trampoline);
+    S_CARVE(S_kern);
+    S_CARVE(S_stack);
+    S_CARVE(S_wr_addr);
+    S_CARVE(S_wr_len);
+    S_CARVE(S_wr_nr);
+    S_CARVE(S_state);
+    S_CARVE(S_idle);
+    S_CARVE(S_ring);
+  }
+
+#undef S_CARVE
+
+  /* Initially, every fiber is idle, the lowest numbered being reused
+   * first. */
+  for (i=0; i<S_nfibers; ++i) {
+    S_idle[i] = S_nfibers-1-i;
+  }
+  S_nidle = S_nfibers;
+
+  return 0;
+}
+
+
+/*! Release the fibers of an exiting thread, including the stacks of any whose
+ *  iterations yielded and were never resumed. */
+static void
+S_thread_exit(void * const arg)
+{
+  int ret, j;
+
+  for (j=0; j<S_nfibers; ++j) {
+    if (S_stack[j]) {
+      ret = munmap(S_stack[j], OOC_FIBER_STACK_SIZE);
+      assert(!ret);
+    }
+  }
+  while (S_npool) {
+    ret = munmap(S_pool[--S_npool], OOC_FIBER_STACK_SIZE);
+    assert(!ret);
+  }
+
+  ret = munmap(S_fibers_mem, S_fibers_len);
+  assert(!ret);
+
+  S_iter    = NULL;
+  S_nfibers = 0;
+  S_nidle   = 0;
+  S_nring   = 0;
+  S_is_init = 0;
+
+  if (arg) {}
+}
+
+
+/*! Initialize the fibers of the calling thread. This may be called from the
+ *  SIGSEGV handler, if the thread faults before it has called ooc_sched(). */
+static int
+S_thread_init(void)
+{
+  int ret;
+
+  ret = S_fibers_init();
+  if (ret) {
+    return ret;
+  }
+
+  /* Any non-NULL value, so that S_thread_exit() is called. */
+  ret = pthread_setspecific(S_key, S_fibers_mem);
+  if (ret) {
+    return ret;
+  }
+
+  S_is_init = 1;
+
+  return 0;
+}
+
+
+/*! Index of the first range of range[0..nr) which ends after addr, or nr. */
+static size_t
+S_range_find(struct S_range const * const range, size_t const nr,
+             uintptr_t const addr)
+{
+  size_t lo, hi, mid;
+
+  for (lo=0,hi=nr; lo<hi;) {
+    mid = lo+(hi-lo)/2;
+    if (range[mid].end <= addr) {
+      lo = mid+1;
+    }
+    else {
+      hi = mid;
+    }
+  }
+
+  return lo;
+}
+
+
+/*! Whether the fault at addr is in a claimed range. This is async-signal-safe,
+ *  it takes no locks. */
+static int
+S_range_owns(void const * const addr)
+{
+  int owns;
+  size_t nr, i;
+  unsigned long seq;
+  struct S_range_tab const * tab;
+
+  do {
+    seq = *(unsigned long volatile*)&S_range_seq;
+    __sync_synchronize();
+
+    owns = 0;
+    tab  = *(struct S_range_tab * volatile*)&S_range;
+    nr   = *(size_t volatile*)&S_nrange;
+    if (!(seq&1) && tab) {
+      if (nr > tab->cap) {
+        nr = tab->cap;
+      }
+      i = S_range_find(tab->range, nr, (uintptr_t)addr);
+      owns = (i < nr && tab->range[i].beg <= (uintptr_t)addr);
+    }
+
+    __sync_synchronize();
+  } while ((seq&1) || seq != *(unsigned long volatile*)&S_range_seq);
+
+  return owns;
+}
+
+
+/*! Pass a signal which is not ours on to the handler which was installed
+ *  before ours. If that is the default action, then it is restored, and the
+ *  fault recurs, or the signal is raised again, once this handler returns. */
+static void
+S_sigsegv_chain(int const sig, siginfo_t * const si, void * const uc)
+{
+  struct sigaction act;
+
+  if ((S_old_act.sa_flags&SA_SIGINFO) && S_old_act.sa_sigaction) {
+    S_old_act.sa_sigaction(sig, si, uc);
+  }
+  else if (SIG_DFL != S_old_act.sa_handler &&
+           SIG_IGN != S_old_act.sa_handler)
+  {
+    S_old_act.sa_handler(sig);
+  }
+  else {
+    /* Ignoring a fault would only repeat it, so it is treated as the default
+     * action, i.e., the process is terminated. */
+    memset(&act, 0, sizeof(act));
+    act.sa_handler = SIG_DFL;
+    (void)sigaction(sig, &act, NULL);
+
+    /* A signal which was sent, rather than caused by a fault, would not
+     * recur. */
+    if (si->si_code <= 0) {
+      (void)raise(sig);
+    }
+  }
+}
+
+
 static void
 S_sigsegv_trampoline(int const sig, siginfo_t * const si, void * const uc)
 {
@@ -208,10 +717,29 @@ S_sigsegv_trampoline(int const sig, siginfo_t * const si, void * const uc)
   static __thread char tmp_stack[SIGSTKSZ];
   int ret;
 
-  assert(SIGSEGV == sig);
+  /* Real segfaults, and faults of other users of guard pages, are not ours. */
+  if (SIGSEGV != sig || si->si_code <= 0 || !S_range_owns(si->si_addr)) {
+    S_sigsegv_chain(sig, si, uc);
+    return;
+  }
+
+  /* A thread which faults before it has called ooc_sched(), e.g., to read the
+   * results of a loop, has no fibers yet. */
+  if (!S_is_init) {
+    ret = S_thread_init();
+    assert(!ret);
+  }
 
   S_addr[S_me] = si->si_addr;
 
+  /* Determine whether the fault was caused by a write, if the platform tells
+   * us. */
+#if defined(__x86_64__) && defined(REG_ERR)
+  S_write[S_me] = (((ucontext_t*)uc)->uc_mcontext.gregs[REG_ERR]&0x2) ? 1 : 0;
+#else
+  S_write[S_me] = -1;
+#endif
+
   ret = getcontext(&tmp_uc);
   assert(!ret);
   tmp_uc.uc_stack.ss_sp = tmp_stack;
@@ -228,70 +756,174 @@ S_sigsegv_trampoline(int const sig, siginfo_t * const si, void * const uc)
 
 
 static void
-S_flush(void)
+S_atexit(void)
 {
+  (void)ooc_finalize();
 }
 
 
-static void
-S_kernel_trampoline(int const i)
+/*! Install the SIGSEGV handler for the process, if it is not installed. */
+static int
+S_global_init(void)
 {
-  S_kernel[i](S_iter[i], S_args[i]);
+  int ret;
+  struct sigaction act;
 
-  /* TODO Before this context returns, it should call a `flush function` where
-   * the data it accessed is flushed to disk. */
-  S_flush();
+  for (;;) {
+    if (2 == *(int volatile*)&S_global) {
+      return 0;
+    }
+    if (__sync_bool_compare_and_swap(&S_global, 0, 1)) {
+      break;
+    }
+    /* Another thread is installing or removing the handler. */
+    (void)sched_yield();
+  }
 
-  /* Switch back to main context, so that a new fiber gets scheduled. */
-  setcontext(&S_main);
+  S_ps = (uintptr_t)OOC_PAGE_SIZE;
 
-  /* It is erroneous to reach this point. */
-  abort();
+  if (!S_once) {
+    ret = pthread_key_create(&S_key, &S_thread_exit);
+    assert(!ret);
+
+    /* Finalize transparently at exit. */
+    ret = atexit(&S_atexit);
+    assert(!ret);
+
+    S_once = 1;
+  }
+
+  /* The handler may still be installed, if the library was finalized while
+   * allocations were live. */
+  ret = pthread_mutex_lock(&S_range_lock);
+  assert(!ret);
+  S_unhook = 0;
+  if (!S_hooked) {
+    memset(&act, 0, sizeof(act));
+    act.sa_sigaction = &S_sigsegv_trampoline;
+    act.sa_flags = SA_SIGINFO;
+    ret = sigaction(SIGSEGV, &act, &S_old_act);
+    assert(!ret);
+    S_hooked = 1;
+  }
+  ret = pthread_mutex_unlock(&S_range_lock);
+  assert(!ret);
+
+  __sync_synchronize();
+  S_global = 2;
+
+  return ret;
 }
 
 
-/* Moved this into its own function to prevent the following gcc error:
-   variable ‘i’ might be clobbered by ‘longjmp’ or ‘vfork’ [-Werror=clobbered]
- */
 static int
-S_kern_init(int const i)
+S_init(void)
 {
   int ret;
 
-  ret = getcontext(&(S_kern[i]));
+  ret = S_global_init();
+  if (ret) {
+    return ret;
+  }
+
+  /* The fibers outlive ooc_finalize(), since some may have yielded. */
+  if (!S_is_init) {
+    ret = S_thread_init();
+  }
+
+  return ret;
+}
+
+
+int
+sched_range_add(void * const beg, void * const end)
+{
+  int ret;
+  size_t i, len;
+  struct S_range_tab * tab;
+  struct S_range * range;
+
+  ret = pthread_mutex_lock(&S_range_lock);
   assert(!ret);
-  S_kern[i].uc_stack.ss_sp = S_stack[i];
-  S_kern[i].uc_stack.ss_size = SIGSTKSZ;
-  S_kern[i].uc_stack.ss_flags = 0;
 
-  makecontext(&(S_kern[i]), (void (*)(void))&S_kernel_trampoline, 1, i);
+  /* Grow the table first, so that the handler never sees it full. */
+  tab = S_range;
+  if (!tab || S_nrange == tab->cap) {
+    len = tab ? 2*(sizeof(*tab)+tab->cap*sizeof(struct S_range)) :\
+      (size_t)OOC_PAGE_SIZE;
+    tab = mmap(NULL, len, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS,\
+      -1, 0);
+    if (MAP_FAILED == tab) {
+      ret = pthread_mutex_unlock(&S_range_lock);
+      assert(!ret);
+      return -1;
+    }
+    tab->cap = (len-sizeof(*tab))/sizeof(struct S_range);
+    if (S_nrange) {
+      memcpy(tab->range, S_range->range, S_nrange*sizeof(struct S_range));
+    }
+  }
+  range = tab->range;
+
+  (void)__sync_fetch_and_add(&S_range_seq, 1);
+
+  i = S_range_find(range, S_nrange, (uintptr_t)beg);
+  memmove(range+i+1, range+i, (S_nrange-i)*sizeof(struct S_range));
+  range[i].beg = (uintptr_t)beg;
+  range[i].end = (uintptr_t)end;
+  S_range = tab;
+  S_nrange++;
+
+  (void)__sync_fetch_and_add(&S_range_seq, 1);
+
+  ret = pthread_mutex_unlock(&S_range_lock);
+  assert(!ret);
 
   return 0;
 }
 
 
-static int
-S_init(void)
+void
+sched_range_del(void * const beg)
 {
-  int ret, i;
-  struct sigaction act;
-
-  S_ps = (uintptr_t)OOC_PAGE_SIZE;
+  int ret;
+  size_t i;
+  struct S_range * range;
 
-  memset(&act, 0, sizeof(act));
-  act.sa_sigaction = &S_sigsegv_trampoline;
-  act.sa_flags = SA_SIGINFO;
-  ret = sigaction(SIGSEGV, &act, &S_old_act);
+  ret = pthread_mutex_lock(&S_range_lock);
   assert(!ret);
 
-  for (i=0; i<OOC_NUM_FIBERS; ++i) {
-    ret = S_kern_init(i);
+  range = S_range ? S_range->range : NULL;
+  i = S_range_find(range, S_nrange, (uintptr_t)beg);
+  if (i < S_nrange && (uintptr_t)beg == range[i].beg) {
+    (void)__sync_fetch_and_add(&S_range_seq, 1);
+
+    memmove(range+i, range+i+1, (S_nrange-i-1)*sizeof(struct S_range));
+    S_nrange--;
+
+    (void)__sync_fetch_and_add(&S_range_seq, 1);
+  }
+
+  /* The library was finalized while this range was live. */
+  if (!S_nrange && S_unhook) {
+    ret = sigaction(SIGSEGV, &S_old_act, NULL);
     assert(!ret);
+    S_hooked = 0;
+    S_unhook = 0;
   }
 
-  S_is_init = 1;
+  ret = pthread_mutex_unlock(&S_range_lock);
+  assert(!ret);
+}
 
-  return ret;
+
+int
+sched_init(void)
+{
+  if (2 == *(int volatile*)&S_global && S_is_init) {
+    return 0;
+  }
+  return S_init();
 }
 
 
@@ -300,66 +932,218 @@ ooc_finalize(void)
 {
   int ret;
 
-  ret = sigaction(SIGSEGV, &S_old_act, NULL);
+  /* Only one thread finalizes, and only once per initialization. */
+  if (!__sync_bool_compare_and_swap(&S_global, 2, 1)) {
+    return 0;
+  }
 
-  S_is_init = 0;
+  /* The handler is removed now, unless some allocation is live, in which case
+   * it is removed once the last one is freed, see sched_range_del(). */
+  ret = pthread_mutex_lock(&S_range_lock);
+  assert(!ret);
+  if (S_nrange) {
+    S_unhook = 1;
+  }
+  else if (S_hooked) {
+    ret = sigaction(SIGSEGV, &S_old_act, NULL);
+    S_hooked = 0;
+  }
+  ret |= pthread_mutex_unlock(&S_range_lock);
+
+  /* Stop the ooc_parallel_for() workers and the background flushers. */
+  ret |= parallel_stop();
+  ret |= ooc_flush_stop();
+
+#ifdef OOC_TRACE
+  /* Dump trace events, if requested. */
+  if (NULL != getenv("OOC_TRACE_FILE")) {
+    ret |= ooc_trace_dump(getenv("OOC_TRACE_FILE"));
+  }
+#endif
+
+  __sync_synchronize();
+  S_global = 0;
 
   return ret;
 }
 
 
 void
-ooc_sched(void (*kern)(size_t const, void * const), size_t const i,
-          void * const args)
+ooc_access(void * const addr, size_t const len, int const mode)
 {
-  int ret, j, run=-1, idle=-1;
+  uintptr_t ps, beg, end;
+
+  ps = (uintptr_t)OOC_PAGE_SIZE;
+
+  /* [beg,end) are the whole pages of a range which is overwritten, which are
+   * neither read in nor read from. */
+  beg = end = (uintptr_t)addr+len;
+  if (mode&OOC_DISCARD) {
+    beg = ((uintptr_t)addr+ps-1)&~(ps-1);
+    end = ((uintptr_t)addr+len)&~(ps-1);
+    if (end <= beg) {
+      beg = end = (uintptr_t)addr+len;
+    }
+  }
 
-  /* Make sure that library has been initialized. */
-  if (!S_is_init) {
-    ret = S_init();
-    assert(!ret);
+  /* Inputs, and outputs which may be partially written, are read in ahead of
+   * the accesses which would otherwise fault them in a page at a time. */
+  if (mode&(OOC_READ|OOC_WRITE)) {
+    page_prefetch(addr, beg-(uintptr_t)addr);
+    page_prefetch((void*)end, (uintptr_t)addr+len-end);
   }
 
-  /* Search for a fiber that is either blocked or idle. */
-  for (j=0; j<OOC_NUM_FIBERS; ++j) {
-    if (/* FIXME is runnable */0) {
-      run = j;
-      break;
-    }
-    else if (/* FIXME is idle */1) {
-      idle = j;
-      break;
+  if (mode&OOC_WRITE) {
+    /* Make outputs writable now, rather than with a read fault followed by a
+     * write fault on each page. */
+    page_dirty((void*)beg, end-beg, 1);
+    page_dirty(addr, len, 0);
+
+    /* Remember the output, so that it is flushed when the kernel returns. */
+    if (S_is_init && S_wr_nr[S_me] < OOC_ACCESS_MAX) {
+      S_wr_addr[S_me][S_wr_nr[S_me]] = addr;
+      S_wr_len[S_me][S_wr_nr[S_me]]  = len;
+      S_wr_nr[S_me]++;
     }
   }
+}
 
-  for (;;) {
-    if (-1 != run) {
-      S_me = run;
-      ret = swapcontext(&S_main, &(S_handler[S_me]));
-      assert(!ret);
-    }
-    else if (-1 != idle) {
-      S_iter[idle] = i;
-      S_kernel[idle] = kern;
-      S_args[idle] = args;
 
-      S_me = idle;
-      ret = swapcontext(&S_main, &(S_kern[S_me]));
-      assert(!ret);
+/*! Account for fiber j, once it has switched back to the main context, as
+ *  yielded or idle. */
+static void
+S_park(int const j)
+{
+  if (S_YIELD == S_state[j]) {
+    S_ring[(S_ring_head+S_nring++)%S_nfibers] = j;
+  }
+  else {
+    S_stack_put(S_stack[j]);
+    S_stack[j] = NULL;
+    S_idle[S_nidle++] = j;
+  }
+}
 
-      /* This is the only place we can safely break from this loop, since this
-       * is the only point that we know that iteration i has been assigned to a
-       * fiber. */
-      break;
-    }
-    else {
-      /* TODO Wait for a fiber to become runnable. Since we are in the `main`
-       * context, all fibers must be blocked on async-io, thus no fiber will
-       * become idle, so we just wait on async-io. */
-      /*ret = aio_suspend(_aiolist, OOC_NUM_FIBERS, NULL);
-      assert(!ret);*/
+
+/*! Resume the fiber which yielded longest ago, until it yields again or
+ *  completes. */
+static void
+S_resume(void)
+{
+  int ret, j;
+
+  j = S_ring[S_ring_head];
+  S_ring_head = (S_ring_head+1)%S_nfibers;
+  S_nring--;
+
+  S_me = j;
+  S_state[j] = S_RUN;
+  S_fiber = 1;
+  STATS_ADD(switches, 1);
+  TRACE_EVENT(OOC_TRACE_SWITCH, j);
+  ret = swapcontext(&S_main, &(S_handler[j]));
+  assert(!ret);
+  S_fiber = 0;
+
+  S_park(j);
+}
+
+
+/*! Resume each fiber which yielded once, returns the number of fibers which
+ *  are still yielded. */
+int
+sched_poll(void)
+{
+  int k, nr;
+
+  if (!S_is_init) {
+    return 0;
+  }
+
+  for (nr=S_nring,k=0; k<nr; ++k) {
+    S_resume();
+  }
+
+  return S_nring;
+}
+
+
+void
+ooc_yield(void)
+{
+  int ret;
+
+  /* Outside of a fiber, there is nothing to switch to. */
+  if (!S_fiber) {
+    (void)sched_yield();
+    return;
+  }
+
+  S_state[S_me] = S_YIELD;
+  S_fiber = 0;
+  TRACE_EVENT(OOC_TRACE_SWITCH, OOC_TRACE_MAIN);
+  ret = swapcontext(&(S_handler[S_me]), &S_main);
+  assert(!ret);
+}
+
+
+void
+ooc_wait(void)
+{
+  while (sched_poll()) {
+    /* Every fiber is blocked, so let other threads, which may release them,
+     * run. */
+    (void)sched_yield();
+  }
+}
+
+
+void
+ooc_sched(void (*kern)(size_t const, void * const), size_t const i,
+          void * const args)
+{
+  int ret, j;
+
+  /* Make sure that library has been initialized. */
+  ret = sched_init();
+  assert(!ret);
+
+  /* Give the fiber which yielded longest ago a chance to make progress, and
+   * then resume the fibers which yielded until one is idle. Starting a new
+   * iteration is otherwise preferred, since with many fibers, resuming each of
+   * them would cost more than the iteration itself. */
+  if (S_nring) {
+    S_resume();
+  }
+  while (!S_nidle) {
+    if (sched_poll() == S_nfibers) {
+      (void)sched_yield();
     }
   }
+
+  j = S_idle[--S_nidle];
+
+  S_stack[j] = S_stack_get();
+  assert(S_stack[j]);
+
+  S_iter[j] = i;
+  S_kernel[j] = kern;
+  S_args[j] = args;
+
+  ret = S_kern_init(j);
+  assert(!ret);
+
+  /* Run iteration i until it completes, or yields. */
+  S_me = j;
+  S_state[j] = S_RUN;
+  S_fiber = 1;
+  STATS_ADD(switches, 1);
+  TRACE_EVENT(OOC_TRACE_SWITCH, S_me);
+  ret = swapcontext(&S_main, &(S_kern[S_me]));
+  assert(!ret);
+  S_fiber = 0;
+
+  S_park(j);
 }
 
 
@@ -382,7 +1166,10 @@ main(void)
   int ret;
   char var;
   size_t ps;
+  void * mem;
+  unsigned char pflags[1]={0};
   struct vm_area * vma;
+  struct ooc_stats stats;
 
   /* This would be set in ooc_sched normally. */
   S_me = 0;
@@ -393,19 +1180,24 @@ main(void)
   ret = sp_tree_init(&vma_tree);
   assert(!ret);
 
-  vma = mmap(NULL, 2*ps, PROT_NONE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
-  assert(MAP_FAILED != vma);
-  ret = mprotect(vma, ps, PROT_READ|PROT_WRITE);
-  assert(!ret);
+  mem = mmap(NULL, ps, PROT_NONE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+  assert(MAP_FAILED != mem);
 
-  vma->vm_start = (void*)((char*)vma+ps);
-  vma->vm_end   = (void*)((char*)vma->vm_start+ps);
+  vma = vma_alloc();
+  assert(vma);
+  vma->vm_start  = mem;
+  vma->vm_end    = (void*)((char*)vma->vm_start+ps);
+  vma->vm_pflags = pflags;
+  vma->vm_off    = 0;
+  vma->vm_shm    = NULL;
 
   ret = S_init();
   assert(!ret);
 
   ret = sp_tree_insert(&vma_tree, vma);
   assert(!ret);
+  ret = sched_range_add(vma->vm_start, vma->vm_end);
+  assert(!ret);
 
   ((char*)vma->vm_start)[0] = 'a'; /* Raise a SIGSEGV. */
   assert(&(((char*)vma->vm_start)[0]) == (void*)S_addr[S_me]);
@@ -418,10 +1210,21 @@ main(void)
   ret = ooc_finalize();
   assert(!ret);
 
-  ret = sp_tree_remove(&vma_tree, vma->vm_start);
+  assert((OOC_PAGE_SYNC|OOC_PAGE_DIRTY) == (pflags[0]&(OOC_PAGE_SYNC|OOC_PAGE_DIRTY)));
+
+  /* One fault to make the page readable, and one to make it writable. */
+  ret = ooc_stats(&stats);
+  assert(!ret);
+  assert(1 == stats.rd_faults);
+  assert(1 == stats.wr_faults);
+  assert(2 == stats.mn_faults);
+  assert(0 == stats.mj_faults);
+
+  sched_range_del(mem);
+  ret = sp_tree_remove(&vma_tree, mem);
   assert(!ret);
 
-  ret = munmap(vma, 2*ps);
+  ret = munmap(mem, ps);
   assert(!ret);
 
   ret = sp_tree_free(&vma_tree);
@@ -0,0 +1,1053 @@
+/*
+Copyright (c) 2016 Jeremy Iverson
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+
+#ifndef _GNU_SOURCE
+  #define _GNU_SOURCE /* Expose memfd_create, MFD_*, fallocate, FALLOC_FL_* */
+#endif
+
+/* assert */
+#include <assert.h>
+
+/* errno, EBUSY, EEXIST, ESRCH, ETIMEDOUT */
+#include <errno.h>
+
+/* fallocate, fcntl, open, FALLOC_FL_*, F_DUPFD_CLOEXEC, O_* */
+#include <fcntl.h>
+
+/* kill */
+#include <signal.h>
+
+/* snprintf */
+#include <stdio.h>
+
+/* offsetof */
+#include <stddef.h>
+
+/* uintptr_t */
+#include <stdint.h>
+
+/* NULL, malloc, free */
+#include <stdlib.h>
+
+/* memcpy, memset, strlen, strncmp */
+#include <string.h>
+
+/* memfd_create, mmap, mprotect, munmap, MAP_*, MFD_*, PROT_* */
+#include <sys/mman.h>
+
+/* fstat, stat, struct stat, S_IRUSR, S_IWUSR */
+#include <sys/stat.h>
+
+/* nanosleep, struct timespec */
+#include <time.h>
+
+/* close, ftruncate, getpid, pread, pwrite, unlink */
+#include <unistd.h>
+
+/* function prototypes */
+#include "include/ooc.h"
+
+/* */
+#include "common.h"
+
+
+/*
+ *  A shared region is a memfd, which each attached process maps with
+ *  MAP_SHARED, so that its resident pages exist once, whichever processes
+ *  touch them. The memfd starts with a struct shm_ctl, which holds the budget
+ *  and resident page count of the region, and the flags and holder masks of
+ *  its pages, so that the ordinary fault, prefetch and eviction paths work on
+ *  the region through a vma whose vm_pflags point into the memfd. Page locks
+ *  are bits in the flags, so they serialize faults and evictions across the
+ *  processes too.
+ *
+ *  The region is backed by a file, OOC_SWAP_DIR/ooc-shm-<name>, whose first
+ *  page records the process which created the region and each process which
+ *  has it mapped, with their descriptors of the memfd, by which other processes
+ *  open the memfd through /proc, as long as one of them is alive. Pages are
+ *  copied between the memfd and the file with pread()/pwrite(), since
+ *  page_read() installs pages which are private to the process, and an
+ *  evicted page is punched out of the memfd, which releases its memory for
+ *  every process.
+ *
+ *  Eviction is coordinated through the holder masks. A process sets its bit for
+ *  a page before the page becomes accessible to it and clears it once the page
+ *  is inaccessible again. A page is only written back or evicted by a process
+ *  which holds its lock while no other process holds it, so no process can
+ *  observe an evicted page, or modify a page while it is written. A process
+ *  which finds a cold page held by others drops its own access to it instead,
+ *  so the last process to let go of a page evicts it, and a region may exceed
+ *  its budget while its pages are held by processes which do not fault.
+ */
+
+
+/*! Magic number of an initialized control block and backing-store header. */
+#define S_MAGIC 0x6f6f632d73686dUL
+
+#define ALIGN(M)   (((M)+(size_t)OOC_PAGE_SIZE-1)&(~((size_t)OOC_PAGE_SIZE-1)))
+
+
+/*! Header of the backing store, at its first page. */
+struct S_head
+{
+  unsigned long magic;        /* S_MAGIC, once pid and fd are valid */
+  int pid;                    /* process which created the region */
+  int fd;                     /* its descriptor of the memfd */
+  struct
+  {
+    int pid;                  /* process attached in slot i, or 0 */
+    int fd;                   /* its descriptor of the memfd */
+  } proc[OOC_SHM_MAX_PROCS];
+};
+
+
+/*! Compute the size of the memfd segments of a region of size bytes. The info
+ *  segment holds the control block, and a holder mask and flag byte per
+ *  page. */
+static void
+S_layout(size_t const size, size_t * const info_sz, size_t * const data_sz)
+{
+  size_t npages;
+
+  *data_sz = ALIGN(size);
+  npages   = *data_sz/(size_t)OOC_PAGE_SIZE;
+  *info_sz = ALIGN(ALIGN(sizeof(struct shm_ctl))+\
+                   npages*(sizeof(unsigned long long)+1));
+}
+
+
+/*! Transfer size bytes between buf and fd at off, retrying partial transfers.
+ *  Reading beyond EOF leaves the rest of buf alone. */
+static int
+S_xfer(int const fd, int const write, char * const buf, size_t const size,
+       size_t const off)
+{
+  ssize_t ret=0;
+  size_t done;
+
+  for (done=0; done<size; done+=(size_t)ret) {
+    if (write) {
+      ret = pwrite(fd, buf+done, size-done, (off_t)(off+done));
+    }
+    else {
+      ret = pread(fd, buf+done, size-done, (off_t)(off+done));
+    }
+    if (-1 == ret) {
+      return -1;
+    }
+    if (0 == ret) {
+      break;
+    }
+  }
+
+  return 0;
+}
+
+
+/*! Create a region of size bytes, whose backing store bfd, at path, has just
+ *  been created. Returns the memfd, or -1 on failure, in which case the
+ *  backing store is removed. */
+static int
+S_create(int const bfd, char const * const path, char const * const name,
+         size_t const size)
+{
+  int ret, fd;
+  size_t info_sz, data_sz;
+  struct shm_ctl * ctl;
+  struct S_head head;
+
+  if (!size) {
+    goto fn_fail;
+  }
+
+  fd = memfd_create(name, MFD_CLOEXEC);
+  if (-1 == fd) {
+    goto fn_fail;
+  }
+
+  S_layout(size, &info_sz, &data_sz);
+
+  ret = ftruncate(fd, (off_t)(info_sz+data_sz));
+  if (ret) {
+    goto fn_close;
+  }
+
+  ctl = mmap(NULL, sizeof(*ctl), PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+  if (MAP_FAILED == ctl) {
+    goto fn_close;
+  }
+
+  /* The rest of the memfd is zero-filled, i.e., all pages are free, not
+   * resident and held by no process. */
+  ctl->size = size;
+  memcpy(ctl->path, path, strlen(path)+1);
+  __sync_synchronize();
+  ctl->magic = S_MAGIC;
+
+  ret = munmap(ctl, sizeof(*ctl));
+  assert(!ret);
+
+  /* Publish the region, magic number last. */
+  memset(&head, 0, sizeof(head));
+  head.pid   = (int)getpid();
+  head.fd    = fd;
+  ret = S_xfer(bfd, 1, (char*)&head, sizeof(head), 0);
+  if (ret) {
+    goto fn_close;
+  }
+  head.magic = S_MAGIC;
+  ret = S_xfer(bfd, 1, (char*)&head.magic, sizeof(head.magic), 0);
+  if (ret) {
+    goto fn_close;
+  }
+
+  ret = close(bfd);
+  assert(!ret);
+
+  return fd;
+
+  fn_close:
+  ret = close(fd);
+  assert(!ret);
+
+  fn_fail:
+  (void)unlink(path);
+  ret = close(bfd);
+  assert(!ret);
+
+  return -1;
+}
+
+
+/*! Open the memfd of a region through the descriptor fd of process pid, and
+ *  check that it is the region whose backing store is at path. Sets *live if
+ *  pid has not exited. */
+static int
+S_open(char const * const path, int const pid, int const fd, int * const live)
+{
+  int ret, mfd;
+  char proc[64];
+  struct shm_ctl ctl;
+
+  if (pid <= 0 || (kill(pid, 0) && ESRCH == errno)) {
+    return -1;
+  }
+  *live = 1;
+
+  ret = snprintf(proc, sizeof(proc), "/proc/%d/fd/%d", pid, fd);
+  if (ret < 0 || (size_t)ret >= sizeof(proc)) {
+    return -1;
+  }
+
+  mfd = open(proc, O_RDWR|O_CLOEXEC);
+  if (-1 == mfd) {
+    return -1;
+  }
+
+  /* The process may have closed the descriptor, and reused it. */
+  ret = S_xfer(mfd, 0, (char*)&ctl, sizeof(ctl), 0);
+  if (ret || S_MAGIC != ctl.magic ||\
+      strncmp(ctl.path, path, sizeof(ctl.path)))
+  {
+    ret = close(mfd);
+    assert(!ret);
+    return -1;
+  }
+
+  return mfd;
+}
+
+
+/*! Open the memfd of the region whose backing store is at path, through the
+ *  process which created it, or any process which is attached to it. Returns
+ *  -1 with errno set to ESRCH if the region is gone, i.e., the backing store
+ *  has been removed or all of those processes have exited, or to EBUSY if they
+ *  have not, but the memfd cannot be opened through any of them. The inode of
+ *  the backing store is stored in *st. */
+static int
+S_attach(char const * const path, struct stat * const st)
+{
+  int ret, bfd, fd, i, live=0;
+  struct timespec ts;
+  struct S_head head;
+
+  bfd = open(path, O_RDONLY|O_CLOEXEC);
+  if (-1 == bfd) {
+    if (ENOENT == errno) {
+      errno = ESRCH;
+    }
+    return -1;
+  }
+
+  ret = fstat(bfd, st);
+  assert(!ret);
+
+  /* Wait for the creator to publish the region. */
+  ts.tv_sec  = 0;
+  ts.tv_nsec = 1000000L;
+  for (i=0; i<OOC_SHM_TIMEOUT; ++i) {
+    head.magic = 0;
+    ret = S_xfer(bfd, 0, (char*)&head, sizeof(head), 0);
+    if (!ret && S_MAGIC == head.magic) {
+      break;
+    }
+    (void)nanosleep(&ts, NULL);
+  }
+
+  ret = close(bfd);
+  assert(!ret);
+
+  if (OOC_SHM_TIMEOUT == i) {
+    errno = ETIMEDOUT;
+    return -1;
+  }
+
+  if (-1 != (fd=S_open(path, head.pid, head.fd, &live))) {
+    return fd;
+  }
+  for (i=0; i<OOC_SHM_MAX_PROCS; ++i) {
+    fd = S_open(path, head.proc[i].pid, head.proc[i].fd, &live);
+    if (-1 != fd) {
+      return fd;
+    }
+  }
+
+  errno = live ? EBUSY : ESRCH;
+  return -1;
+}
+
+
+/*! Record in the backing store header that the calling process is attached in
+ *  slot i, with descriptor fd of the memfd, or, if fd is -1, that it is no
+ *  longer attached. */
+static int
+S_slot_publish(struct shm * const shm, int const i, int const fd)
+{
+  int ent[2];
+
+  ent[0] = -1 == fd ? 0 : (int)getpid();
+  ent[1] = fd;
+
+  return S_xfer(shm->bfd, 1, (char*)ent, sizeof(ent),\
+    offsetof(struct S_head, proc)+(size_t)i*sizeof(ent));
+}
+
+
+/*! Claim a slot of the control block for the calling process, releasing the
+ *  slots, and holds, of any attached process which has exited. */
+static int
+S_slot_get(struct shm * const shm, size_t const npages)
+{
+  int i, pid, me;
+  size_t ip;
+  struct shm_ctl * ctl;
+
+  ctl = shm->ctl;
+  me  = (int)getpid();
+
+  for (i=0; i<OOC_SHM_MAX_PROCS; ++i) {
+    pid = *(int volatile*)&(ctl->pid[i]);
+
+    if (pid && kill(pid, 0) && ESRCH == errno &&\
+        __sync_bool_compare_and_swap(&(ctl->pid[i]), pid, -1))
+    {
+      for (ip=0; ip<npages; ++ip) {
+        (void)__sync_fetch_and_and(&(shm->holder[ip]), ~(1ULL<<i));
+      }
+      __sync_synchronize();
+      ctl->pid[i] = pid = 0;
+    }
+
+    if (!pid && __sync_bool_compare_and_swap(&(ctl->pid[i]), 0, me)) {
+      shm->me = 1ULL<<i;
+      return 0;
+    }
+  }
+
+  return -1;
+}
+
+
+int
+ooc_shm_open(char const * const name, size_t const size)
+{
+  int ret, fd, bfd, i;
+  char path[sizeof(((struct shm_ctl*)NULL)->path)];
+  struct stat st, cur;
+
+  ret = snprintf(path, sizeof(path), "%s/ooc-shm-%s", OOC_SWAP_DIR, name);
+  if (ret < 0 || (size_t)ret >= sizeof(path)) {
+    return -1;
+  }
+
+  for (i=0; i<2; ++i) {
+    bfd = open(path, O_RDWR|O_CREAT|O_EXCL|O_CLOEXEC, S_IRUSR|S_IWUSR);
+    if (-1 != bfd) {
+      return S_create(bfd, path, name, size);
+    }
+    if (EEXIST != errno) {
+      return -1;
+    }
+
+    fd = S_attach(path, &st);
+    if (-1 != fd || ESRCH != errno) {
+      return fd;
+    }
+
+    /* Every process which had the region has exited, so replace it, unless
+     * another process already has. */
+    if (!stat(path, &cur) && cur.st_dev == st.st_dev &&\
+        cur.st_ino == st.st_ino)
+    {
+      (void)unlink(path);
+    }
+  }
+
+  return -1;
+}
+
+
+void *
+ooc_malloc_shared(int const fd)
+{
+  int ret;
+  size_t info_sz, data_sz, mmap_sz;
+  void * info;
+  struct stat st;
+  struct shm_ctl * ctl;
+  struct shm * shm;
+  struct vm_area * vma;
+
+  /* Faults on the memory must be handled, whichever thread touches it. */
+  if (sched_init()) {
+    goto fn_fail;
+  }
+
+  ret = fstat(fd, &st);
+  if (ret) {
+    goto fn_fail;
+  }
+  mmap_sz = (size_t)st.st_size;
+
+  if (mmap_sz < sizeof(*ctl)) {
+    goto fn_fail;
+  }
+
+  /* Map the region, with the data segment inaccessible until it is
+   * faulted. */
+  info = mmap(NULL, mmap_sz, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+  if (MAP_FAILED == info) {
+    goto fn_fail;
+  }
+  ctl = (struct shm_ctl*)info;
+
+  if (S_MAGIC != ctl->magic) {
+    goto fn_unmap;
+  }
+
+  S_layout(ctl->size, &info_sz, &data_sz);
+  if (info_sz+data_sz != mmap_sz) {
+    goto fn_unmap;
+  }
+
+  ret = mprotect((char*)info+info_sz, data_sz, PROT_NONE);
+  if (ret) {
+    goto fn_unmap;
+  }
+
+  /* Setup attachment. */
+  shm = malloc(sizeof(*shm));
+  if (NULL == shm) {
+    goto fn_unmap;
+  }
+  shm->ctl     = ctl;
+  shm->holder  = (unsigned long long*)((char*)info+ALIGN(sizeof(*ctl)));
+  shm->info_sz = info_sz;
+
+  shm->fd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+  if (-1 == shm->fd) {
+    goto fn_free;
+  }
+
+  shm->bfd = open(ctl->path, O_RDWR|O_CLOEXEC);
+  if (-1 == shm->bfd) {
+    goto fn_close;
+  }
+
+  ret = S_slot_get(shm, data_sz/(size_t)OOC_PAGE_SIZE);
+  if (ret) {
+    goto fn_bclose;
+  }
+
+  /* Let processes which open the region later do so through this one. */
+  ret = S_slot_publish(shm, __builtin_ctzll(shm->me), shm->fd);
+  if (ret) {
+    goto fn_slot;
+  }
+
+  /* Get new vma. */
+  vma = vma_alloc();
+  if (NULL == vma) {
+    goto fn_slot;
+  }
+
+  /* Setup vma. The first page of the backing store is its header. */
+  vma->vm_flags  = 0;
+  vma->vm_start  = (void*)((char*)info+info_sz);
+  vma->vm_end    = (void*)((char*)vma->vm_start+ctl->size);
+  vma->vm_pflags = (unsigned char*)\
+    (shm->holder+data_sz/(size_t)OOC_PAGE_SIZE);
+  vma->vm_off    = (size_t)OOC_PAGE_SIZE;
+  vma->vm_shm    = shm;
+
+  /* Claim faults on the data segment. */
+  ret = sched_range_add(vma->vm_start, vma->vm_end);
+  if (ret) {
+    vma_free(vma);
+    goto fn_slot;
+  }
+
+  /* Insert new vma into page table. */
+  ret = sp_tree_insert(&vma_tree, vma);
+  if (ret) {
+    sched_range_del(vma->vm_start);
+    vma_free(vma);
+    goto fn_slot;
+  }
+
+  /* Return pointer to data segment. */
+  return vma->vm_start;
+
+  fn_slot:
+  (void)S_slot_publish(shm, __builtin_ctzll(shm->me), -1);
+  ctl->pid[__builtin_ctzll(shm->me)] = 0;
+
+  fn_bclose:
+  ret = close(shm->bfd);
+  assert(!ret);
+
+  fn_close:
+  ret = close(shm->fd);
+  assert(!ret);
+
+  fn_free:
+  free(shm);
+
+  fn_unmap:
+  ret = munmap(info, mmap_sz);
+  assert(!ret);
+
+  fn_fail:
+  return NULL;
+}
+
+
+void
+shm_free(struct vm_area * const vma)
+{
+  int ret, i;
+  size_t info_sz, data_sz, ip, npages;
+  void * info, * start;
+  struct stat st, bst;
+  struct shm_ctl * ctl;
+  struct shm * shm;
+
+  shm     = vma->vm_shm;
+  ctl     = shm->ctl;
+  start   = vma->vm_start;
+  info_sz = shm->info_sz;
+  data_sz = ALIGN((uintptr_t)vma->vm_end-(uintptr_t)vma->vm_start);
+  npages  = data_sz/(size_t)OOC_PAGE_SIZE;
+  info    = (char*)start-info_sz;
+
+  /* Wait for any thread of this process which works on the pages without
+   * holding the vma lock. The locks are shared with the other processes, so
+   * they are released again. */
+  for (ip=0; ip<npages; ++ip) {
+    page_lock(vma, ip);
+    page_unlock(vma, ip);
+  }
+
+  /* Remove from splay tree. This releases vma. */
+  ret = sp_tree_remove(&vma_tree, start);
+  assert(!ret);
+
+  /* Faults on the memory are no longer ours. */
+  sched_range_del(start);
+
+  /* Let go of the pages, so that the other processes can evict them. */
+  ret = mprotect(start, data_sz, PROT_NONE);
+  assert(!ret);
+  for (ip=0; ip<npages; ++ip) {
+    (void)__sync_fetch_and_and(&(shm->holder[ip]), ~shm->me);
+  }
+  (void)S_slot_publish(shm, __builtin_ctzll(shm->me), -1);
+  __sync_synchronize();
+  ctl->pid[__builtin_ctzll(shm->me)] = 0;
+
+  /* The last process to detach removes the backing store, unless it has
+   * already been replaced by that of another region. */
+  for (i=0; i<OOC_SHM_MAX_PROCS && !ctl->pid[i]; ++i);
+  if (OOC_SHM_MAX_PROCS == i && !fstat(shm->bfd, &bst) &&\
+      !stat(ctl->path, &st) && st.st_dev == bst.st_dev &&\
+      st.st_ino == bst.st_ino)
+  {
+    (void)unlink(ctl->path);
+  }
+
+  ret = close(shm->bfd);
+  assert(!ret);
+  ret = close(shm->fd);
+  assert(!ret);
+  free(shm);
+
+  ret = munmap(info, info_sz+data_sz);
+  assert(!ret);
+}
+
+
+int
+ooc_shm_set_budget(void * const ptr, size_t const size)
+{
+  int ret;
+  struct vm_area * vma;
+
+  ret = sp_tree_find_and_lock(&vma_tree, ptr, (void*)&vma);
+  assert(!ret);
+
+  if (vma->vm_shm) {
+    vma->vm_shm->ctl->budget = size/(size_t)OOC_PAGE_SIZE;
+  }
+  else {
+    /* Not an ooc_malloc_shared() allocation. */
+    ret = -1;
+  }
+
+  if (lock_let(&(vma->vm_lock))) {
+    ret = -1;
+  }
+
+  return ret;
+}
+
+
+void
+shm_hold(struct vm_area const * const vma, size_t const ip)
+{
+  (void)__sync_fetch_and_or(&(vma->vm_shm->holder[ip]), vma->vm_shm->me);
+}
+
+
+void
+shm_drop(struct vm_area const * const vma, size_t const ip)
+{
+  (void)__sync_fetch_and_and(&(vma->vm_shm->holder[ip]), ~vma->vm_shm->me);
+}
+
+
+int
+shm_held(struct vm_area const * const vma, size_t const ip)
+{
+  return 0 != (*(unsigned long long volatile*)&(vma->vm_shm->holder[ip])&\
+               vma->vm_shm->me);
+}
+
+
+int
+shm_busy(struct vm_area const * const vma, size_t const ip)
+{
+  return 0 != (*(unsigned long long volatile*)&(vma->vm_shm->holder[ip])&\
+               ~vma->vm_shm->me);
+}
+
+
+/*! Copy nr pages of shared vma, starting at page ip, between its memfd and its
+ *  backing store, through a private buffer. */
+static int
+S_copy(struct vm_area const * const vma, size_t const ip, size_t const nr,
+       int const write)
+{
+  int ret, src, dst;
+  size_t ps, len;
+  unsigned long long beg;
+  char * buf;
+
+  ps  = (size_t)OOC_PAGE_SIZE;
+  len = nr*ps;
+
+  buf = mmap(NULL, len, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+  if (MAP_FAILED == buf) {
+    return -1;
+  }
+
+  src = write ? vma->vm_shm->fd : vma->vm_shm->bfd;
+  dst = write ? vma->vm_shm->bfd : vma->vm_shm->fd;
+
+  beg = stats_io_begin();
+  TRACE_EVENT(OOC_TRACE_IO_BEG, len);
+
+  ret = S_xfer(src, 0, buf, len, write ? vma->vm_shm->info_sz+ip*ps :\
+               vma->vm_off+ip*ps);
+  if (!ret) {
+    ret = S_xfer(dst, 1, buf, len, write ? vma->vm_off+ip*ps :\
+                 vma->vm_shm->info_sz+ip*ps);
+  }
+
+  stats_io_end(beg, ret ? 0 : len, write);
+  TRACE_EVENT(OOC_TRACE_IO_END, ret ? 0 : len);
+
+  if (munmap(buf, len)) {
+    ret = -1;
+  }
+
+  return ret;
+}
+
+
+int
+shm_read(struct vm_area const * const vma, size_t const ip, size_t const nr)
+{
+  int ret;
+  size_t ps;
+
+  ps = (size_t)OOC_PAGE_SIZE;
+
+  /* The pages are filled through the memfd, so they need not be accessible
+   * while they are incomplete. */
+  ret = S_copy(vma, ip, nr, 0);
+  if (ret) {
+    return ret;
+  }
+
+  return mprotect((char*)vma->vm_start+ip*ps, nr*ps, PROT_READ);
+}
+
+
+int
+shm_write(struct vm_area const * const vma, size_t const ip, size_t const nr)
+{
+  return S_copy(vma, ip, nr, 1);
+}
+
+
+int
+shm_punch(struct vm_area const * const vma, size_t const ip, size_t const nr)
+{
+  size_t ps;
+
+  ps = (size_t)OOC_PAGE_SIZE;
+
+  return fallocate(vma->vm_shm->fd, FALLOC_FL_PUNCH_HOLE|FALLOC_FL_KEEP_SIZE,\
+                   (off_t)(vma->vm_shm->info_sz+ip*ps), (off_t)(nr*ps));
+}
+
+
+#ifdef TEST
+/* assert */
+#include <assert.h>
+
+/* EXIT_SUCCESS */
+#include <stdlib.h>
+
+/* waitpid, WIFEXITED, WEXITSTATUS */
+#include <sys/wait.h>
+
+/* access, fork, pipe, read, write, F_OK */
+#include <unistd.h>
+
+#define N_PAGES  64
+#define N_BUDGET 16
+
+static void
+S_fill(size_t const i, void * const args)
+{
+  size_t ps, ip;
+  char * mem;
+
+  ps = (size_t)OOC_PAGE_SIZE;
+  mem = (char*)args;
+
+  for (ip=0; ip<N_PAGES; ++ip) {
+    mem[ip*ps] = (char)(ip+i);
+  }
+}
+
+static void
+S_check(size_t const i, void * const args)
+{
+  size_t ps, ip;
+  char * mem;
+
+  ps = (size_t)OOC_PAGE_SIZE;
+  mem = (char*)args;
+
+  for (ip=0; ip<N_PAGES; ++ip) {
+    assert((char)(ip+i) == mem[ip*ps]);
+  }
+}
+
+/* Get the control block of the region at mem, and count its resident
+ * pages. */
+static struct shm_ctl *
+S_ctl(void * const mem, size_t * const nsync)
+{
+  int ret;
+  size_t ip;
+  struct shm_ctl * ctl;
+  struct vm_area * vma;
+
+  ret = sp_tree_find_and_lock(&vma_tree, mem, (void*)&vma);
+  assert(!ret);
+  assert(vma->vm_shm);
+  ctl = vma->vm_shm->ctl;
+  for (*nsync=0,ip=0; ip<N_PAGES; ++ip) {
+    *nsync += (vma->vm_pflags[ip]&OOC_PAGE_SYNC) ? 1 : 0;
+  }
+  ret = lock_let(&(vma->vm_lock));
+  assert(!ret);
+
+  return ctl;
+}
+
+/* Another process, which opens the region by name once it has been filled,
+ * and then refills it. */
+static int
+S_child(char const * const name, int const rfd)
+{
+  int ret, fd;
+  size_t nsync;
+  char c, * mem;
+  struct ooc_stats stats;
+
+  ret = (int)read(rfd, &c, 1);
+  assert(1 == ret);
+
+  fd = ooc_shm_open(name, 0);
+  assert(-1 != fd);
+  mem = ooc_malloc_shared(fd);
+  assert(mem);
+
+  /* Pages which the parent evicted are read from the shared backing store,
+   * those which it still holds cannot be evicted by this process. */
+  ooc_sched(&S_check, 1, mem);
+  ret = ooc_stats(&stats);
+  assert(!ret);
+  assert(stats.mj_faults > 0);
+  assert(S_ctl(mem, &nsync)->resident <= 2*(N_BUDGET+1));
+
+  ooc_sched(&S_fill, 2, mem);
+
+  ooc_free(mem);
+  ret = close(fd);
+  assert(!ret);
+
+  return EXIT_SUCCESS;
+}
+
+/* A process which creates and fills a region once told to, and detaches from
+ * it and exits once told to again. */
+static int
+S_creator(char const * const name, int const rfd, int const wfd)
+{
+  int ret, fd;
+  char c, * mem;
+
+  ret = (int)read(rfd, &c, 1);
+  assert(1 == ret);
+
+  fd = ooc_shm_open(name, N_PAGES*(size_t)OOC_PAGE_SIZE);
+  assert(-1 != fd);
+  mem = ooc_malloc_shared(fd);
+  assert(mem);
+  ooc_sched(&S_fill, 3, mem);
+
+  ret = (int)write(wfd, "", 1);
+  assert(1 == ret);
+  ret = (int)read(rfd, &c, 1);
+  assert(1 == ret);
+
+  ooc_free(mem);
+  ret = close(fd);
+  assert(!ret);
+
+  return EXIT_SUCCESS;
+}
+
+/* A process which opens a region once told to, after its creator has exited,
+ * and checks its contents. */
+static int
+S_joiner(char const * const name, int const rfd)
+{
+  int ret, fd;
+  char c, * mem;
+
+  ret = (int)read(rfd, &c, 1);
+  assert(1 == ret);
+
+  fd = ooc_shm_open(name, 0);
+  assert(-1 != fd);
+  mem = ooc_malloc_shared(fd);
+  assert(mem);
+  ooc_sched(&S_check, 3, mem);
+
+  ooc_free(mem);
+  ret = close(fd);
+  assert(!ret);
+
+  return EXIT_SUCCESS;
+}
+
+/* Fork a process which runs fn, or S_creator() if fn is NULL, with the read end
+ * of a pipe from this process, and the write end of up. */
+static pid_t
+S_fork(int (*fn)(char const *, int), char const * const name, int * const down,
+       int const up)
+{
+  int ret;
+  pid_t pid;
+
+  ret = pipe(down);
+  assert(!ret);
+  pid = fork();
+  assert(-1 != pid);
+  if (!pid) {
+    exit(fn ? fn(name, down[0]) : S_creator(name, down[0], up));
+  }
+
+  return pid;
+}
+
+static void
+S_wait(pid_t const pid)
+{
+  int ret, status;
+
+  ret = (int)waitpid(pid, &status, 0);
+  assert(pid == ret);
+  assert(WIFEXITED(status) && EXIT_SUCCESS == WEXITSTATUS(status));
+}
+
+int
+main(void)
+{
+  int ret, fd, pfd[2], cfd[2], jfd[2], up[2];
+  size_t ps, nsync;
+  pid_t pid, cpid, jpid;
+  char name[64], name2[64], path[256], path2[256], c;
+  char * mem, * priv;
+  struct shm_ctl * ctl;
+
+  ps = (size_t)OOC_PAGE_SIZE;
+
+  ret = snprintf(name, sizeof(name), "test-%d", (int)getpid());
+  assert(ret > 0 && (size_t)ret < sizeof(name));
+  ret = snprintf(path, sizeof(path), "%s/ooc-shm-%s", OOC_SWAP_DIR, name);
+  assert(ret > 0 && (size_t)ret < sizeof(path));
+  ret = snprintf(name2, sizeof(name2), "test2-%d", (int)getpid());
+  assert(ret > 0 && (size_t)ret < sizeof(name2));
+  ret = snprintf(path2, sizeof(path2), "%s/ooc-shm-%s", OOC_SWAP_DIR, name2);
+  assert(ret > 0 && (size_t)ret < sizeof(path2));
+
+  /* Fork before the library is used, as independently started processes
+   * would be. */
+  ret = pipe(up);
+  assert(!ret);
+  pid  = S_fork(&S_child, name, pfd, -1);
+  cpid = S_fork(NULL, name2, cfd, up[1]);
+  jpid = S_fork(&S_joiner, name2, jfd, -1);
+
+  fd = ooc_shm_open(name, N_PAGES*ps);
+  assert(-1 != fd);
+  mem = ooc_malloc_shared(fd);
+  assert(mem);
+  assert(NULL == ooc_malloc_shared(-1));
+
+  /* Private allocations have no budget of their own. */
+  priv = ooc_malloc(ps);
+  assert(priv);
+  assert(-1 == ooc_shm_set_budget(priv, 0));
+  ooc_free(priv);
+
+  ret = ooc_shm_set_budget(mem, N_BUDGET*ps);
+  assert(!ret);
+
+  /* A single process keeps the region within its budget. */
+  ooc_sched(&S_fill, 1, mem);
+  ctl = S_ctl(mem, &nsync);
+  assert(ctl->resident <= N_BUDGET+1);
+  assert(ctl->resident == nsync);
+
+  /* The child's writes are seen by this process, and the residency of each
+   * page is accounted once, whichever process made it resident. */
+  ret = (int)write(pfd[1], "", 1);
+  assert(1 == ret);
+  S_wait(pid);
+
+  ctl = S_ctl(mem, &nsync);
+  assert(ctl->resident == nsync);
+
+  ooc_sched(&S_check, 2, mem);
+  ctl = S_ctl(mem, &nsync);
+  assert(ctl->resident <= N_BUDGET+1);
+  assert(ctl->resident == nsync);
+
+  /* Opening the region by name from the process which created it. */
+  ret = close(ooc_shm_open(name, 0));
+  assert(!ret);
+
+  /* The last process to detach removes the backing store. */
+  ooc_free(mem);
+  ret = close(fd);
+  assert(!ret);
+  assert(-1 == access(path, F_OK));
+
+  /* Once its creator has exited, a region is opened through the processes
+   * which still have it mapped, rather than replaced. */
+  ret = (int)write(cfd[1], "", 1);
+  assert(1 == ret);
+  ret = (int)read(up[0], &c, 1);
+  assert(1 == ret);
+  fd = ooc_shm_open(name2, 0);
+  assert(-1 != fd);
+  mem = ooc_malloc_shared(fd);
+  assert(mem);
+  ret = close(fd);
+  assert(!ret);
+  ret = (int)write(cfd[1], "", 1);
+  assert(1 == ret);
+  S_wait(cpid);
+
+  ret = (int)write(jfd[1], "", 1);
+  assert(1 == ret);
+  S_wait(jpid);
+  ooc_sched(&S_check, 3, mem);
+
+  ooc_free(mem);
+  assert(-1 == access(path2, F_OK));
+
+  ret = ooc_finalize();
+  assert(!ret);
+
+  return EXIT_SUCCESS;
+}
+#endif
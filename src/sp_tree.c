@@ -69,6 +69,9 @@ THE SOFTWARE.
 /* NULL */
 #include <stdlib.h>
 
+/* OOC_LOCK_* */
+#include "include/ooc.h"
+
 /* */
 #include "common.h"
 
@@ -116,6 +119,8 @@ S_sp_node_init(struct sp_node * const n)
 
   ret = lock_init(&(n->vm_lock));
   assert(!ret);
+  ret = lock_class(&(n->vm_lock), OOC_LOCK_VMA);
+  assert(!ret);
 }
 
 
@@ -257,6 +262,8 @@ sp_tree_init(struct sp_tree * const sp)
 
   ret = lock_init(&(sp->lock));
   assert(!ret);
+  ret = lock_class(&(sp->lock), OOC_LOCK_TREE);
+  assert(!ret);
 
   return 0;
 }
@@ -381,6 +388,90 @@ sp_tree_find_and_lock(struct sp_tree * const sp, void * const vm_addr,
 }
 
 
+/*! Find and lock the first node containing or following vm_addr. If skip,
+ *  nodes whose lock is held by someone else are skipped, otherwise the lock of
+ *  the first node is waited for. Returns -1 if there is no such node. */
+static int
+S_sp_tree_find_next(struct sp_tree * const sp, void * const vm_addr,
+                    struct sp_node ** const zp, int const skip)
+{
+  int ret;
+  struct sp_node * n;
+
+  /* Lock splay tree. */
+  ret = lock_get(&(sp->lock));
+  assert(!ret);
+
+  if (!sp->root) {
+    /* Unlock splay tree. */
+    ret = lock_let(&(sp->lock));
+    assert(!ret);
+
+    return -1;
+  }
+
+  /* Splay vm_addr to root of tree. The node containing vm_addr, if any, is then
+   * either sp->root or sp->root->vm_prev, otherwise the first node following
+   * vm_addr is either sp->root or sp->root->vm_next. */
+  sp->root = S_sp_tree_splay(vm_addr, sp->root);
+
+  n = sp->root;
+  if (n->vm_start <= vm_addr) {
+    if (n->vm_end <= vm_addr) {
+      n = n->vm_next;
+    }
+  }
+  else if (n->vm_prev && vm_addr < n->vm_prev->vm_end) {
+    n = n->vm_prev;
+  }
+
+  if (!skip) {
+    /* Lock the first node. */
+    if (n) {
+      ret = lock_get(&(n->vm_lock));
+      assert(!ret);
+    }
+  }
+  else {
+    /* Lock the first node that is not already locked. */
+    for (; n && lock_try(&(n->vm_lock)); n=n->vm_next);
+  }
+
+  /* Unlock splay tree. */
+  ret = lock_let(&(sp->lock));
+  assert(!ret);
+
+  if (!n) {
+    return -1;
+  }
+
+  /* Set output variable. */
+  *zp = n;
+
+  return 0;
+}
+
+
+/*! NOTE Nodes whose lock is held by someone else are skipped, so this never
+ *  blocks on a node lock. Returns -1 if there is no such node. */
+int
+sp_tree_find_next_and_lock(struct sp_tree * const sp, void * const vm_addr,
+                           struct sp_node ** const zp)
+{
+  return S_sp_tree_find_next(sp, vm_addr, zp, 1);
+}
+
+
+/*! NOTE Unlike sp_tree_find_and_lock(), vm_addr need not be in any node.
+ *  Returns -1 if there is no such node. */
+int
+sp_tree_find_first_and_lock(struct sp_tree * const sp, void * const vm_addr,
+                            struct sp_node ** const zp)
+{
+  return S_sp_tree_find_next(sp, vm_addr, zp, 0);
+}
+
+
 /*! NOTE vm_addr must be OOC_PAGE_SIZE aligned. */
 int
 sp_tree_find_mod_and_lock(struct sp_tree * const sp, void * const vm_addr,
@@ -1071,6 +1162,98 @@ S_sp_tree_find_mod_and_lock_test_7(void)
   assert(!ret);
 }
 
+static void
+S_sp_tree_find_next_and_lock_test_0(void)
+{
+  int ret;
+  struct sp_tree l_vma_tree;
+  struct sp_node * z1, * z2, * zp;
+
+  ret = sp_tree_init(&l_vma_tree);
+  assert(!ret);
+
+  /****************************************************************************/
+  /* Find next in an empty tree. */
+  /****************************************************************************/
+  ret = sp_tree_find_next_and_lock(&l_vma_tree, (void*)(0*4096), (void*)&zp);
+  assert(-1 == ret);
+  /****************************************************************************/
+
+  z1 = vma_alloc();
+  assert(z1);
+  z1->vm_start = (void*)(1*4096);
+  z1->vm_end = (void*)(3*4096);
+  ret = sp_tree_insert(&l_vma_tree, z1);
+  assert(!ret);
+  z2 = vma_alloc();
+  assert(z2);
+  z2->vm_start = (void*)(5*4096);
+  z2->vm_end = (void*)(6*4096);
+  ret = sp_tree_insert(&l_vma_tree, z2);
+  assert(!ret);
+
+  /****************************************************************************/
+  /* Find next for addresses before, inside, between, and after nodes. */
+  /****************************************************************************/
+  ret = sp_tree_find_next_and_lock(&l_vma_tree, (void*)(0*4096), (void*)&zp);
+  assert(!ret);
+  assert(z1 == zp);
+  ret = lock_let(&(zp->vm_lock));
+  assert(!ret);
+
+  ret = sp_tree_find_next_and_lock(&l_vma_tree, (void*)(2*4096), (void*)&zp);
+  assert(!ret);
+  assert(z1 == zp);
+  ret = lock_let(&(zp->vm_lock));
+  assert(!ret);
+
+  ret = sp_tree_find_next_and_lock(&l_vma_tree, (void*)(3*4096), (void*)&zp);
+  assert(!ret);
+  assert(z2 == zp);
+  ret = lock_let(&(zp->vm_lock));
+  assert(!ret);
+
+  ret = sp_tree_find_next_and_lock(&l_vma_tree, (void*)(6*4096), (void*)&zp);
+  assert(-1 == ret);
+
+  ret = sp_tree_find_first_and_lock(&l_vma_tree, (void*)(0*4096), (void*)&zp);
+  assert(!ret);
+  assert(z1 == zp);
+  ret = lock_let(&(zp->vm_lock));
+  assert(!ret);
+
+  ret = sp_tree_find_first_and_lock(&l_vma_tree, (void*)(4*4096), (void*)&zp);
+  assert(!ret);
+  assert(z2 == zp);
+  ret = lock_let(&(zp->vm_lock));
+  assert(!ret);
+
+  ret = sp_tree_find_first_and_lock(&l_vma_tree, (void*)(6*4096), (void*)&zp);
+  assert(-1 == ret);
+  /****************************************************************************/
+
+#ifdef _OPENMP
+  /****************************************************************************/
+  /* Find next skips a node which is already locked. */
+  /****************************************************************************/
+  ret = lock_get(&(z1->vm_lock));
+  assert(!ret);
+
+  ret = sp_tree_find_next_and_lock(&l_vma_tree, (void*)(1*4096), (void*)&zp);
+  assert(!ret);
+  assert(z2 == zp);
+  ret = lock_let(&(zp->vm_lock));
+  assert(!ret);
+
+  ret = lock_let(&(z1->vm_lock));
+  assert(!ret);
+  /****************************************************************************/
+#endif
+
+  ret = sp_tree_free(&l_vma_tree);
+  assert(!ret);
+}
+
 int
 main(void)
 {
@@ -1087,6 +1270,7 @@ main(void)
   S_sp_tree_find_mod_and_lock_test_5();
   S_sp_tree_find_mod_and_lock_test_6();
   S_sp_tree_find_mod_and_lock_test_7();
+  S_sp_tree_find_next_and_lock_test_0();
 
   ret = sp_tree_init(&vma_tree);
   assert(!ret);
@@ -0,0 +1,354 @@
+/*
+Copyright (c) 2016 Jeremy Iverson
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+
+/* assert */
+#include <assert.h>
+
+/* size_t */
+#include <stddef.h>
+
+/* memset */
+#include <string.h>
+
+/* clock_gettime, CLOCK_MONOTONIC */
+#include <time.h>
+
+/* struct ooc_stats, function prototypes */
+#include "include/ooc.h"
+
+/* */
+#include "common.h"
+
+
+/*! Per-thread statistics counters. Each thread claims a slot the first time
+ *  that it updates a counter. Slots are never released, so that the counters
+ *  of threads which have exited are still included by ooc_stats(). Since the
+ *  counters are only updated by atomic additions, threads beyond
+ *  OOC_STATS_MAX_THREADS can safely share the last slot. The slots are
+ *  statically allocated, so that they can be claimed from within the SIGSEGV
+ *  handler. */
+static struct
+{
+  struct ooc_stats stats;
+} __attribute__((aligned(64))) S_slot[OOC_STATS_MAX_THREADS];
+
+/*! Number of slots which have been claimed. */
+static size_t S_nslot=0;
+
+/*! The calling thread's slot. */
+static __thread struct ooc_stats * S_stats=NULL;
+
+/*! Number of I/O requests in flight, and the maximum thereof. These are gauges,
+ *  rather than counters, so they are process wide. */
+static unsigned long long S_io_depth=0, S_io_depth_max=0;
+
+
+struct ooc_stats *
+stats_local(void)
+{
+  size_t slot;
+
+  if (NULL == S_stats) {
+    slot = __sync_fetch_and_add(&S_nslot, 1);
+    if (slot >= OOC_STATS_MAX_THREADS) {
+      slot = OOC_STATS_MAX_THREADS-1;
+    }
+    S_stats = &(S_slot[slot].stats);
+  }
+
+  return S_stats;
+}
+
+
+unsigned long long
+stats_clock(void)
+{
+  struct timespec ts;
+
+  (void)clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return (unsigned long long)ts.tv_sec*1000000000ULL+\
+    (unsigned long long)ts.tv_nsec;
+}
+
+
+void
+stats_hist(unsigned long long * const hist, unsigned long long const ns)
+{
+  int i;
+
+  /* Bucket i counts latencies in [2^i,2^(i+1)). */
+  for (i=0; i<OOC_STATS_HIST-1 && (ns>>(i+1)); ++i);
+
+  (void)__sync_fetch_and_add(&(hist[i]), 1ULL);
+}
+
+
+unsigned long long
+stats_io_begin(void)
+{
+  unsigned long long depth, max;
+
+  depth = __sync_add_and_fetch(&S_io_depth, 1ULL);
+  while (depth > (max=S_io_depth_max)) {
+    if (__sync_bool_compare_and_swap(&S_io_depth_max, max, depth)) {
+      break;
+    }
+  }
+
+  return stats_clock();
+}
+
+
+void
+stats_io_end(unsigned long long const beg, size_t const size, int const write)
+{
+  struct ooc_stats * stats;
+
+  stats = stats_local();
+
+  stats_hist(stats->io_ns, stats_clock()-beg);
+  if (write) {
+    (void)__sync_fetch_and_add(&(stats->wr_bytes), (unsigned long long)size);
+  }
+  else {
+    (void)__sync_fetch_and_add(&(stats->rd_bytes), (unsigned long long)size);
+  }
+
+  (void)__sync_sub_and_fetch(&S_io_depth, 1ULL);
+}
+
+
+#ifdef OOC_LOCK_STATS
+int
+lock_stats_get(lock_t * const lock)
+{
+  int ret;
+  unsigned long long beg;
+
+  if (ooc_lock_raw_try(&(lock->raw))) {
+    beg = stats_clock();
+    ret = ooc_lock_raw_get(&(lock->raw));
+    lock->ts = stats_clock();
+
+    STATS_ADD(locks[lock->cls].contended, 1);
+    STATS_ADD(locks[lock->cls].wait_ns, lock->ts-beg);
+  }
+  else {
+    ret = 0;
+    lock->ts = stats_clock();
+  }
+  STATS_ADD(locks[lock->cls].acquired, 1);
+
+  return ret;
+}
+
+
+int
+lock_stats_let(lock_t * const lock)
+{
+  STATS_ADD(locks[lock->cls].hold_ns, stats_clock()-lock->ts);
+
+  return ooc_lock_raw_let(&(lock->raw));
+}
+
+
+int
+lock_stats_try(lock_t * const lock)
+{
+  if (ooc_lock_raw_try(&(lock->raw))) {
+    return -1;
+  }
+
+  lock->ts = stats_clock();
+  STATS_ADD(locks[lock->cls].acquired, 1);
+
+  return 0;
+}
+#endif
+
+
+int
+ooc_stats(struct ooc_stats * const stats)
+{
+  int i;
+  size_t slot, nslot;
+  struct ooc_stats const * s;
+
+  if (NULL == stats) {
+    return -1;
+  }
+
+  memset(stats, 0, sizeof(*stats));
+
+  if ((nslot=S_nslot) > OOC_STATS_MAX_THREADS) {
+    nslot = OOC_STATS_MAX_THREADS;
+  }
+
+  /* Counters may be updated concurrently, so the aggregate is a snapshot which
+   * is only exact once all threads are quiescent. */
+  for (slot=0; slot<nslot; ++slot) {
+    s = &(S_slot[slot].stats);
+
+    stats->rd_faults += s->rd_faults;
+    stats->wr_faults += s->wr_faults;
+    stats->mn_faults += s->mn_faults;
+    stats->mj_faults += s->mj_faults;
+    stats->rd_shared += s->rd_shared;
+    stats->prefetches += s->prefetches;
+    stats->discards  += s->discards;
+    stats->rd_bytes  += s->rd_bytes;
+    stats->wr_bytes  += s->wr_bytes;
+    stats->evictions += s->evictions;
+    stats->switches  += s->switches;
+    stats->steals    += s->steals;
+
+    for (i=0; i<OOC_STATS_HIST; ++i) {
+      stats->fault_ns[i] += s->fault_ns[i];
+      stats->io_ns[i]    += s->io_ns[i];
+    }
+
+    for (i=0; i<OOC_LOCK_CLASSES; ++i) {
+      stats->locks[i].acquired  += s->locks[i].acquired;
+      stats->locks[i].contended += s->locks[i].contended;
+      stats->locks[i].wait_ns   += s->locks[i].wait_ns;
+      stats->locks[i].hold_ns   += s->locks[i].hold_ns;
+    }
+  }
+
+  stats->io_depth     = S_io_depth;
+  stats->io_depth_max = S_io_depth_max;
+
+  return 0;
+}
+
+
+#ifdef TEST
+/* assert */
+#include <assert.h>
+
+/* EXIT_SUCCESS */
+#include <stdlib.h>
+
+/* omp_get_thread_num */
+#include <omp.h>
+
+int
+main(void)
+{
+  int ret, i;
+  unsigned long long beg, n;
+  struct ooc_stats stats;
+
+  /* Latency histogram buckets. */
+  stats_hist(stats_local()->fault_ns, 0);
+  stats_hist(stats_local()->fault_ns, 1);
+  stats_hist(stats_local()->fault_ns, 2);
+  stats_hist(stats_local()->fault_ns, 3);
+  stats_hist(stats_local()->fault_ns, 1024);
+  stats_hist(stats_local()->fault_ns, ~0ULL);
+  assert(2 == stats_local()->fault_ns[0]);
+  assert(2 == stats_local()->fault_ns[1]);
+  assert(1 == stats_local()->fault_ns[10]);
+  assert(1 == stats_local()->fault_ns[OOC_STATS_HIST-1]);
+
+  /* Per-thread counters are aggregated over all threads. */
+  #pragma omp parallel num_threads(4)
+  {
+    STATS_ADD(rd_faults, 1);
+    STATS_ADD(mj_faults, omp_get_thread_num());
+  }
+
+  /* I/O accounting. */
+  beg = stats_io_begin();
+  beg = stats_io_begin();
+  ret = ooc_stats(&stats);
+  assert(!ret);
+  assert(2 == stats.io_depth);
+  stats_io_end(beg, 4096, 0);
+  stats_io_end(beg, 8192, 1);
+
+  ret = ooc_stats(&stats);
+  assert(!ret);
+  assert(4 == stats.rd_faults);
+  assert(6 == stats.mj_faults);
+  assert(4096 == stats.rd_bytes);
+  assert(8192 == stats.wr_bytes);
+  assert(0 == stats.io_depth);
+  assert(2 == stats.io_depth_max);
+  assert(2 == stats.fault_ns[0]);
+  for (i=0, n=0; i<OOC_STATS_HIST; ++i) {
+    n += stats.io_ns[i];
+  }
+  assert(2 == n);
+
+#ifdef OOC_LOCK_STATS
+  /* Lock statistics, with one contended acquisition. */
+  {
+    lock_t lock;
+
+    ret = lock_init(&lock);
+    assert(!ret);
+    ret = lock_class(&lock, OOC_LOCK_VMA);
+    assert(!ret);
+
+    #pragma omp parallel num_threads(2)
+    {
+      if (0 == omp_get_thread_num()) {
+        ret = lock_get(&lock);
+        assert(!ret);
+      }
+      #pragma omp barrier
+      if (1 == omp_get_thread_num()) {
+        assert(lock_try(&lock));
+        ret = lock_get(&lock);
+        assert(!ret);
+        ret = lock_let(&lock);
+        assert(!ret);
+      }
+      else {
+        beg = stats_clock();
+        while (stats_clock()-beg < 1000000ULL);
+        ret = lock_let(&lock);
+        assert(!ret);
+      }
+    }
+
+    ret = lock_free(&lock);
+    assert(!ret);
+
+    ret = ooc_stats(&stats);
+    assert(!ret);
+    assert(2 == stats.locks[OOC_LOCK_VMA].acquired);
+    assert(1 == stats.locks[OOC_LOCK_VMA].contended);
+    assert(stats.locks[OOC_LOCK_VMA].wait_ns > 0);
+    assert(stats.locks[OOC_LOCK_VMA].hold_ns >= 1000000ULL);
+  }
+#endif
+
+  ret = ooc_stats(NULL);
+  assert(-1 == ret);
+
+  return EXIT_SUCCESS;
+}
+#endif
@@ -0,0 +1,643 @@
+/*
+Copyright (c) 2016 Jeremy Iverson
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+
+#ifndef _GNU_SOURCE
+  #define _GNU_SOURCE /* Expose fallocate, FALLOC_FL_*, O_DIRECT, preadv,
+                         pwritev */
+#endif
+
+/* assert */
+#include <assert.h>
+
+/* fallocate, open, FALLOC_FL_PUNCH_HOLE, FALLOC_FL_KEEP_SIZE, O_DIRECT */
+#include <fcntl.h>
+
+/* IOV_MAX */
+#include <limits.h>
+
+/* snprintf */
+#include <stdio.h>
+
+/* mkstemp */
+#include <stdlib.h>
+
+/* uintptr_t */
+#include <stdint.h>
+
+/* memcpy, memmove, memset */
+#include <string.h>
+
+/* mmap, MAP_* */
+#include <sys/mman.h>
+
+/* preadv, pwritev, struct iovec */
+#include <sys/uio.h>
+
+/* unlink, close */
+#include <unistd.h>
+
+/* OOC_TRACE_* */
+#include "include/ooc.h"
+
+/* */
+#include "common.h"
+
+
+/*! The backing store is a single unlinked temporary file per process, which is
+ *  created the first time that a page must be written to it. Every ooc_malloc()
+ *  allocation reserves a page aligned range of this file for its entire
+ *  lifetime. */
+static int S_fd=-1;
+
+/*! The backing store opened with O_DIRECT, so that evicted pages bypass the
+ *  kernel page cache, or -1 if the file system does not support it. */
+static int S_dfd=-1;
+
+/*! State of the backing store: 0 not created, 1 being created, 2 created. */
+static int S_state=0;
+
+/*! Next unreserved offset in the backing store. */
+static size_t S_off=0;
+
+/*! Pool of aligned bounce buffers, for direct I/O to or from memory which is
+ *  not suitably aligned, and a bit mask of the free buffers. */
+static char * S_bounce=NULL;
+static unsigned int S_bounce_free=0;
+
+/*! Create the backing store. */
+static int
+S_swap_open(void)
+{
+  int ret, fd;
+  char fname[256];
+  void * bounce;
+
+  ret = snprintf(fname, sizeof(fname), "%s/ooc-XXXXXX", OOC_SWAP_DIR);
+  if (ret < 0 || (size_t)ret >= sizeof(fname)) {
+    return -1;
+  }
+
+  fd = mkstemp(fname);
+  if (-1 == fd) {
+    return -1;
+  }
+
+  /* Open a second, direct, descriptor on the file, if possible. The buffered
+   * descriptor is kept for transfers which do not meet the alignment
+   * requirements of direct I/O. */
+  S_dfd = open(fname, O_RDWR|O_DIRECT);
+
+  /* Unlink immediately, so that the file is reclaimed on process exit. */
+  ret = unlink(fname);
+  assert(!ret);
+
+  if (-1 != S_dfd) {
+    bounce = mmap(NULL, OOC_SWAP_BOUNCE_NR*OOC_SWAP_BOUNCE_SIZE,\
+                  PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE,\
+                  -1, 0);
+    if (MAP_FAILED != bounce) {
+      S_bounce = bounce;
+      S_bounce_free = (1u<<OOC_SWAP_BOUNCE_NR)-1;
+    }
+  }
+
+  return fd;
+}
+
+
+/*! Get the buffered backing store file descriptor, creating the file if
+ *  needed. */
+static int
+S_swap_fd(void)
+{
+  int fd;
+
+  if (2 == *(int volatile*)&S_state) {
+    __sync_synchronize();
+    return S_fd;
+  }
+
+  if (__sync_bool_compare_and_swap(&S_state, 0, 1)) {
+    fd = S_swap_open();
+    S_fd = fd;
+    __sync_synchronize();
+    S_state = -1 == fd ? 0 : 2;
+
+    return fd;
+  }
+
+  /* Another thread is creating the file. */
+  while (1 == *(int volatile*)&S_state) {
+    __sync_synchronize();
+  }
+
+  return 2 == S_state ? S_fd : -1;
+}
+
+
+/*! Take a bounce buffer from the pool, returns -1 if there is none free. */
+static int
+S_bounce_get(void)
+{
+  unsigned int mask;
+  int b;
+
+  do {
+    if (0 == (mask=*(unsigned int volatile*)&S_bounce_free)) {
+      return -1;
+    }
+    b = __builtin_ctz(mask);
+  } while (!__sync_bool_compare_and_swap(&S_bounce_free, mask,\
+           mask&~(1u<<b)));
+
+  return b;
+}
+
+
+/*! Return a bounce buffer to the pool. */
+static void
+S_bounce_put(int const b)
+{
+  (void)__sync_fetch_and_or(&S_bounce_free, 1u<<b);
+}
+
+
+size_t
+swap_alloc(size_t const size)
+{
+  return __sync_fetch_and_add(&S_off, size);
+}
+
+
+void
+swap_free(size_t const off, size_t const size)
+{
+  int ret;
+
+  if (-1 == S_fd) {
+    return;
+  }
+
+  /* Return the file blocks to the file system. Failure is harmless, since the
+   * range will simply not be reused. */
+  ret = fallocate(S_fd, FALLOC_FL_PUNCH_HOLE|FALLOC_FL_KEEP_SIZE, (off_t)off,
+                  (off_t)size);
+
+  if (ret) {}
+}
+
+
+/*! Transfer iovcnt buffers, totalling size bytes, to or from a contiguous
+ *  range of fd, retrying partial transfers. iov is consumed. */
+static int
+S_swap_xfer(int const fd, int const write, struct iovec * iov, int iovcnt,
+            size_t const off, size_t const size)
+{
+  ssize_t ret=0;
+  size_t done, n;
+
+  for (done=0; done<size; done+=(size_t)ret) {
+    if (write) {
+      ret = pwritev(fd, iov, iovcnt < IOV_MAX ? iovcnt : IOV_MAX,\
+                    (off_t)(off+done));
+    }
+    else {
+      ret = preadv(fd, iov, iovcnt < IOV_MAX ? iovcnt : IOV_MAX,\
+                   (off_t)(off+done));
+    }
+    if (-1 == ret) {
+      return -1;
+    }
+    if (0 == ret) {
+      /* Reading beyond EOF, i.e., a hole at the end of the file. */
+      break;
+    }
+
+    /* Consume the transferred bytes from iov. */
+    for (n=(size_t)ret; n>0 && n>=iov->iov_len; iov++,iovcnt--) {
+      n -= iov->iov_len;
+    }
+    if (n) {
+      iov->iov_base = (char*)iov->iov_base+n;
+      iov->iov_len -= n;
+    }
+  }
+
+  return 0;
+}
+
+
+/*! Copy len bytes between buf and the bytes of iov starting at pos. */
+static void
+S_iov_copy(struct iovec const * iov, size_t pos, char * buf, size_t len,
+           int const to_iov)
+{
+  size_t n;
+
+  for (; pos>=iov->iov_len; pos-=iov->iov_len,iov++);
+
+  for (; len>0; pos=0,iov++) {
+    n = iov->iov_len-pos < len ? iov->iov_len-pos : len;
+    if (to_iov) {
+      memcpy((char*)iov->iov_base+pos, buf, n);
+    }
+    else {
+      memcpy(buf, (char*)iov->iov_base+pos, n);
+    }
+    buf += n;
+    len -= n;
+  }
+}
+
+
+/*! Transfer iovcnt buffers, totalling size bytes, to or from the direct
+ *  backing store through bounce buffer b. */
+static int
+S_swap_bounce(int const b, int const write, struct iovec const * const iov,
+              size_t const off, size_t const size)
+{
+  int ret;
+  size_t done, len;
+  char * buf;
+  struct iovec biov;
+
+  buf = S_bounce+(size_t)b*OOC_SWAP_BOUNCE_SIZE;
+
+  for (done=0; done<size; done+=len) {
+    len = size-done < OOC_SWAP_BOUNCE_SIZE ? size-done : OOC_SWAP_BOUNCE_SIZE;
+
+    biov.iov_base = buf;
+    biov.iov_len  = len;
+
+    if (write) {
+      S_iov_copy(iov, done, buf, len, 0);
+      ret = S_swap_xfer(S_dfd, 1, &biov, 1, off+done, len);
+    }
+    else {
+      /* Holes read as zeros. */
+      memset(buf, 0, len);
+      ret = S_swap_xfer(S_dfd, 0, &biov, 1, off+done, len);
+      S_iov_copy(iov, done, buf, len, 1);
+    }
+    if (ret) {
+      return ret;
+    }
+  }
+
+  return 0;
+}
+
+
+/*! Transfer iovcnt buffers to or from a contiguous range of the backing store.
+ *  iov is consumed. Transfers go directly between the buffers and the device
+ *  when the file range and the buffers are aligned for direct I/O, through a
+ *  bounce buffer when only the file range is, and through the page cache
+ *  otherwise. */
+static int
+S_swap_rw(int const write, struct iovec * iov, int iovcnt, size_t const off)
+{
+  int ret, fd, b, i, aligned;
+  size_t size, align;
+  unsigned long long beg;
+
+  if (-1 == (fd=S_swap_fd())) {
+    return -1;
+  }
+
+  align = (size_t)OOC_SWAP_ALIGN;
+
+  for (aligned=1,size=0,i=0; i<iovcnt; ++i) {
+    size += iov[i].iov_len;
+    if ((uintptr_t)iov[i].iov_base%align || iov[i].iov_len%align) {
+      aligned = 0;
+    }
+  }
+
+  beg = stats_io_begin();
+  TRACE_EVENT(OOC_TRACE_IO_BEG, size);
+
+  if (-1 != S_dfd && 0 == off%align && 0 == size%align) {
+    if (aligned) {
+      fd = S_dfd;
+    }
+    else if (-1 != (b=S_bounce_get())) {
+      fd = -1;
+      ret = S_swap_bounce(b, write, iov, off, size);
+      S_bounce_put(b);
+    }
+  }
+
+  if (-1 != fd) {
+    ret = S_swap_xfer(fd, write, iov, iovcnt, off, size);
+  }
+
+  stats_io_end(beg, ret ? 0 : size, write);
+  TRACE_EVENT(OOC_TRACE_IO_END, ret ? 0 : size);
+
+  return ret;
+}
+
+
+int
+swap_read(void * const buf, size_t const size, size_t const off)
+{
+  struct iovec iov;
+
+  iov.iov_base = buf;
+  iov.iov_len  = size;
+
+  return S_swap_rw(0, &iov, 1, off);
+}
+
+
+int
+swap_write(void const * const buf, size_t const size, size_t const off)
+{
+  struct iovec iov;
+
+  iov.iov_base = (void*)buf;
+  iov.iov_len  = size;
+
+  return S_swap_rw(1, &iov, 1, off);
+}
+
+
+int
+swap_readv(struct iovec * const iov, int const iovcnt, size_t const off)
+{
+  return S_swap_rw(0, iov, iovcnt, off);
+}
+
+
+int
+swap_writev(struct iovec * const iov, int const iovcnt, size_t const off)
+{
+  return S_swap_rw(1, iov, iovcnt, off);
+}
+
+
+/*
+ *  Writing back (or reading in) neighbouring pages one at a time turns into
+ *  many page-sized requests, which leave most of the bandwidth of the backing
+ *  device unused. Instead, extents are queued, kept sorted by backing-store
+ *  offset, and each run of extents which are contiguous in the backing store
+ *  is dispatched as one vectored I/O when the queue is flushed.
+ */
+
+
+void
+swap_queue_init(struct swap_queue * const q, int const write)
+{
+  q->write = write;
+  q->n = 0;
+}
+
+
+int
+swap_queue_add(struct swap_queue * const q, void * const buf,
+               size_t const len, size_t const off)
+{
+  int ret;
+  size_t i;
+
+  /* Find the insertion point. Extents are usually queued in ascending order,
+   * so search from the back. */
+  for (i=q->n; i>0 && q->ext[i-1].off>off; --i);
+
+  /* Try to merge with the preceding extent and then also with the following
+   * one, if the new extent fills the gap between them. */
+  if (i>0 && q->ext[i-1].off+q->ext[i-1].len == off &&\
+      (char*)q->ext[i-1].buf+q->ext[i-1].len == (char*)buf)
+  {
+    q->ext[i-1].len += len;
+
+    if (i<q->n && off+len == q->ext[i].off &&\
+        (char*)buf+len == (char*)q->ext[i].buf)
+    {
+      q->ext[i-1].len += q->ext[i].len;
+      memmove(&(q->ext[i]), &(q->ext[i+1]), (q->n-i-1)*sizeof(q->ext[0]));
+      q->n--;
+    }
+
+    return 0;
+  }
+
+  /* Try to merge with the following extent. */
+  if (i<q->n && off+len == q->ext[i].off &&\
+      (char*)buf+len == (char*)q->ext[i].buf)
+  {
+    q->ext[i].buf = buf;
+    q->ext[i].len += len;
+    q->ext[i].off = off;
+
+    return 0;
+  }
+
+  /* Queue is full, so dispatch what has been queued so far. */
+  if (OOC_SWAP_QUEUE_SIZE == q->n) {
+    ret = swap_queue_flush(q);
+    if (ret) {
+      return ret;
+    }
+    i = 0;
+  }
+
+  /* Start a new extent. */
+  memmove(&(q->ext[i+1]), &(q->ext[i]), (q->n-i)*sizeof(q->ext[0]));
+  q->ext[i].buf = buf;
+  q->ext[i].len = len;
+  q->ext[i].off = off;
+  q->n++;
+
+  return 0;
+}
+
+
+int
+swap_queue_flush(struct swap_queue * const q)
+{
+  int ret, err=0;
+  size_t i, j;
+  struct iovec iov[OOC_SWAP_QUEUE_SIZE];
+
+  for (i=0; i<q->n; i=j) {
+    for (j=i; j<q->n && (j==i ||\
+         q->ext[j-1].off+q->ext[j-1].len == q->ext[j].off); ++j)
+    {
+      iov[j-i].iov_base = q->ext[j].buf;
+      iov[j-i].iov_len  = q->ext[j].len;
+    }
+
+    ret = S_swap_rw(q->write, iov, (int)(j-i), q->ext[i].off);
+    if (ret) {
+      err = ret;
+    }
+  }
+
+  q->n = 0;
+
+  return err;
+}
+
+
+#ifdef TEST
+/* assert */
+#include <assert.h>
+
+/* EXIT_SUCCESS */
+#include <stdlib.h>
+
+/* memset, memcmp */
+#include <string.h>
+
+/* mmap, munmap */
+#include <sys/mman.h>
+
+int
+main(void)
+{
+  int ret;
+  unsigned long long nio0, nio1;
+  size_t off1, off2, ps, i;
+  char buf1[8192], buf2[8192];
+  char * mem;
+  struct iovec iov[8];
+  struct swap_queue q;
+  struct ooc_stats stats;
+
+  ps = (size_t)OOC_PAGE_SIZE;
+
+  mem = mmap(NULL, 17*ps, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1,\
+             0);
+  assert(MAP_FAILED != mem);
+
+  off1 = swap_alloc(sizeof(buf1));
+  off2 = swap_alloc(sizeof(buf1));
+  assert(off1+sizeof(buf1) == off2);
+
+  memset(buf1, 'a', sizeof(buf1));
+  ret = swap_write(buf1, sizeof(buf1), off2);
+  assert(!ret);
+
+  memset(buf1, 'b', sizeof(buf1));
+  ret = swap_write(buf1, sizeof(buf1), off1);
+  assert(!ret);
+
+  ret = swap_read(buf2, sizeof(buf2), off2);
+  assert(!ret);
+  memset(buf1, 'a', sizeof(buf1));
+  assert(!memcmp(buf1, buf2, sizeof(buf1)));
+
+  swap_free(off1, sizeof(buf1));
+  swap_free(off2, sizeof(buf1));
+
+  /* Queue eight page-sized extents, which are contiguous in the backing store
+   * but scattered in memory, plus one which is not, out of order. */
+  off1 = swap_alloc(8*ps);
+  (void)swap_alloc(ps); /* leave a gap */
+  off2 = swap_alloc(ps);
+
+  for (i=0; i<8*ps; ++i) {
+    mem[i] = (char)(i/ps+1);
+  }
+  mem[8*ps] = 'z';
+
+  ret = ooc_stats(&stats);
+  assert(!ret);
+  for (nio0=0,i=0; i<OOC_STATS_HIST; ++i) {
+    nio0 += stats.io_ns[i];
+  }
+
+  swap_queue_init(&q, 1);
+  for (i=0; i<8; ++i) {
+    ret = swap_queue_add(&q, mem+((i*5)%8)*ps, ps, off1+((i*5)%8)*ps);
+    assert(!ret);
+  }
+  /* Pages 0..7 of mem map to the same pages of the backing store, so they
+   * merge into a single extent. */
+  assert(1 == q.n);
+  ret = swap_queue_add(&q, mem+8*ps, ps, off2);
+  assert(!ret);
+  assert(2 == q.n);
+  ret = swap_queue_flush(&q);
+  assert(!ret);
+  assert(0 == q.n);
+
+  /* One I/O per contiguous backing-store run. */
+  ret = ooc_stats(&stats);
+  assert(!ret);
+  for (nio1=0,i=0; i<OOC_STATS_HIST; ++i) {
+    nio1 += stats.io_ns[i];
+  }
+  assert(nio0+2 == nio1);
+
+  /* Read the pages back, reversed in memory, with a vectored read. */
+  for (i=0; i<8; ++i) {
+    iov[i].iov_base = mem+9*ps+(7-i)*ps;
+    iov[i].iov_len  = ps;
+  }
+  ret = swap_readv(iov, 8, off1);
+  assert(!ret);
+  for (i=0; i<8; ++i) {
+    assert((char)(8-i) == mem[9*ps+i*ps]);
+    assert((char)(8-i) == mem[9*ps+i*ps+ps-1]);
+  }
+
+  /* Scattered extents are read into discontiguous memory, and the queue
+   * merges them in backing-store order. */
+  swap_queue_init(&q, 0);
+  for (i=0; i<8; ++i) {
+    ret = swap_queue_add(&q, mem+9*ps+(7-i)*ps, ps, off1+i*ps);
+    assert(!ret);
+  }
+  assert(8 == q.n);
+  memset(mem+9*ps, 0, 8*ps);
+  ret = swap_queue_flush(&q);
+  assert(!ret);
+  for (i=0; i<8; ++i) {
+    assert((char)(8-i) == mem[9*ps+i*ps]);
+  }
+
+  swap_free(off1, 8*ps);
+  swap_free(off2, ps);
+
+  /* An unaligned write goes through the page cache, and must be visible to a
+   * subsequent aligned, possibly direct, read. */
+  off1 = swap_alloc(ps);
+  memset(mem, 'x', ps);
+  ret = swap_write(mem, ps, off1);
+  assert(!ret);
+  ret = swap_write("abc", 3, off1+5);
+  assert(!ret);
+  ret = swap_read(mem+ps, ps, off1);
+  assert(!ret);
+  assert('x' == mem[ps+4]);
+  assert(!memcmp(mem+ps+5, "abc", 3));
+  assert('x' == mem[ps+8]);
+  swap_free(off1, ps);
+
+  munmap(mem, 17*ps);
+
+  return EXIT_SUCCESS;
+}
+#endif
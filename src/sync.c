@@ -0,0 +1,360 @@
+/*
+Copyright (c) 2016 Jeremy Iverson
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+
+/* assert */
+#include <assert.h>
+
+/* ooc_mutex_lock, ooc_yield, struct ooc_mutex */
+#include "include/ooc.h"
+
+/* */
+#include "common.h"
+
+
+/*
+ *  The primitives never block the calling thread. A fiber which must wait
+ *  yields instead, and checks again once it is resumed by the scheduler, which
+ *  in the meantime runs the thread's other fibers. Waiting is thus polled,
+ *  which lets a primitive be released from any fiber on any thread, without
+ *  knowing which fibers are waiting on it.
+ */
+
+
+int
+ooc_mutex_init(struct ooc_mutex * const mutex)
+{
+  mutex->lock = 0;
+
+  return 0;
+}
+
+
+int
+ooc_mutex_lock(struct ooc_mutex * const mutex)
+{
+  while (__sync_lock_test_and_set(&(mutex->lock), 1)) {
+    while (*(int volatile*)&(mutex->lock)) {
+      ooc_yield();
+    }
+  }
+
+  return 0;
+}
+
+
+int
+ooc_mutex_trylock(struct ooc_mutex * const mutex)
+{
+  return __sync_lock_test_and_set(&(mutex->lock), 1) ? -1 : 0;
+}
+
+
+int
+ooc_mutex_unlock(struct ooc_mutex * const mutex)
+{
+  __sync_lock_release(&(mutex->lock));
+
+  return 0;
+}
+
+
+int
+ooc_cond_init(struct ooc_cond * const cond)
+{
+  cond->seq = 0;
+
+  return 0;
+}
+
+
+int
+ooc_cond_wait(struct ooc_cond * const cond, struct ooc_mutex * const mutex)
+{
+  int ret;
+  unsigned int seq;
+
+  /* A signal after the mutex is released changes seq, so it is not lost. */
+  seq = *(unsigned int volatile*)&(cond->seq);
+  __sync_synchronize();
+
+  ret = ooc_mutex_unlock(mutex);
+  assert(!ret);
+
+  while (seq == *(unsigned int volatile*)&(cond->seq)) {
+    ooc_yield();
+  }
+
+  return ooc_mutex_lock(mutex);
+}
+
+
+int
+ooc_cond_signal(struct ooc_cond * const cond)
+{
+  /* As pthread_cond_signal() may, this wakes all of the waiters, since it is
+   * not known which fibers are waiting. */
+  return ooc_cond_broadcast(cond);
+}
+
+
+int
+ooc_cond_broadcast(struct ooc_cond * const cond)
+{
+  (void)__sync_fetch_and_add(&(cond->seq), 1);
+
+  return 0;
+}
+
+
+int
+ooc_barrier_init(struct ooc_barrier * const barrier, unsigned int const count)
+{
+  if (!count) {
+    return -1;
+  }
+
+  barrier->count   = count;
+  barrier->arrived = 0;
+  barrier->gen     = 0;
+
+  return 0;
+}
+
+
+int
+ooc_barrier_wait(struct ooc_barrier * const barrier)
+{
+  unsigned int gen;
+
+  gen = *(unsigned int volatile*)&(barrier->gen);
+  __sync_synchronize();
+
+  if (barrier->count == __sync_add_and_fetch(&(barrier->arrived), 1)) {
+    /* Last to arrive, so reset the barrier for its next use and release the
+     * others. */
+    barrier->arrived = 0;
+    __sync_synchronize();
+    (void)__sync_fetch_and_add(&(barrier->gen), 1);
+
+    return OOC_BARRIER_SERIAL;
+  }
+
+  while (gen == *(unsigned int volatile*)&(barrier->gen)) {
+    ooc_yield();
+  }
+
+  return 0;
+}
+
+
+#ifdef TEST
+/* assert */
+#include <assert.h>
+
+/* EXIT_SUCCESS, setenv */
+#include <stdlib.h>
+
+/* memset */
+#include <string.h>
+
+/* omp_get_thread_num */
+#include <omp.h>
+
+#define N_FIBERS 4
+#define N_THREAD 2
+#define N_ITERS  64
+#define N_MANY   1000
+#define N_DEEP   (64*1024)
+
+static struct ooc_mutex S_mutex;
+static struct ooc_cond S_cond;
+static struct ooc_barrier S_barrier;
+static int S_flag;
+static unsigned int S_count;
+static unsigned int S_serial;
+
+static void
+S_barrier_kern(size_t const i, void * const args)
+{
+  if (OOC_BARRIER_SERIAL == ooc_barrier_wait(&S_barrier)) {
+    (void)__sync_fetch_and_add(&S_serial, 1);
+  }
+  (void)__sync_fetch_and_add(&S_count, 1);
+
+  if (i || args) {}
+}
+
+static void
+S_mutex_kern(size_t const i, void * const args)
+{
+  int ret;
+  unsigned int count;
+
+  ret = ooc_mutex_lock(&S_mutex);
+  assert(!ret);
+
+  /* Yield while holding the mutex, so that other fibers contend for it. */
+  count = S_count;
+  ooc_yield();
+  S_count = count+1;
+
+  ret = ooc_mutex_unlock(&S_mutex);
+  assert(!ret);
+
+  if (i || args) {}
+}
+
+static void
+S_wait_kern(size_t const i, void * const args)
+{
+  int ret;
+
+  ret = ooc_mutex_lock(&S_mutex);
+  assert(!ret);
+  while (!S_flag) {
+    ret = ooc_cond_wait(&S_cond, &S_mutex);
+    assert(!ret);
+  }
+  S_count++;
+  ret = ooc_mutex_unlock(&S_mutex);
+  assert(!ret);
+
+  if (i || args) {}
+}
+
+static void
+S_deep_kern(size_t const i, void * const args)
+{
+  char buf[N_DEEP];
+
+  /* Far more stack than a fiber commits up front, which must survive while
+   * the fiber is yielded and others run. */
+  memset(buf, (int)i, sizeof(buf));
+  ooc_yield();
+  if ((char)i == buf[0] && (char)i == buf[sizeof(buf)-1]) {
+    (void)__sync_fetch_and_add(&S_count, 1);
+  }
+
+  if (args) {}
+}
+
+static void
+S_signal_kern(size_t const i, void * const args)
+{
+  int ret;
+
+  ret = ooc_mutex_lock(&S_mutex);
+  assert(!ret);
+  S_flag = 1;
+  ret = ooc_cond_broadcast(&S_cond);
+  assert(!ret);
+  ret = ooc_mutex_unlock(&S_mutex);
+  assert(!ret);
+
+  if (i || args) {}
+}
+
+int
+main(void)
+{
+  int ret;
+  size_t i;
+
+  /* Enough fibers for N_MANY blocked iterations on one thread. */
+  ret = setenv("OOC_NUM_FIBERS", "1024", 1);
+  assert(!ret);
+
+  ret = ooc_mutex_init(&S_mutex);
+  assert(!ret);
+  ret = ooc_cond_init(&S_cond);
+  assert(!ret);
+  ret = ooc_barrier_init(&S_barrier, 0);
+  assert(ret);
+
+  /* A barrier between the fibers of one thread, which would deadlock if the
+   * first fiber to arrive blocked the thread. */
+  ret = ooc_barrier_init(&S_barrier, N_FIBERS);
+  assert(!ret);
+  for (i=0; i<N_FIBERS; ++i) {
+    ooc_sched(&S_barrier_kern, i, NULL);
+  }
+  ooc_wait();
+  assert(N_FIBERS == S_count);
+  assert(1 == S_serial);
+
+  /* The barrier can be reused. */
+  for (i=0; i<N_FIBERS; ++i) {
+    ooc_sched(&S_barrier_kern, i, NULL);
+  }
+  ooc_wait();
+  assert(2*N_FIBERS == S_count);
+  assert(2 == S_serial);
+
+  /* Mutual exclusion between fibers, on several threads. */
+  S_count = 0;
+  #pragma omp parallel num_threads(N_THREAD)
+  {
+    size_t j;
+
+    for (j=0; j<N_ITERS; ++j) {
+      ooc_sched(&S_mutex_kern, j, NULL);
+    }
+    ooc_wait();
+  }
+  assert(N_THREAD*N_ITERS == S_count);
+
+  /* Waiters on a condition variable, which is signaled by a later
+   * iteration. */
+  S_count = 0;
+  for (i=0; i<N_FIBERS-1; ++i) {
+    ooc_sched(&S_wait_kern, i, NULL);
+  }
+  assert(0 == S_count);
+  ooc_sched(&S_signal_kern, 0, NULL);
+  ooc_wait();
+  assert(N_FIBERS-1 == S_count);
+
+  /* Many iterations blocked at once on one thread, as many as the barrier
+   * needs, each with a deep stack. */
+  ret = ooc_barrier_init(&S_barrier, N_MANY);
+  assert(!ret);
+  S_count = 0;
+  for (i=0; i<N_MANY; ++i) {
+    ooc_sched(&S_barrier_kern, i, NULL);
+  }
+  ooc_wait();
+  assert(N_MANY == S_count);
+
+  S_count = 0;
+  for (i=0; i<N_MANY; ++i) {
+    ooc_sched(&S_deep_kern, i, NULL);
+  }
+  ooc_wait();
+  assert(N_MANY == S_count);
+
+  ret = ooc_finalize();
+  assert(!ret);
+
+  return EXIT_SUCCESS;
+}
+#endif
@@ -0,0 +1,737 @@
+/*
+Copyright (c) 2016 Jeremy Iverson
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+
+#ifndef _GNU_SOURCE
+  #define _GNU_SOURCE /* Expose mremap, MREMAP_* */
+#endif
+
+/* assert */
+#include <assert.h>
+
+/* sched_yield */
+#include <sched.h>
+
+/* size_t */
+#include <stddef.h>
+
+/* SIZE_MAX, uintptr_t */
+#include <stdint.h>
+
+/* memmove */
+#include <string.h>
+
+/* mmap, mremap, munmap */
+#include <sys/mman.h>
+
+/* ooc_task, ooc_task_wait */
+#include "include/ooc.h"
+
+/* */
+#include "common.h"
+
+
+#if OOC_TASK_DATA > OOC_ACCESS_MAX
+  #error "OOC_TASK_DATA must not exceed OOC_ACCESS_MAX"
+#endif
+
+
+/*
+ *  Tasks submitted with ooc_task() form a graph, which is run by
+ *  ooc_task_wait(). Dependencies are inferred from the tasks' data handles, in
+ *  submission order, as if the tasks were run sequentially: a task depends on
+ *  the last task to write any range which overlaps one of its handles and, if
+ *  it writes the handle, on each task which has read such a range since. To
+ *  that end, a record is kept for each distinct range named by a handle, with
+ *  its last writer and the readers since. Records are indexed in address
+ *  order, so that the records which overlap a range, which start less than
+ *  the longest record before it, are found without looking at the others.
+ *
+ *  The graph is run on the ooc_parallel_for() worker pool. Each worker pops a
+ *  ready task from a shared stack and runs it on a fiber, after declaring its
+ *  handles with ooc_access(), so that its inputs are prefetched and its
+ *  outputs are made writable and written back as it completes. The stack runs
+ *  the most recently readied task first, whose inputs were most recently
+ *  produced and so are the most likely to still be resident. When a task
+ *  completes,
+ *    - a successor with one remaining predecessor is about to become ready,
+ *      so its inputs are prefetched, and
+ *    - a range for which no task that has not completed holds a handle has no
+ *      pending consumers, so it is evicted, to make room for data which does.
+ */
+
+
+/*! No task, edge, or record. */
+#define S_NONE SIZE_MAX
+
+/*! A task of the graph. */
+struct S_task
+{
+  void (*kern)(size_t const, void * const);
+  size_t i;
+  void * args;
+  struct ooc_data data[OOC_TASK_DATA];
+  size_t rec[OOC_TASK_DATA];  /* record of each data handle */
+  size_t nr;                  /* number of data handles */
+  size_t npred;               /* predecessors which have not completed */
+  size_t succ;                /* first edge to a successor */
+};
+
+/*! An edge to a successor, or an entry of a record's list of readers. */
+struct S_edge
+{
+  size_t task;
+  size_t next;
+};
+
+/*! Dependency record of a range named by a data handle. */
+struct S_rec
+{
+  void * addr;
+  size_t len;
+  size_t writer;              /* last task to write the range */
+  size_t readers;             /* first of the tasks to read it since */
+  size_t pending;             /* handles of tasks which have not completed */
+};
+
+/*! An array in anonymous memory, which is grown by remapping it. Elements are
+ *  referred to by index, since they move. */
+struct S_array
+{
+  void * p;
+  size_t nr;
+  size_t cap;                 /* in bytes */
+};
+
+/*! The graph being built, or run. */
+static struct
+{
+  struct S_array task;
+  struct S_array edge;
+  struct S_array rec;
+  struct S_array index;       /* records, by address, then length */
+  size_t maxlen;              /* length of the longest record */
+  size_t * ready;             /* stack of ready tasks */
+  size_t nready;
+  size_t left;                /* tasks which have not completed */
+  lock_t lock;                /* protects the above while the graph is run */
+} S_graph;
+
+/*! Serializes ooc_task() and ooc_task_wait(). */
+static lock_t S_lock;
+
+#define S_TASK(t) (((struct S_task*)S_graph.task.p)+(t))
+#define S_EDGE(e) (((struct S_edge*)S_graph.edge.p)+(e))
+#define S_REC(r)  (((struct S_rec*)S_graph.rec.p)+(r))
+#define S_IDX(k)  (((size_t*)S_graph.index.p)[k])
+
+
+/*! Make room in a for n more elements of size sz, returns non-zero on
+ *  failure. */
+static int
+S_reserve(struct S_array * const a, size_t const n, size_t const sz)
+{
+  size_t cap;
+  void * p;
+
+  if ((a->nr+n)*sz <= a->cap) {
+    return 0;
+  }
+
+  for (cap=a->cap?a->cap:(size_t)OOC_PAGE_SIZE; cap<(a->nr+n)*sz; cap*=2);
+
+  if (NULL == a->p) {
+    p = mmap(NULL, cap, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+  }
+  else {
+    p = mremap(a->p, a->cap, cap, MREMAP_MAYMOVE);
+  }
+  if (MAP_FAILED == p) {
+    return -1;
+  }
+
+  a->p   = p;
+  a->cap = cap;
+
+  return 0;
+}
+
+
+/*! Release the memory of a. */
+static void
+S_release(struct S_array * const a)
+{
+  int ret;
+
+  if (a->p) {
+    ret = munmap(a->p, a->cap);
+    assert(!ret);
+  }
+  a->p   = NULL;
+  a->nr  = 0;
+  a->cap = 0;
+}
+
+
+/*! Whether the ranges of data handle d and record r overlap. */
+static int
+S_overlap(struct ooc_data const * const d, struct S_rec const * const r)
+{
+  return (uintptr_t)d->addr < (uintptr_t)r->addr+r->len &&
+         (uintptr_t)r->addr < (uintptr_t)d->addr+d->len;
+}
+
+
+/*! Position in the index of the first record which starts after addr, or at
+ *  addr with at least length len. */
+static size_t
+S_index_find(uintptr_t const addr, size_t const len)
+{
+  size_t lo, hi, mid;
+  struct S_rec const * r;
+
+  for (lo=0,hi=S_graph.index.nr; lo<hi;) {
+    mid = lo+(hi-lo)/2;
+    r   = S_REC(S_IDX(mid));
+    if ((uintptr_t)r->addr < addr ||\
+        ((uintptr_t)r->addr == addr && r->len < len))
+    {
+      lo = mid+1;
+    }
+    else {
+      hi = mid;
+    }
+  }
+
+  return lo;
+}
+
+
+/*! Position in the index of the first record which may overlap range d, i.e.,
+ *  of the first which starts less than the longest record before it. The
+ *  records which overlap d are among those from there on which start before
+ *  it ends. */
+static size_t
+S_index_first(struct ooc_data const * const d)
+{
+  uintptr_t const addr=(uintptr_t)d->addr;
+
+  return S_index_find(addr >= S_graph.maxlen ? addr-S_graph.maxlen+1 : 0, 0);
+}
+
+
+/*! Add an edge from task p to task t, unless it would be a loop or a
+ *  duplicate. Since edges to t are only added while t is being submitted, a
+ *  duplicate is always the most recent edge from p. */
+static void
+S_edge_add(size_t const p, size_t const t)
+{
+  size_t e;
+
+  if (p == t) {
+    return;
+  }
+  e = S_TASK(p)->succ;
+  if (S_NONE != e && t == S_EDGE(e)->task) {
+    return;
+  }
+
+  e = S_graph.edge.nr++;
+  assert(S_graph.edge.nr*sizeof(struct S_edge) <= S_graph.edge.cap);
+  S_EDGE(e)->task = t;
+  S_EDGE(e)->next = S_TASK(p)->succ;
+  S_TASK(p)->succ = e;
+  S_TASK(t)->npred++;
+}
+
+
+/*! Add the dependencies of data handle j of task t, and record it. If count
+ *  is non-zero, then only count the edges that this would add, including
+ *  the entry in a list of readers, and whether a record would be added. */
+static size_t
+S_depend(size_t const t, size_t const j, int const count, size_t * const nrec)
+{
+  size_t k, r, e, rec=S_NONE, nedge=0;
+  struct ooc_data const * const d=&(S_TASK(t)->data[j]);
+
+  k = S_index_find((uintptr_t)d->addr, d->len);
+  if (k < S_graph.index.nr && d->addr == S_REC(S_IDX(k))->addr &&
+      d->len == S_REC(S_IDX(k))->len)
+  {
+    rec = S_IDX(k);
+  }
+
+  for (k=S_index_first(d); k<S_graph.index.nr; ++k) {
+    r = S_IDX(k);
+    if ((uintptr_t)S_REC(r)->addr >= (uintptr_t)d->addr+d->len) {
+      break;
+    }
+    if (!S_overlap(d, S_REC(r))) {
+      continue;
+    }
+
+    /* Read or write after write. */
+    if (S_NONE != S_REC(r)->writer) {
+      if (!count) {
+        S_edge_add(S_REC(r)->writer, t);
+      }
+      nedge++;
+    }
+
+    /* Write after read. */
+    if (d->mode&OOC_WRITE) {
+      for (e=S_REC(r)->readers; S_NONE!=e; e=S_EDGE(e)->next) {
+        if (!count) {
+          S_edge_add(S_EDGE(e)->task, t);
+        }
+        nedge++;
+      }
+    }
+  }
+
+  if (count) {
+    *nrec += S_NONE == rec;
+    return nedge+1;
+  }
+
+  if (S_NONE == rec) {
+    rec = S_graph.rec.nr++;
+    assert(S_graph.rec.nr*sizeof(struct S_rec) <= S_graph.rec.cap);
+    S_REC(rec)->addr    = d->addr;
+    S_REC(rec)->len     = d->len;
+    S_REC(rec)->writer  = S_NONE;
+    S_REC(rec)->readers = S_NONE;
+    S_REC(rec)->pending = 0;
+
+    k = S_index_find((uintptr_t)d->addr, d->len);
+    memmove(&S_IDX(k+1), &S_IDX(k), (S_graph.index.nr-k)*sizeof(size_t));
+    S_IDX(k) = rec;
+    S_graph.index.nr++;
+    assert(S_graph.index.nr*sizeof(size_t) <= S_graph.index.cap);
+    if (d->len > S_graph.maxlen) {
+      S_graph.maxlen = d->len;
+    }
+  }
+
+  S_REC(rec)->pending++;
+  S_TASK(t)->rec[j] = rec;
+
+  if (d->mode&OOC_WRITE) {
+    S_REC(rec)->writer  = t;
+    S_REC(rec)->readers = S_NONE;
+  }
+  else {
+    e = S_graph.edge.nr++;
+    assert(S_graph.edge.nr*sizeof(struct S_edge) <= S_graph.edge.cap);
+    S_EDGE(e)->task = t;
+    S_EDGE(e)->next = S_REC(rec)->readers;
+    S_REC(rec)->readers = e;
+  }
+
+  return 0;
+}
+
+
+/*! Whether no task which has not completed holds a handle on a range which
+ *  overlaps record r. */
+static int
+S_idle(size_t const r)
+{
+  size_t k, q;
+  struct ooc_data d;
+
+  d.addr = S_REC(r)->addr;
+  d.len  = S_REC(r)->len;
+
+  for (k=S_index_first(&d); k<S_graph.index.nr; ++k) {
+    q = S_IDX(k);
+    if ((uintptr_t)S_REC(q)->addr >= (uintptr_t)d.addr+d.len) {
+      break;
+    }
+    if (S_REC(q)->pending && S_overlap(&d, S_REC(q))) {
+      return 0;
+    }
+  }
+
+  return 1;
+}
+
+
+/*! Release the successors and the data of task t, which has completed. */
+static void
+S_done(size_t const t)
+{
+  int ret;
+  size_t e, s, j, k, r, npre=0, nev=0;
+  size_t pre[OOC_TASK_PREFETCH], ev[OOC_TASK_DATA];
+  struct S_task const * const task=S_TASK(t);
+
+  ret = lock_get(&(S_graph.lock));
+  assert(!ret);
+
+  for (e=task->succ; S_NONE!=e; e=S_EDGE(e)->next) {
+    s = S_EDGE(e)->task;
+    if (0 == --S_TASK(s)->npred) {
+      S_graph.ready[S_graph.nready++] = s;
+    }
+    else if (1 == S_TASK(s)->npred && npre < OOC_TASK_PREFETCH) {
+      pre[npre++] = s;
+    }
+  }
+
+  for (j=0; j<task->nr; ++j) {
+    r = task->rec[j];
+    if (0 == --S_REC(r)->pending && S_idle(r)) {
+      ev[nev++] = r;
+    }
+  }
+
+  ret = lock_let(&(S_graph.lock));
+  assert(!ret);
+
+  /* Tasks and records do not change while the graph is run, so they can be
+   * read without the lock. */
+  for (k=0; k<npre; ++k) {
+    for (j=0; j<S_TASK(pre[k])->nr; ++j) {
+      if (S_TASK(pre[k])->data[j].mode&OOC_READ) {
+        page_prefetch(S_TASK(pre[k])->data[j].addr,\
+          S_TASK(pre[k])->data[j].len);
+      }
+    }
+  }
+
+  for (k=0; k<nev; ++k) {
+    flush_evict(S_REC(ev[k])->addr, S_REC(ev[k])->len);
+  }
+
+  (void)__sync_fetch_and_sub(&(S_graph.left), 1);
+}
+
+
+/*! Run task t, on a fiber. The task is only complete once its kernel returns,
+ *  which may be after ooc_sched() returns, if the kernel yields. */
+static void
+S_run(size_t const t, void * const args)
+{
+  size_t j;
+  struct S_task const * const task=S_TASK(t);
+
+  for (j=0; j<task->nr; ++j) {
+    ooc_access(task->data[j].addr, task->data[j].len, task->data[j].mode);
+  }
+
+  task->kern(task->i, task->args);
+
+  S_done(t);
+
+  if (args) {}
+}
+
+
+/*! Run ready tasks until the graph is complete. */
+static void
+S_worker(size_t const i, void * const args)
+{
+  int ret;
+  size_t t;
+
+  while (*(size_t volatile*)&(S_graph.left)) {
+    ret = lock_get(&(S_graph.lock));
+    assert(!ret);
+
+    t = S_graph.nready ? S_graph.ready[--S_graph.nready] : S_NONE;
+
+    ret = lock_let(&(S_graph.lock));
+    assert(!ret);
+
+    if (S_NONE == t) {
+      /* Nothing is ready until a running task completes, so resume the tasks
+       * which yielded, or let other threads run. */
+      if (!sched_poll()) {
+        (void)sched_yield();
+      }
+      continue;
+    }
+
+    ooc_sched(&S_run, t, NULL);
+  }
+
+  if (i || args) {}
+}
+
+
+int
+ooc_task(void (*kern)(size_t const, void * const), size_t const i,
+         void * const args, struct ooc_data const * const data,
+         size_t const nr)
+{
+  int ret, err=0;
+  size_t t, j, nedge=0, nrec=0;
+
+  if (nr > OOC_TASK_DATA) {
+    return -1;
+  }
+
+  ret = lock_get(&S_lock);
+  assert(!ret);
+
+  if (S_reserve(&(S_graph.task), 1, sizeof(struct S_task))) {
+    err = -1;
+  }
+  else {
+    t = S_graph.task.nr;
+    S_TASK(t)->kern  = kern;
+    S_TASK(t)->i     = i;
+    S_TASK(t)->args  = args;
+    S_TASK(t)->nr    = nr;
+    S_TASK(t)->npred = 0;
+    S_TASK(t)->succ  = S_NONE;
+    for (j=0; j<nr; ++j) {
+      S_TASK(t)->data[j] = data[j];
+    }
+
+    /* Make room for the edges and records first, so that the graph is not
+     * left half updated if that fails. */
+    for (j=0; j<nr; ++j) {
+      nedge += S_depend(t, j, 1, &nrec);
+    }
+    if (S_reserve(&(S_graph.edge), nedge, sizeof(struct S_edge)) ||
+        S_reserve(&(S_graph.rec), nrec, sizeof(struct S_rec)) ||
+        S_reserve(&(S_graph.index), nrec, sizeof(size_t)))
+    {
+      err = -1;
+    }
+    else {
+      S_graph.task.nr++;
+      for (j=0; j<nr; ++j) {
+        (void)S_depend(t, j, 0, NULL);
+      }
+    }
+  }
+
+  ret = lock_let(&S_lock);
+  assert(!ret);
+
+  return err;
+}
+
+
+int
+ooc_task_wait(void)
+{
+  int ret, err=0;
+  size_t t, n;
+  void * ready;
+
+  ret = lock_get(&S_lock);
+  assert(!ret);
+
+  n = S_graph.task.nr;
+
+  if (n) {
+    ready = mmap(NULL, n*sizeof(size_t), PROT_READ|PROT_WRITE,\
+      MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    if (MAP_FAILED == ready) {
+      err = -1;
+    }
+  }
+
+  if (n && !err) {
+    /* Seed the stack so that initially ready tasks run in submission
+     * order. */
+    S_graph.ready  = ready;
+    S_graph.nready = 0;
+    for (t=n; t>0; --t) {
+      if (!S_TASK(t-1)->npred) {
+        S_graph.ready[S_graph.nready++] = t-1;
+      }
+    }
+    S_graph.left = n;
+
+    err = ooc_parallel_for(&S_worker, 0, OOC_PARALLEL_MAX_THREADS, 1, NULL);
+    assert(!S_graph.left);
+
+    ret = munmap(ready, n*sizeof(size_t));
+    assert(!ret);
+    S_graph.ready = NULL;
+
+    S_release(&(S_graph.task));
+    S_release(&(S_graph.edge));
+    S_release(&(S_graph.rec));
+    S_release(&(S_graph.index));
+    S_graph.maxlen = 0;
+  }
+
+  ret = lock_let(&S_lock);
+  assert(!ret);
+
+  return err;
+}
+
+
+#ifdef TEST
+/* assert */
+#include <assert.h>
+
+/* EXIT_SUCCESS */
+#include <stdlib.h>
+
+#define N_TILES  32
+#define N_STEPS  8
+#define N_BUDGET 8
+
+/* Expected value of each tile, computed sequentially. */
+static unsigned long S_expect[N_TILES];
+
+static void
+S_tile_init(size_t const k, void * const args)
+{
+  *(unsigned long*)((char*)args+k*(size_t)OOC_PAGE_SIZE) = k;
+}
+
+static void
+S_tile_step(size_t const k, void * const args)
+{
+  size_t ps;
+  char * mem;
+
+  ps  = (size_t)OOC_PAGE_SIZE;
+  mem = (char*)args;
+
+  *(unsigned long*)(mem+k*ps) +=\
+    *(unsigned long*)(mem+(k+N_TILES-1)%N_TILES*ps);
+}
+
+static void
+S_tile_bump(size_t const k, void * const args)
+{
+  *(unsigned long*)((char*)args+k*(size_t)OOC_PAGE_SIZE) += 1;
+}
+
+static void
+S_tile_check(size_t const k, void * const args)
+{
+  assert(S_expect[k] == *(unsigned long*)((char*)args+k*(size_t)OOC_PAGE_SIZE));
+}
+
+int
+main(void)
+{
+  int ret;
+  size_t ps, s, k;
+  char * mem;
+  struct ooc_data data[OOC_TASK_DATA+1];
+  struct ooc_stats stats, before;
+
+  ps = (size_t)OOC_PAGE_SIZE;
+
+  mem = ooc_malloc(N_TILES*ps);
+  assert(mem);
+
+  ret = ooc_set_budget(N_BUDGET*ps);
+  assert(!ret);
+
+  /* Too many handles. */
+  ret = ooc_task(&S_tile_check, 0, mem, data, OOC_TASK_DATA+1);
+  assert(ret);
+
+  /* An empty graph. */
+  ret = ooc_task_wait();
+  assert(!ret);
+
+  ret = ooc_stats(&before);
+  assert(!ret);
+
+  /* Each step adds the previous tile to each tile, in place, so that the
+   * result depends on every read after write, write after read, and write
+   * after write being ordered as submitted. */
+  for (k=0; k<N_TILES; ++k) {
+    data[0].addr = mem+k*ps;
+    data[0].len  = ps;
+    data[0].mode = OOC_WRITE|OOC_DISCARD;
+    ret = ooc_task(&S_tile_init, k, mem, data, 1);
+    assert(!ret);
+
+    S_expect[k] = k;
+  }
+  for (s=0; s<N_STEPS; ++s) {
+    for (k=0; k<N_TILES; ++k) {
+      data[0].addr = mem+k*ps;
+      data[0].len  = ps;
+      data[0].mode = OOC_READ|OOC_WRITE;
+      data[1].addr = mem+(k+N_TILES-1)%N_TILES*ps;
+      data[1].len  = ps;
+      data[1].mode = OOC_READ;
+      ret = ooc_task(&S_tile_step, k, mem, data, 2);
+      assert(!ret);
+
+      S_expect[k] += S_expect[(k+N_TILES-1)%N_TILES];
+    }
+  }
+  ret = ooc_task_wait();
+  assert(!ret);
+
+  /* The tiles did not fit in the budget, so they were evicted, and read back
+   * ahead of the tasks which needed them. */
+  ret = ooc_stats(&stats);
+  assert(!ret);
+  assert(stats.evictions > before.evictions);
+  assert(stats.prefetches > before.prefetches);
+
+  /* A second graph, which reads the tiles as a whole, and then writes each
+   * tile, which must wait for the readers of the range which contains it. */
+  for (k=0; k<N_TILES; ++k) {
+    data[0].addr = mem;
+    data[0].len  = N_TILES*ps;
+    data[0].mode = OOC_READ;
+    ret = ooc_task(&S_tile_check, k, mem, data, 1);
+    assert(!ret);
+  }
+  for (k=0; k<N_TILES; ++k) {
+    data[0].addr = mem+k*ps;
+    data[0].len  = ps;
+    data[0].mode = OOC_READ|OOC_WRITE;
+    ret = ooc_task(&S_tile_bump, k, mem, data, 1);
+    assert(!ret);
+  }
+  ret = ooc_task_wait();
+  assert(!ret);
+
+  for (k=0; k<N_TILES; ++k) {
+    S_expect[k]++;
+    data[0].addr = mem+k*ps;
+    data[0].len  = ps;
+    data[0].mode = OOC_READ;
+    ret = ooc_task(&S_tile_check, k, mem, data, 1);
+    assert(!ret);
+  }
+  ret = ooc_task_wait();
+  assert(!ret);
+
+  ooc_free(mem);
+
+  ret = ooc_finalize();
+  assert(!ret);
+
+  return EXIT_SUCCESS;
+}
+#endif
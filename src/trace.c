@@ -0,0 +1,244 @@
+/*
+Copyright (c) 2016 Jeremy Iverson
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+
+/* assert */
+#include <assert.h>
+
+/* FILE, fopen, fwrite, fclose */
+#include <stdio.h>
+
+/* NULL */
+#include <stdlib.h>
+
+/* memcpy */
+#include <string.h>
+
+/* mmap, PROT_READ, PROT_WRITE, MAP_PRIVATE, MAP_ANONYMOUS, MAP_NORESERVE */
+#include <sys/mman.h>
+
+/* struct ooc_trace_*, function prototypes */
+#include "include/ooc.h"
+
+/* */
+#include "common.h"
+
+
+/*! A per-thread ring buffer of trace events. Only the owning thread writes to
+ *  its ring, so recording an event is a store and an increment, without any
+ *  atomic operations. head counts all events ever recorded, so the ring holds
+ *  the events [head-OOC_TRACE_SIZE,head), once it has wrapped. */
+struct trace_ring
+{
+  unsigned long long head;
+  unsigned int tid;
+  struct trace_ring * next;
+  struct ooc_trace_event ev[OOC_TRACE_SIZE];
+};
+
+
+/*! List of all rings, so that they can be dumped by any thread. Rings are only
+ *  ever pushed onto the list, so the list can be read without a lock. */
+static struct trace_ring * S_rings=NULL;
+
+/*! Number of rings which have been created. */
+static unsigned int S_nring=0;
+
+/*! The calling thread's ring. */
+static __thread struct trace_ring * S_ring=NULL;
+
+/*! The calling thread's current fiber. */
+static __thread unsigned int S_fiber=OOC_TRACE_MAIN;
+
+
+/*! Create the calling thread's ring. The ring is mapped, rather than
+ *  malloc()'d, since the first event may be recorded from within the SIGSEGV
+ *  handler, and its pages are only committed as they are written. */
+static struct trace_ring *
+S_ring_create(void)
+{
+  struct trace_ring * ring, * head;
+
+  ring = mmap(NULL, sizeof(struct trace_ring), PROT_READ|PROT_WRITE,\
+    MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+  if (MAP_FAILED == ring) {
+    return NULL;
+  }
+
+  ring->head = 0;
+  ring->tid  = __sync_fetch_and_add(&S_nring, 1);
+
+  do {
+    head = S_rings;
+    ring->next = head;
+  } while (!__sync_bool_compare_and_swap(&S_rings, head, ring));
+
+  return ring;
+}
+
+
+void
+trace_event(unsigned int const type, unsigned long long const arg)
+{
+  struct ooc_trace_event * ev;
+
+  if (NULL == S_ring && NULL == (S_ring=S_ring_create())) {
+    return;
+  }
+
+  ev = &(S_ring->ev[S_ring->head%OOC_TRACE_SIZE]);
+  ev->ts    = stats_clock();
+  ev->arg   = arg;
+  ev->type  = type;
+  ev->fiber = S_fiber;
+
+  if (OOC_TRACE_SWITCH == type) {
+    S_fiber = (unsigned int)arg;
+  }
+
+  /* Publish the event only after it has been written, for a concurrent dump. */
+  __sync_synchronize();
+  S_ring->head++;
+}
+
+
+int
+ooc_trace_dump(char const * const fname)
+{
+  int ret=0;
+  size_t beg, nr;
+  unsigned long long head;
+  FILE * fp;
+  struct trace_ring const * ring;
+  struct ooc_trace_head th;
+  struct ooc_trace_thread tt;
+
+  if (NULL == fname || NULL == (fp=fopen(fname, "wb"))) {
+    return -1;
+  }
+
+  memcpy(th.magic, OOC_TRACE_MAGIC, sizeof(th.magic));
+  th.version = OOC_TRACE_VERSION;
+  th.size    = (unsigned int)sizeof(struct ooc_trace_event);
+  if (1 != fwrite(&th, sizeof(th), 1, fp)) {
+    ret = -1;
+  }
+
+  /* Rings which are being written concurrently may yield torn events at the
+   * oldest end, so a dump is only exact once all threads are quiescent. */
+  for (ring=S_rings; !ret && NULL!=ring; ring=ring->next) {
+    head = ring->head;
+    if (head > OOC_TRACE_SIZE) {
+      beg = (size_t)(head%OOC_TRACE_SIZE);
+      nr  = OOC_TRACE_SIZE;
+    }
+    else {
+      beg = 0;
+      nr  = (size_t)head;
+    }
+
+    tt.tid = ring->tid;
+    tt.nr  = (unsigned int)nr;
+    if (1 != fwrite(&tt, sizeof(tt), 1, fp)) {
+      ret = -1;
+      break;
+    }
+
+    /* Oldest events are at [beg,OOC_TRACE_SIZE), newest at [0,beg). */
+    if (nr-beg != fwrite(ring->ev+beg, sizeof(*ring->ev), nr-beg, fp) ||\
+        beg != fwrite(ring->ev, sizeof(*ring->ev), beg, fp))
+    {
+      ret = -1;
+    }
+  }
+
+  if (fclose(fp)) {
+    ret = -1;
+  }
+
+  return ret;
+}
+
+
+#ifdef TEST
+/* assert */
+#include <assert.h>
+
+/* EXIT_SUCCESS */
+#include <stdlib.h>
+
+/* unlink */
+#include <unistd.h>
+
+int
+main(void)
+{
+  int ret;
+  size_t i;
+  char fname[]="/tmp/ooc-trace-XXXXXX";
+  FILE * fp;
+  struct ooc_trace_head th;
+  struct ooc_trace_thread tt;
+  struct ooc_trace_event ev;
+
+  ret = mkstemp(fname);
+  assert(-1 != ret);
+  ret = close(ret);
+  assert(!ret);
+
+  /* Wrap the ring, so that only the newest OOC_TRACE_SIZE events remain. */
+  trace_event(OOC_TRACE_SWITCH, 3);
+  for (i=1; i<OOC_TRACE_SIZE+10; ++i) {
+    trace_event(OOC_TRACE_EVICT, i);
+  }
+
+  ret = ooc_trace_dump(fname);
+  assert(!ret);
+
+  fp = fopen(fname, "rb");
+  assert(fp);
+  assert(1 == fread(&th, sizeof(th), 1, fp));
+  assert(!memcmp(th.magic, OOC_TRACE_MAGIC, sizeof(th.magic)));
+  assert(OOC_TRACE_VERSION == th.version);
+  assert(sizeof(struct ooc_trace_event) == th.size);
+  assert(1 == fread(&tt, sizeof(tt), 1, fp));
+  assert(0 == tt.tid);
+  assert(OOC_TRACE_SIZE == tt.nr);
+  for (i=0; i<tt.nr; ++i) {
+    assert(1 == fread(&ev, sizeof(ev), 1, fp));
+    assert(OOC_TRACE_EVICT == ev.type);
+    assert(10+i == ev.arg);
+    assert(3 == ev.fiber);
+  }
+  assert(0 == fread(&ev, sizeof(ev), 1, fp));
+  ret = fclose(fp);
+  assert(!ret);
+
+  ret = unlink(fname);
+  assert(!ret);
+
+  ret = ooc_trace_dump(NULL);
+  assert(-1 == ret);
+
+  return EXIT_SUCCESS;
+}
+#endif
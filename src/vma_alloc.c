@@ -89,6 +89,15 @@ THE SOFTWARE.
 /* uintptr_t */
 #include <stdint.h>
 
+/* pthread_key_create, pthread_once, pthread_setspecific */
+#include <pthread.h>
+
+/* clock_gettime, CLOCK_MONOTONIC */
+#include <time.h>
+
+/* OOC_LOCK_* */
+#include "include/ooc.h"
+
 /* */
 #include "common.h"
 
@@ -130,8 +139,11 @@ struct block
   size_t vctr, lctr;
   lock_t lock;
   struct vm_area * head;
+  struct vm_area * bump;
   struct superblock * superblock;
   struct mpool * mpool;
+  struct vm_area * rhead;
+  struct block * rnext;
   struct block * prev;
   struct block * next;
 };
@@ -143,6 +155,8 @@ struct superblock
   size_t bctr, lctr, blctr;
   lock_t lock;
   struct block * head;
+  struct block * bump;
+  unsigned long stamp;
   struct superblock * prev;
   struct superblock * next;
 };
@@ -153,27 +167,49 @@ struct superblock
 /******************************************************************************/
 
 
-/*! A per-thread initalization variable to specify whether or not their
- *  per-thread memory pool has been initialized. */
-static __thread int S_init = 0;
-
-
-/*! A per-thread instance of a memory pool. */
-static __thread struct mpool
+/*! A per-thread memory pool. When its thread exits, the pool is marked dead
+ *  and kept in S_gpool, rather than released, since its blocks may still hold
+ *  vmas which other threads free, until a new thread adopts it. */
+struct mpool
 {
   size_t lctr;
   lock_t lock;
   struct block * head;
-} S_mpool;
+  struct block * rhead;
+  int dead;
+  struct mpool * next;
+};
+
+
+/*! This thread's memory pool, NULL until it first allocates a vma. */
+static __thread struct mpool * S_mpool=NULL;
 
 
-/*! A per-process instance of a memory pool. */
+/*! Key whose destructor retires the memory pool of an exiting thread. */
+static pthread_key_t S_key;
+static pthread_once_t S_key_once=PTHREAD_ONCE_INIT;
+
+
+/*! A per-thread magazine of vmas, which satisfies allocations and frees by the
+ *  owning thread without touching any blocks. */
+static __thread struct
+{
+  size_t n;
+  struct vm_area * vma[OOC_VMA_MAGAZINE_SIZE];
+} S_magazine;
+
+
+/*! A per-process instance of a memory pool. Superblocks with no used blocks
+ *  are kept in a cache (most recently emptied first), instead of being
+ *  returned to the system immediately. */
 static struct
 {
-  size_t actr;
+  size_t actr, cctr;
   size_t lctr, mlctr, blctr, slctr;
   lock_t lock;
   struct superblock * head;
+  struct superblock * chead, * ctail;
+  struct mpool * mhead;
 } S_gpool;
 
 
@@ -203,82 +239,161 @@ S_vma_2block(struct vm_area * const vma)
 /******************************************************************************/
 
 
-/* TODO This is the step I would like to find a way to do lazily, i.e., as each
- * block/vma is requested. */
-/*! Setup a superblock's block list and each block's vma list. */
+/*! Setup a superblock's block list. Blocks, and each block's vmas, are not
+ *  threaded onto free lists up front. Instead, they are handed out in address
+ *  order by a bump pointer the first time that they are requested, and only
+ *  blocks/vmas which have been returned are kept on the free lists. Thus, the
+ *  memory of a superblock is not touched until it is actually used. */
 static void
 S_superblock_list_setup(struct superblock * const superblock)
+{
+  superblock->head = NULL;
+  superblock->bump = (struct block*)((char*)superblock+BLOCK_SIZE);
+}
+
+
+/*! Destroy a superblock's block list and each block's vma list. */
+static void
+S_superblock_list_destroy(struct superblock * const superblock)
 {
   int ret;
-  size_t i, j;
-  struct vm_area * vma;
-  struct block * block;
+  struct block * block, * end;
 
-  /* Setup superblock's block list. */
-  superblock->head = (struct block*)((char*)superblock+BLOCK_SIZE);
-  block = superblock->head;
-  block->prev = NULL;
-  for (i=0; i<SUPERBLOCK_CTR_FULL; ++i) {
-    block->vctr = 0;
-    block->lctr = 0;
-    block->superblock = superblock;
-    block->head = (struct vm_area*)((char*)block+sizeof(struct block));
-    if (SUPERBLOCK_CTR_FULL-1 == i) {
-      block->next = NULL;
-    }
-    else {
-      block->next = (struct block*)((char*)block+BLOCK_SIZE);
-      block->next->prev = block;
-    }
+  /* Only blocks below the bump pointer have been initialized. */
+  if (NULL == (end=superblock->bump)) {
+    end = (struct block*)((char*)superblock+SUPERBLOCK_SIZE);
+  }
 
-    /* Initialize block's lock. */
-    ret = lock_init(&(block->lock));
+  /* Destroy superblock's block list. */
+  for (block=(struct block*)((char*)superblock+BLOCK_SIZE); block<end;\
+       block=(struct block*)((char*)block+BLOCK_SIZE))
+  {
+    /* Destroy block's lock. */
+    ret = lock_free(&(block->lock));
     assert(!ret);
 
-    /* Setup block's vma list. */
-    vma = block->head;
-    for (j=0; j<BLOCK_CTR_FULL-1; ++j) {
-      vma->vm_next = vma+1;
+    /* Accumulate block wait counter. */
+    superblock->blctr += block->lctr;
+  }
+}
 
-      vma = vma->vm_next;
-    }
-    vma->vm_next = NULL;
 
-    block = block->next;
-  }
+/*! Check whether a superblock has any available blocks. */
+static int
+S_superblock_is_full(struct superblock const * const superblock)
+{
+  return NULL == superblock->head && NULL == superblock->bump;
 }
 
 
-/* TODO This is the step I would like to find a way to do lazily, i.e., as each
- * block/vma is requested. */
-/*! Destroy a superblock's block list and each block's vma list. */
+/*! Check whether a block has any available vmas. */
+static int
+S_block_is_full(struct block const * const block)
+{
+  return NULL == block->head && NULL == block->bump;
+}
+
+
+/*! Initialize a block the first time that it is handed out by its superblock's
+ *  bump pointer. */
 static void
-S_superblock_list_destroy(struct superblock * const superblock)
+S_block_setup(struct superblock * const superblock, struct block * const block)
 {
   int ret;
-  size_t i;
-  struct block * block;
 
-  /* Destroy superblock's block list. */
-  superblock->head = (struct block*)((char*)superblock+BLOCK_SIZE);
-  block = superblock->head;
-  for (i=0; i<SUPERBLOCK_CTR_FULL; ++i) {
-    block->head = (struct vm_area*)((char*)block+sizeof(struct block));
-    if (SUPERBLOCK_CTR_FULL-1 == i) {
-      block->next = NULL;
+  block->vctr = 0;
+  block->lctr = 0;
+  block->superblock = superblock;
+  block->head = NULL;
+  block->bump = (struct vm_area*)((char*)block+sizeof(struct block));
+  block->rhead = NULL;
+
+  /* Initialize block's lock. */
+  ret = lock_init(&(block->lock));
+  assert(!ret);
+  ret = lock_class(&(block->lock), OOC_LOCK_BLOCK);
+  assert(!ret);
+}
+
+
+/*! Get a monotonic time stamp in milliseconds. */
+static unsigned long
+S_stamp(void)
+{
+  struct timespec ts;
+
+  (void)clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return (unsigned long)ts.tv_sec*1000UL+(unsigned long)ts.tv_nsec/1000000UL;
+}
+
+
+/*! Remove superblocks from the tail (least recently emptied end) of S_gpool's
+ *  cache, while there are more than keep superblocks cached or, if age is not
+ *  0, while the tail has been cached for at least age milliseconds. The
+ *  removed superblocks are destroyed and returned as a list, so that they can
+ *  be released to the system after S_gpool is unlocked. S_gpool must be
+ *  locked. */
+static struct superblock *
+S_superblock_cache_evict(size_t const keep, unsigned long const age)
+{
+  int ret;
+  unsigned long now;
+  struct superblock * superblock, * list=NULL;
+
+  now = age ? S_stamp() : 0;
+
+  while (NULL != (superblock=S_gpool.ctail)) {
+    if (S_gpool.cctr <= keep && (!age || now-superblock->stamp < age)) {
+      break;
+    }
+
+    /* Remove superblock from tail of S_gpool's cache. */
+    S_gpool.ctail = superblock->prev;
+    if (NULL != S_gpool.ctail) {
+      S_gpool.ctail->next = NULL;
     }
     else {
-      block->next = (struct block*)((char*)block+BLOCK_SIZE);
+      S_gpool.chead = NULL;
     }
+    S_gpool.cctr--;
 
-    /* Destroy block's lock. */
-    ret = lock_free(&(block->lock));
+    /* Free superblock's lock. */
+    ret = lock_free(&(superblock->lock));
     assert(!ret);
 
-    /* Accumulate block wait counter. */
-    superblock->blctr += block->lctr;
+    /* Destroy superblock's block list. */
+    S_superblock_list_destroy(superblock);
 
-    block = block->next;
+    /* Accumulate superblock's block wait counter. */
+    S_gpool.blctr += superblock->blctr;
+    /* Accumulate superblock's wait counter. */
+    S_gpool.slctr += superblock->lctr;
+
+    superblock->next = list;
+    list = superblock;
+  }
+
+  return list;
+}
+
+
+/*! Release a list of superblocks, built by S_superblock_cache_evict(), back to
+ *  the system. */
+static void
+S_superblock_cache_release(struct superblock * list)
+{
+  int ret;
+  struct superblock * superblock;
+
+  while (NULL != (superblock=list)) {
+    list = superblock->next;
+
+    DBG_LOG(stderr, "releasing superblock %p\n", (void*)superblock);
+
+    /* Release back to system. */
+    ret = CALL_SYS_FREE(superblock, SUPERBLOCK_SIZE);
+    assert(SYS_FREE_FAIL != ret);
   }
 }
 
@@ -291,7 +406,23 @@ S_superblock_get_and_lock(void)
   void * retp;
   struct superblock * superblock;
 
-  if (NULL == (superblock=S_gpool.head)) {
+  if (NULL == (superblock=S_gpool.head) && NULL != (superblock=S_gpool.chead)) {
+    /* Remove superblock from front of S_gpool's cache. */
+    S_gpool.chead = superblock->next;
+    if (NULL != S_gpool.chead) {
+      S_gpool.chead->prev = NULL;
+    }
+    else {
+      S_gpool.ctail = NULL;
+    }
+    S_gpool.cctr--;
+
+    /* Prepend superblock to S_gpool's superblock list. */
+    S_gpool.head = superblock;
+    superblock->prev = NULL;
+    superblock->next = NULL;
+  }
+  else if (NULL == superblock) {
     /* Allocate new superblock. */
     retp = CALL_SYS_ALLOC(superblock, SUPERBLOCK_SIZE);
     if (SYS_ALLOC_FAIL == retp) {
@@ -312,6 +443,8 @@ S_superblock_get_and_lock(void)
     /* Initialize superblock's lock. */
     ret = lock_init(&(superblock->lock));
     assert(!ret);
+    ret = lock_class(&(superblock->lock), OOC_LOCK_SUPERBLOCK);
+    assert(!ret);
 
     /* Setup superblock's block list. */
     S_superblock_list_setup(superblock);
@@ -404,22 +537,35 @@ S_block_steal_and_lock(void)
   }
   /* superblock will be locked by superblock_get(). */
 
-  /* Get head of superblock's block list. */
-  block = superblock->head;
+  if (NULL != (block=superblock->head)) {
+    /* Lock block. */
+    LOCK_GET(&(block->lock), block->lctr);
 
-  /* Lock block. */
-  LOCK_GET(&(block->lock), block->lctr);
+    /* Remove block from front of superblock's block list. */
+    superblock->head = block->next;
+    if (NULL != block->next) {
+      block->next->prev = block->prev;
+    }
+  }
+  else {
+    /* Take never used block from superblock's bump pointer. */
+    block = superblock->bump;
+    superblock->bump = (struct block*)((char*)block+BLOCK_SIZE);
+    if ((char*)superblock->bump == (char*)superblock+SUPERBLOCK_SIZE) {
+      superblock->bump = NULL;
+    }
 
-  /* Remove block from front of superblock's block list. */
-  superblock->head = block->next;
-  if (NULL != block->next) {
-    block->next->prev = block->prev;
+    /* Setup block. */
+    S_block_setup(superblock, block);
+
+    /* Lock block. */
+    LOCK_GET(&(block->lock), block->lctr);
   }
 
   /* Increment superblock's block count. */
   superblock->bctr++;
 
-  if (NULL == superblock->head) {
+  if (S_superblock_is_full(superblock)) {
     /* Remove superblock from front of S_gpool's superblock list. */
     S_gpool.head = superblock->next;
     if (NULL != superblock->next) {
@@ -447,11 +593,15 @@ static void
 S_block_unlock_and_return(struct block * const block)
 {
   int ret;
-  struct superblock * superblock;
+  struct superblock * superblock, * list=NULL;
 
   /* Get superblock. */
   superblock = S_block_2superblock(block);
 
+  /* Lock S_gpool. This must be done before the superblock is locked, to
+   * respect the lock order of S_block_steal_and_lock(). */
+  LOCK_GET(&(S_gpool.lock), S_gpool.lctr);
+
   /* Lock superblock. */
   LOCK_GET(&(superblock->lock), superblock->lctr);
 
@@ -466,41 +616,67 @@ S_block_unlock_and_return(struct block * const block)
   superblock->bctr--;
 
   if (0 == superblock->bctr) {
-    /* Unlock superblock. */
-    LOCK_LET(&(superblock->lock));
+    /* Remove superblock from S_gpool's superblock list. */
+    if (S_gpool.head == superblock) {
+      S_gpool.head = superblock->next;
+    }
+    else {
+      superblock->prev->next = superblock->next;
+    }
+    if (NULL != superblock->next) {
+      superblock->next->prev = superblock->prev;
+    }
 
-    /* Unlock block. */
-    LOCK_LET(&(block->lock));
+    /* Prepend superblock to front of S_gpool's cache. */
+    superblock->stamp = S_stamp();
+    superblock->prev = NULL;
+    superblock->next = S_gpool.chead;
+    if (NULL != superblock->next) {
+      superblock->next->prev = superblock;
+    }
+    else {
+      S_gpool.ctail = superblock;
+    }
+    S_gpool.chead = superblock;
+    S_gpool.cctr++;
 
-    S_superblock_unlock_and_put(superblock);
-    /* S_superblock_unlock_and_put() will unlock superblock. */
+    /* Unlock superblock. */
+    LOCK_LET(&(superblock->lock));
 
+    /* Hysteresis -- once the cache grows beyond its high watermark, shrink it
+     * to its low watermark. */
+    if (S_gpool.cctr > OOC_VMA_CACHE_HIWAT) {
+      list = S_superblock_cache_evict(OOC_VMA_CACHE_LOWAT, 0);
+    }
   }
   else {
-    if (NULL == block->next) {
-      /* Lock S_gpool. */
-      LOCK_GET(&(S_gpool.lock), S_gpool.lctr);
-
+    if (NULL == block->next && NULL == superblock->bump) {
       /* Prepend superblock to front of S_gpool's superblock list. */
+      superblock->prev = NULL;
       superblock->next = S_gpool.head;
       if (NULL != superblock->next) {
         superblock->next->prev = superblock;
       }
       S_gpool.head = superblock;
 
-      /* Unlock S_gpool. */
-      LOCK_LET(&(S_gpool.lock));
-
       assert(SUPERBLOCK_CTR_FULL-1 == superblock->bctr);
     }
 
     /* Unlock superblock. */
     LOCK_LET(&(superblock->lock));
-
-    /* Unlock block. */
-    LOCK_LET(&(block->lock));
   }
 
+  /* Unlock block. This must be done before S_gpool is unlocked, since, once
+   * S_gpool is unlocked, block's superblock may be evicted from the cache by
+   * another thread. */
+  LOCK_LET(&(block->lock));
+
+  /* Unlock S_gpool. */
+  LOCK_LET(&(S_gpool.lock));
+
+  /* Release superblocks evicted from the cache back to system. */
+  S_superblock_cache_release(list);
+
   DBG_LOG(stderr, "returned block %p-%p\n", (void*)superblock,\
     (void*)((char*)superblock+SUPERBLOCK_SIZE));
 }
@@ -511,149 +687,432 @@ S_block_unlock_and_return(struct block * const block)
 /******************************************************************************/
 
 
-struct vm_area *
-vma_alloc(void)
+/*! Allocate up to nr vmas from S_mpool's blocks, stealing blocks from S_gpool
+ *  as necessary. Vmas are taken from each block in a batch, while the block is
+ *  locked. Returns the number of vmas allocated, which is less than nr only if
+ *  the system is out of memory. */
+static size_t
+S_mpool_alloc(struct vm_area ** const vma, size_t const nr)
 {
   int ret;
-  struct vm_area * vma;
+  size_t n=0;
   struct block * block;
 
-  if (0 == S_init) {
-    S_init = 1;
-    S_mpool.lctr = 0;
-    ret = lock_init(&(S_mpool.lock));
-    assert(!ret);
-    S_mpool.head = NULL;
-  }
+  while (n < nr) {
+    /* Check for cached block in S_mpool. S_mpool->head is only changed by the
+     * owning thread, but the block lock may be held by S_gpool, so it can only
+     * be tried here, since the lock order is block, then S_mpool. */
+    for (;;) {
+      /* Lock S_mpool. */
+      LOCK_GET(&(S_mpool->lock), S_mpool->lctr);
 
-  /* Check for cached block in S_mpool. */
-  if (NULL == (block=S_mpool.head)) {
-    block = S_block_steal_and_lock();
-    if (NULL == block) {
-      return NULL;
-    }
-    /* block will be locked by block_steal_and_lock(). */
+      if (NULL == (block=S_mpool->head) || !lock_try(&(block->lock))) {
+        break;
+      }
 
-    /* Lock S_mpool. */
-    LOCK_GET(&(S_mpool.lock), S_mpool.lctr);
+      /* Unlock S_mpool. */
+      LOCK_LET(&(S_mpool->lock));
 
-    /* Prepend block to S_mpool's block list. */
-    S_mpool.head = block;
-    block->prev = NULL;
-    block->next = NULL;
-    block->mpool = &S_mpool;
-  }
-  else {
-    /* Lock block. */
-    LOCK_GET(&(block->lock), block->lctr);
+      S_mpool->lctr++;
+    }
 
-    /* Lock mpool. */
-    LOCK_GET(&(S_mpool.lock), S_mpool.lctr);
-  }
+    if (NULL == block) {
+      /* Unlock S_mpool. */
+      LOCK_LET(&(S_mpool->lock));
 
-  /* Get head of block's vma list. */
-  vma = block->head;
+      block = S_block_steal_and_lock();
+      if (NULL == block) {
+        break;
+      }
+      /* block will be locked by block_steal_and_lock(). */
 
-  /* Remove vma from front of block's vma list. */
-  block->head = vma->vm_next;
+      /* Lock S_mpool. */
+      LOCK_GET(&(S_mpool->lock), S_mpool->lctr);
 
-  /* Increment block's vma count. */
-  block->vctr++;
+      /* Prepend block to S_mpool's block list. */
+      S_mpool->head = block;
+      block->prev = NULL;
+      block->next = NULL;
+      block->mpool = S_mpool;
+    }
+    /* Otherwise, block and S_mpool will be locked by the loop above. */
 
-  if (NULL == block->head) {
-    /* Remove block from front of mpool's block list. */
-    S_mpool.head = block->next;
-    if (NULL != block->next) {
-      block->next->prev = block->prev;
+    for (; n<nr && !S_block_is_full(block); ++n) {
+      if (NULL != (vma[n]=block->head)) {
+        /* Remove vma from front of block's vma list. */
+        block->head = vma[n]->vm_next;
+      }
+      else {
+        /* Take never used vma from block's bump pointer. */
+        vma[n] = block->bump;
+        block->bump = vma[n]+1;
+        if ((char*)(block->bump+1) > (char*)block+BLOCK_SIZE) {
+          block->bump = NULL;
+        }
+      }
+
+      /* Increment block's vma count. */
+      block->vctr++;
     }
 
-    assert(BLOCK_CTR_FULL == block->vctr);
-  }
+    if (S_block_is_full(block)) {
+      /* Remove block from front of mpool's block list. */
+      S_mpool->head = block->next;
+      if (NULL != block->next) {
+        block->next->prev = block->prev;
+      }
 
-  /* Unlock S_mpool. */
-  LOCK_LET(&(S_mpool.lock));
+      assert(BLOCK_CTR_FULL == block->vctr);
+    }
 
-  /* Unlock block. */
-  LOCK_LET(&(block->lock));
+    /* Unlock S_mpool. */
+    LOCK_LET(&(S_mpool->lock));
 
-  DBG_LOG(stderr, "allocated vma %p\n", (void*)vma);
+    /* Unlock block. */
+    LOCK_LET(&(block->lock));
+  }
 
-  return vma;
+  return n;
 }
 
 
-void
-vma_free(struct vm_area * const vma)
+/*! Free a list of nr vmas, from head to tail, which all belong to the same
+ *  block. The block's pool is S_mpool, or a dead pool, whose blocks any thread
+ *  may free to. */
+static void
+S_mpool_free(struct block * const block, struct vm_area * const head,
+             struct vm_area * const tail, size_t const nr)
 {
-  int ret;
-  struct block * block;
-
-  /* Get block. */
-  block = S_vma_2block(vma);
+  int ret, full;
+  struct mpool * const mpool=block->mpool;
 
   /* Lock block. */
   LOCK_GET(&(block->lock), block->lctr);
 
-  /* Prepend vma to front of block's vma list. */
-  vma->vm_next = block->head;
-  block->head = vma;
+  full = S_block_is_full(block);
+
+  /* Prepend vmas to front of block's vma list. */
+  tail->vm_next = block->head;
+  block->head = head;
 
   /* Decrement block's vma count. */
-  block->vctr--;
+  block->vctr -= nr;
 
   if (0 == block->vctr) {
-    /* Lock block's mpool. */
-    LOCK_GET(&(block->mpool->lock), block->mpool->lctr);
+    /* A full block is not in mpool's block list, but a batch can take it
+     * directly from full to empty. */
+    if (!full) {
+      /* Lock mpool. */
+      LOCK_GET(&(mpool->lock), mpool->lctr);
+
+      /* Remove block from mpool's block list. */
+      if (mpool->head == block) {
+        mpool->head = block->next;
+      }
+      else {
+        block->prev->next = block->next;
+      }
+      if (NULL != block->next) {
+        block->next->prev = block->prev;
+      }
 
-    /* Remove block from block's mpool's block list. */
-    if (block->mpool->head == block) {
-      block->mpool->head = block->next;
-    }
-    else {
-      block->prev->next = block->next;
-    }
-    if (NULL != block->next) {
-      block->next->prev = block->prev;
+      /* Unlock S_mpool. */
+      LOCK_LET(&(mpool->lock));
     }
 
-    /* Unlock block's mpool. */
-    LOCK_LET(&(block->mpool->lock));
-
     S_block_unlock_and_return(block);
     /* S_block_unlock_and_return() will unlock block. */
   }
   else {
-    if (NULL == vma->vm_next) {
-      /* Lock block's mpool. */
-      LOCK_GET(&(block->mpool->lock), block->mpool->lctr);
+    if (full) {
+      /* Lock mpool. */
+      LOCK_GET(&(mpool->lock), mpool->lctr);
 
-      /* Prepend block to front of block's mpool's block list. */
-      block->next = block->mpool->head;
+      /* Prepend block to front of mpool's block list. */
+      block->prev = NULL;
+      block->next = mpool->head;
       if (NULL != block->next) {
         block->next->prev = block;
       }
-      block->mpool->head = block;
+      mpool->head = block;
 
-      /* Unlock block's mpool. */
-      LOCK_LET(&(block->mpool->lock));
+      /* Unlock S_mpool. */
+      LOCK_LET(&(mpool->lock));
 
-      assert(BLOCK_CTR_FULL-1 == block->vctr);
+      assert(BLOCK_CTR_FULL-nr == block->vctr);
     }
 
     /* Unlock block. */
     LOCK_LET(&(block->lock));
   }
+}
+
+
+static void S_mpool_drain(struct mpool * const mpool, int const fill);
+
+
+/*! Free a vma which belongs to a block owned by another thread. The vma is
+ *  pushed onto the block's remote free list without taking any locks. The
+ *  first vma pushed onto an empty remote free list also pushes the block onto
+ *  its owner's list of blocks to drain. The vma remains counted as used by its
+ *  block, until the owner drains it, so that the block cannot be returned to
+ *  its superblock in the meantime. If the owner has exited, the vma is freed
+ *  to its block directly instead, as are those which were pushed while it was
+ *  exiting. */
+static void
+S_block_remote_free(struct block * const block, struct vm_area * const vma)
+{
+  struct vm_area * head;
+  struct block * bhead;
+  struct mpool * const mpool=block->mpool;
+
+  if (*(int volatile*)&(mpool->dead)) {
+    S_mpool_free(block, vma, vma, 1);
+    return;
+  }
+
+  do {
+    head = block->rhead;
+    vma->vm_next = head;
+  } while (!__sync_bool_compare_and_swap(&(block->rhead), head, vma));
+
+  if (NULL == head) {
+    do {
+      bhead = mpool->rhead;
+      block->rnext = bhead;
+    } while (!__sync_bool_compare_and_swap(&(mpool->rhead), bhead, block));
+  }
+
+  /* The owner may have exited after its last drain. */
+  __sync_synchronize();
+  if (*(int volatile*)&(mpool->dead)) {
+    S_mpool_drain(mpool, 0);
+  }
+}
+
+
+/*! Drain the remote free lists of all blocks owned by mpool, which is S_mpool,
+ *  or a dead pool. Drained vmas are put into S_magazine while there is room,
+ *  when fill is non-zero, and are otherwise freed to their blocks in a single
+ *  batch per block. */
+static void
+S_mpool_drain(struct mpool * const mpool, int const fill)
+{
+  size_t nr;
+  struct vm_area * vma, * head, * tail;
+  struct block * block, * next;
+
+  assert(!fill || S_mpool == mpool);
+
+  /* Only the owner, or any thread once the owner is dead, pops from mpool's
+   * list of blocks to drain, and it takes the whole list at once, so there is
+   * no ABA problem. */
+  block = __sync_lock_test_and_set(&(mpool->rhead), NULL);
+
+  for (; NULL != block; block=next) {
+    /* block may be pushed again, as soon as its remote free list is taken, so
+     * its link must be read first. */
+    next = block->rnext;
+    vma = __sync_lock_test_and_set(&(block->rhead), NULL);
+
+    for (; fill && NULL != vma && S_magazine.n < OOC_VMA_MAGAZINE_SIZE;\
+         vma=vma->vm_next)
+    {
+      S_magazine.vma[S_magazine.n++] = vma;
+    }
+
+    if (NULL != (head=vma)) {
+      for (nr=1, tail=head; NULL != tail->vm_next; ++nr, tail=tail->vm_next);
+      S_mpool_free(block, head, tail, nr);
+    }
+  }
+}
+
+
+/*! Free the nr most recently cached vmas in S_magazine to their blocks. */
+static void
+S_magazine_flush(size_t const nr)
+{
+  size_t i;
+  struct vm_area * vma;
+
+  assert(nr <= S_magazine.n);
+
+  for (i=0; i<nr; ++i) {
+    vma = S_magazine.vma[--S_magazine.n];
+    S_mpool_free(S_vma_2block(vma), vma, vma, 1);
+  }
+}
+
+
+/*! Retire the memory pool of an exiting thread. Its cached vmas, and those
+ *  freed to it by other threads, are returned to their blocks, and the pool is
+ *  marked dead, so that the vmas which remain in its blocks are freed to them
+ *  directly, until a new thread adopts it. */
+static void
+S_mpool_exit(void * const arg)
+{
+  int ret;
+  struct mpool * const mpool=(struct mpool*)arg;
+
+  assert(S_mpool == mpool);
+
+  S_mpool_drain(mpool, 0);
+  S_magazine_flush(S_magazine.n);
+
+  __sync_synchronize();
+  mpool->dead = 1;
+  __sync_synchronize();
+
+  /* Remote frees which raced with the drain above. */
+  S_mpool_drain(mpool, 0);
+
+  S_mpool = NULL;
+
+  /* Lock S_gpool. */
+  LOCK_GET(&(S_gpool.lock), S_gpool.lctr);
+
+  mpool->next = S_gpool.mhead;
+  S_gpool.mhead = mpool;
+
+  /* Unlock S_gpool. */
+  LOCK_LET(&(S_gpool.lock));
+}
+
+
+static void
+S_key_create(void)
+{
+  int ret;
+
+  ret = pthread_key_create(&S_key, &S_mpool_exit);
+  assert(!ret);
+}
+
+
+/*! Set up S_mpool, adopting the pool of a thread which has exited, if any. */
+static int
+S_mpool_init(void)
+{
+  int ret;
+  struct mpool * mpool;
+
+  ret = pthread_once(&S_key_once, &S_key_create);
+  assert(!ret);
+
+  /* Lock S_gpool. */
+  LOCK_GET(&(S_gpool.lock), S_gpool.lctr);
+
+  if (NULL != (mpool=S_gpool.mhead)) {
+    S_gpool.mhead = mpool->next;
+  }
+
+  /* Unlock S_gpool. */
+  LOCK_LET(&(S_gpool.lock));
+
+  if (NULL == mpool) {
+    if (SYS_ALLOC_FAIL == CALL_SYS_ALLOC(mpool, sizeof(struct mpool))) {
+      return -1;
+    }
+    mpool->lctr = 0;
+    ret = lock_init(&(mpool->lock));
+    assert(!ret);
+    ret = lock_class(&(mpool->lock), OOC_LOCK_MPOOL);
+    assert(!ret);
+    mpool->head = NULL;
+    mpool->rhead = NULL;
+  }
+
+  mpool->next = NULL;
+  __sync_synchronize();
+  mpool->dead = 0;
+  __sync_synchronize();
+
+  ret = pthread_setspecific(S_key, mpool);
+  assert(!ret);
+
+  S_mpool = mpool;
+  S_magazine.n = 0;
+
+  return 0;
+}
+
+
+struct vm_area *
+vma_alloc(void)
+{
+  struct vm_area * vma;
+
+  if (NULL == S_mpool && S_mpool_init()) {
+    return NULL;
+  }
+
+  if (0 == S_magazine.n) {
+    /* Refill S_magazine, preferring vmas freed by other threads. */
+    S_mpool_drain(S_mpool, 1);
+    if (S_magazine.n < OOC_VMA_MAGAZINE_SIZE/2) {
+      S_magazine.n += S_mpool_alloc(S_magazine.vma+S_magazine.n,\
+        OOC_VMA_MAGAZINE_SIZE/2-S_magazine.n);
+    }
+    if (0 == S_magazine.n) {
+      return NULL;
+    }
+  }
+
+  vma = S_magazine.vma[--S_magazine.n];
+
+  DBG_LOG(stderr, "allocated vma %p\n", (void*)vma);
+
+  return vma;
+}
+
+
+void
+vma_free(struct vm_area * const vma)
+{
+  struct block * block;
+
+  /* Get block. */
+  block = S_vma_2block(vma);
+
+  if (S_mpool != block->mpool) {
+    S_block_remote_free(block, vma);
+  }
+  else {
+    if (OOC_VMA_MAGAZINE_SIZE == S_magazine.n) {
+      /* Make room by flushing half of S_magazine, so that alternating
+       * allocations and frees do not thrash between S_magazine and blocks. */
+      S_magazine_flush(OOC_VMA_MAGAZINE_SIZE/2);
+    }
+    S_magazine.vma[S_magazine.n++] = vma;
+  }
 
   DBG_LOG(stderr, "freed vma %p\n", (void*)vma);
 }
 
 
+void
+vma_mpool_flush(void)
+{
+  if (NULL == S_mpool) {
+    return;
+  }
+
+  S_mpool_drain(S_mpool, 0);
+  S_magazine_flush(S_magazine.n);
+}
+
+
 void
 vma_gpool_init(void)
 {
   int ret;
 
   S_gpool.actr = 0;
+  S_gpool.cctr = 0;
+  S_gpool.chead = NULL;
+  S_gpool.ctail = NULL;
+  S_gpool.mhead = NULL;
   S_gpool.blctr = 0;
   S_gpool.slctr = 0;
   S_gpool.mlctr = 0;
@@ -661,6 +1120,8 @@ vma_gpool_init(void)
 
   ret = lock_init(&(S_gpool.lock));
   assert(!ret);
+  ret = lock_class(&(S_gpool.lock), OOC_LOCK_GPOOL);
+  assert(!ret);
 }
 
 
@@ -668,20 +1129,60 @@ void
 vma_gpool_free(void)
 {
   int ret;
+  struct superblock * superblock, * list;
+  struct mpool * mpool;
 
-  /* TODO Until superblock_* cache unused superblocks, this is unnecessary if we
-   * say that applications must free all memory they allocate. */
-#if 0
-  while (S_gpool.head) {
-    S_superblock_unlock_and_put(S_gpool.head);
+  /* Release all cached superblocks. */
+  LOCK_GET(&(S_gpool.lock), S_gpool.lctr);
+  list = S_superblock_cache_evict(0, 0);
+  LOCK_LET(&(S_gpool.lock));
+
+  S_superblock_cache_release(list);
+
+  /* Release superblocks which still have available blocks. Any vmas in these
+   * that have not been freed by the application are lost. */
+  while (NULL != (superblock=S_gpool.head)) {
+    LOCK_GET(&(superblock->lock), superblock->lctr);
+    S_superblock_unlock_and_put(superblock);
+  }
+
+  /* Release the pools of threads which have exited. */
+  while (NULL != (mpool=S_gpool.mhead)) {
+    S_gpool.mhead = mpool->next;
+    ret = lock_free(&(mpool->lock));
+    assert(!ret);
+    ret = CALL_SYS_FREE(mpool, sizeof(struct mpool));
+    assert(SYS_FREE_FAIL != ret);
   }
-#endif
 
   ret = lock_free(&(S_gpool.lock));
   assert(!ret);
 }
 
 
+void
+vma_gpool_trim(void)
+{
+  int ret;
+  struct superblock * list;
+
+  if (!OOC_VMA_CACHE_TIMEOUT || NULL == S_gpool.ctail) {
+    return;
+  }
+
+  /* Lock S_gpool. */
+  LOCK_GET(&(S_gpool.lock), S_gpool.lctr);
+
+  /* Evict only by age, regardless of the number of cached superblocks. */
+  list = S_superblock_cache_evict((size_t)-1, OOC_VMA_CACHE_TIMEOUT);
+
+  /* Unlock S_gpool. */
+  LOCK_LET(&(S_gpool.lock));
+
+  S_superblock_cache_release(list);
+}
+
+
 void
 vma_gpool_gather(void)
 {
@@ -691,7 +1192,9 @@ vma_gpool_gather(void)
   LOCK_GET(&(S_gpool.lock), S_gpool.lctr);
 
   /* Accumulate threads's S_mpool wait counter. */
-  S_gpool.mlctr += S_mpool.lctr;
+  if (NULL != S_mpool) {
+    S_gpool.mlctr += S_mpool->lctr;
+  }
 
   /* Unlock S_gpool. */
   LOCK_LET(&(S_gpool.lock));
@@ -708,6 +1211,8 @@ vma_gpool_show(void)
   printf("  global pool: %lu\n", (long unsigned)S_gpool.lctr);
   printf("Number of system allocations...\n");
   printf("               %lu\n", (long unsigned)S_gpool.actr);
+  printf("Number of cached superblocks...\n");
+  printf("               %lu\n", (long unsigned)S_gpool.cctr);
 }
 
 
@@ -723,10 +1228,17 @@ vma_gpool_show(void)
 /* malloc, free, EXIT_SUCCESS */
 #include <stdlib.h>
 
+/* omp_get_thread_num, omp_get_num_threads */
+#include <omp.h>
+
 
 #define N_ALLOC  (1<<22)
 #define N_THREAD 5
 
+/* Number of used vmas in the block of the last vma of a magazine refill, which
+ * may span several blocks. */
+#define MAGAZINE_VCTR (((OOC_VMA_MAGAZINE_SIZE/2-1)%BLOCK_CTR_FULL)+1)
+
 int null_ctr=0;
 
 
@@ -742,6 +1254,11 @@ void block_4(void);
 void block_5(void);
 void block_6(void);
 void block_7(void);
+void cache_1(void);
+void cache_2(void);
+void magazine_1(void);
+void exit_1(void);
+void remote_1(void);
 
 
 /*! This will test the functionality of S_superblock_get_and_lock() when S_gpool's
@@ -762,11 +1279,26 @@ void superblock_1(void)
   assert(superblock == S_gpool.head);
   assert(NULL == superblock->prev);
   assert(NULL == superblock->next);
-  for (ictr=0,block=superblock->head; block; block=block->next,++ictr) {
+  assert(NULL == superblock->head);
+  assert((char*)superblock+BLOCK_SIZE == (char*)superblock->bump);
+  for (ictr=0; !S_superblock_is_full(superblock); ++ictr) {
     assert(ictr < SUPERBLOCK_CTR_FULL);
 
-    for (jctr=0,vma=block->head; vma; vma=vma->vm_next,++jctr) {
+    block = superblock->bump;
+    superblock->bump = (struct block*)((char*)block+BLOCK_SIZE);
+    if ((char*)superblock->bump == (char*)superblock+SUPERBLOCK_SIZE) {
+      superblock->bump = NULL;
+    }
+    S_block_setup(superblock, block);
+
+    for (jctr=0; !S_block_is_full(block); ++jctr) {
       assert(jctr < BLOCK_CTR_FULL);
+
+      vma = block->bump;
+      block->bump = vma+1;
+      if ((char*)(block->bump+1) > (char*)block+BLOCK_SIZE) {
+        block->bump = NULL;
+      }
     }
     assert(jctr == BLOCK_CTR_FULL);
   }
@@ -776,6 +1308,7 @@ void superblock_1(void)
   LOCK_LET(&(superblock->lock));
   ret = lock_free(&(superblock->lock));
   assert(!ret);
+  S_superblock_list_destroy(superblock);
   ret = CALL_SYS_FREE(superblock, SUPERBLOCK_SIZE);
   assert(SYS_FREE_FAIL != ret);
   S_gpool.head = NULL;
@@ -795,6 +1328,7 @@ void superblock_2(void)
   assert(SYS_ALLOC_FAIL != retp);
   ret = lock_init(&(superblock->lock));
   assert(!ret);
+  S_superblock_list_setup(superblock);
   superblock->prev = NULL;
   superblock->next = NULL;
   S_gpool.head = superblock;
@@ -825,8 +1359,10 @@ void superblock_3(void)
   assert(SYS_ALLOC_FAIL != retp);
   ret = lock_init(&(superblock1->lock));
   assert(!ret);
+  S_superblock_list_setup(superblock1);
   ret = lock_init(&(superblock2->lock));
   assert(!ret);
+  S_superblock_list_setup(superblock2);
   superblock1->prev = superblock2;
   superblock1->next = NULL;
   superblock2->prev = NULL;
@@ -864,8 +1400,10 @@ void superblock_4(void)
   assert(SYS_ALLOC_FAIL != retp);
   ret = lock_init(&(superblock1->lock));
   assert(!ret);
+  S_superblock_list_setup(superblock1);
   ret = lock_init(&(superblock2->lock));
   assert(!ret);
+  S_superblock_list_setup(superblock2);
   superblock1->prev = superblock2;
   superblock1->next = NULL;
   superblock2->prev = NULL;
@@ -905,10 +1443,13 @@ void superblock_5(void)
   assert(SYS_ALLOC_FAIL != retp);
   ret = lock_init(&(superblock1->lock));
   assert(!ret);
+  S_superblock_list_setup(superblock1);
   ret = lock_init(&(superblock2->lock));
   assert(!ret);
+  S_superblock_list_setup(superblock2);
   ret = lock_init(&(superblock3->lock));
   assert(!ret);
+  S_superblock_list_setup(superblock3);
   superblock1->prev = superblock2;
   superblock1->next = NULL;
   superblock2->prev = superblock3;
@@ -952,8 +1493,8 @@ void block_1(void)
   assert(block);
   superblock = S_block_2superblock(block);
   assert(superblock == S_gpool.head);
-  assert(block != superblock->head);
-  assert(block->next == superblock->head);
+  assert(NULL == superblock->head);
+  assert((char*)block+BLOCK_SIZE == (char*)superblock->bump);
 
   /* ---- CLEANUP ---- */
   LOCK_LET(&(block->lock));
@@ -979,7 +1520,8 @@ void block_2(void)
   /* ---- SETUP ---- */
   superblock = S_superblock_get_and_lock();
   superblock->bctr = SUPERBLOCK_CTR_FULL-1; /* fake the next block as the last. */
-  superblock->head->next = NULL;            /* ... */
+  superblock->bump = (struct block*)        /* ... */\
+    ((char*)superblock+SUPERBLOCK_SIZE-BLOCK_SIZE);
   LOCK_LET(&(superblock->lock));
 
   /* ---- UNIT ---- */
@@ -990,9 +1532,8 @@ void block_2(void)
   assert(superblock == S_block_2superblock(block));
   assert(superblock != S_gpool.head);
   assert(superblock->next == S_gpool.head);
-  assert(block != superblock->head);
   assert(NULL == superblock->head);
-  assert(NULL == block->next);
+  assert(NULL == superblock->bump);
 
   /* ---- CLEANUP ---- */
   S_gpool.head = superblock;
@@ -1017,7 +1558,8 @@ void block_3(void)
   superblock2->next = superblock1;
   superblock1->prev = superblock2;
   superblock2->bctr = SUPERBLOCK_CTR_FULL-1; /* fake the next block as the last. */
-  superblock2->head->next = NULL;            /* ... */
+  superblock2->bump = (struct block*)        /* ... */\
+    ((char*)superblock2+SUPERBLOCK_SIZE-BLOCK_SIZE);
   LOCK_LET(&(superblock2->lock));
 
   /* ---- UNIT ---- */
@@ -1030,9 +1572,8 @@ void block_3(void)
   assert(superblock1 == S_gpool.head);
   assert(NULL == superblock1->prev);
   assert(NULL == superblock1->next);
-  assert(block != superblock2->head);
   assert(NULL == superblock2->head);
-  assert(NULL == block->next);
+  assert(NULL == superblock2->bump);
 
   /* ---- CLEANUP ---- */
   S_gpool.head = superblock2;
@@ -1057,8 +1598,10 @@ void block_4(void)
 
   /* ---- ASSERTIONS ---- */
   assert(NULL == S_gpool.head);
+  assert(1 == S_gpool.cctr);
 
   /* ---- CLEANUP ---- */
+  S_superblock_cache_release(S_superblock_cache_evict(0, 0));
 }
 
 
@@ -1105,6 +1648,7 @@ void block_6(void)
   S_gpool.head = NULL;
   superblock->bctr = SUPERBLOCK_CTR_FULL; /* fake a full superblock. */
   superblock->head = NULL;                /* ... */
+  superblock->bump = NULL;                /* ... */
 
   /* ---- UNIT ---- */
   S_block_unlock_and_return(block);
@@ -1137,6 +1681,7 @@ void block_7(void)
   superblock1 = S_block_2superblock(block);
   superblock1->bctr = SUPERBLOCK_CTR_FULL; /* fake a full superblock. */
   superblock1->head = NULL;                /* ... */
+  superblock1->bump = NULL;                /* ... */
   S_gpool.head = NULL;
   superblock2 = S_superblock_get_and_lock();
   LOCK_LET(&(superblock2->lock));
@@ -1160,6 +1705,255 @@ void block_7(void)
 }
 
 
+/*! This will test the functionality of S_block_unlock_and_return() when the
+ *  superblock becomes empty and is cached, and S_superblock_get_and_lock()
+ *  when it reuses the cached superblock. */
+void cache_1(void)
+{
+  size_t actr;
+  struct block * block;
+  struct superblock * superblock, * list;
+
+  /* ---- SETUP ---- */
+  block = S_block_steal_and_lock();
+  assert(block);
+  superblock = S_block_2superblock(block);
+  actr = S_gpool.actr;
+
+  /* ---- UNIT ---- */
+  S_block_unlock_and_return(block);
+
+  /* ---- ASSERTIONS ---- */
+  assert(NULL == S_gpool.head);
+  assert(1 == S_gpool.cctr);
+  assert(superblock == S_gpool.chead);
+  assert(superblock == S_gpool.ctail);
+
+  /* ---- UNIT ---- */
+  block = S_block_steal_and_lock();
+
+  /* ---- ASSERTIONS ---- */
+  assert(block);
+  assert(superblock == S_block_2superblock(block));
+  assert(actr == S_gpool.actr);
+  assert(0 == S_gpool.cctr);
+  assert(NULL == S_gpool.chead);
+  assert(NULL == S_gpool.ctail);
+
+  /* ---- CLEANUP ---- */
+  S_block_unlock_and_return(block);
+  list = S_superblock_cache_evict(0, 0);
+  assert(superblock == list);
+  assert(NULL == list->next);
+  S_superblock_cache_release(list);
+  assert(0 == S_gpool.cctr);
+}
+
+
+/*! This will test the functionality of vma_gpool_trim() when the cache holds
+ *  one superblock which has expired and one which has not. */
+void cache_2(void)
+{
+  struct block * block1, * block2;
+  struct superblock * superblock1, * superblock2;
+
+  /* ---- SETUP ---- */
+  block1 = S_block_steal_and_lock();
+  assert(block1);
+  superblock1 = S_block_2superblock(block1);
+  S_gpool.head = NULL;                  /* force a second superblock. */
+  block2 = S_block_steal_and_lock();
+  assert(block2);
+  superblock2 = S_block_2superblock(block2);
+  assert(superblock1 != superblock2);
+  superblock1->prev = NULL;             /* restore first superblock. */
+  superblock1->next = superblock2;      /* ... */
+  superblock2->prev = superblock1;      /* ... */
+  S_gpool.head = superblock1;           /* ... */
+  S_block_unlock_and_return(block1);
+  S_block_unlock_and_return(block2);
+  assert(2 == S_gpool.cctr);
+  assert(superblock2 == S_gpool.chead);
+  assert(superblock1 == S_gpool.ctail);
+  superblock1->stamp -= OOC_VMA_CACHE_TIMEOUT; /* fake an expired superblock. */
+
+  /* ---- UNIT ---- */
+  vma_gpool_trim();
+
+  /* ---- ASSERTIONS ---- */
+  assert(1 == S_gpool.cctr);
+  assert(superblock2 == S_gpool.chead);
+  assert(superblock2 == S_gpool.ctail);
+  assert(NULL == superblock2->prev);
+  assert(NULL == superblock2->next);
+
+  /* ---- CLEANUP ---- */
+  S_superblock_cache_release(S_superblock_cache_evict(0, 0));
+}
+
+
+/*! This will test the functionality of vma_alloc() and vma_free() when the
+ *  vmas are cached in S_magazine, and vma_mpool_flush() when the magazine is
+ *  returned to its block. */
+void magazine_1(void)
+{
+  struct vm_area * vma;
+  struct block * block;
+
+  /* ---- UNIT ---- */
+  vma = vma_alloc();
+
+  /* ---- ASSERTIONS ---- */
+  assert(vma);
+  block = S_vma_2block(vma);
+  assert(S_mpool == block->mpool);
+  assert(OOC_VMA_MAGAZINE_SIZE/2-1 == S_magazine.n);
+  assert(MAGAZINE_VCTR == block->vctr);
+
+  /* ---- UNIT ---- */
+  vma_free(vma);
+
+  /* ---- ASSERTIONS ---- */
+  assert(OOC_VMA_MAGAZINE_SIZE/2 == S_magazine.n);
+  assert(vma == S_magazine.vma[S_magazine.n-1]);
+  assert(MAGAZINE_VCTR == block->vctr);
+
+  /* ---- UNIT ---- */
+  vma_mpool_flush();
+
+  /* ---- ASSERTIONS ---- */
+  assert(0 == S_magazine.n);
+  assert(NULL == S_mpool->head);
+  assert(NULL == S_gpool.head);
+  assert(1 == S_gpool.cctr);
+
+  /* ---- CLEANUP ---- */
+  S_superblock_cache_release(S_superblock_cache_evict(0, 0));
+}
+
+
+/*! This will test the functionality of vma_free() when the vma is freed by a
+ *  thread other than the one which owns its block, and vma_mpool_flush() when
+ *  the owner drains its remote free list. */
+void remote_1(void)
+{
+  struct vm_area * vma=NULL;
+  struct block * block=NULL;
+
+  #pragma omp parallel num_threads(2)
+  {
+    assert(2 == omp_get_num_threads());
+
+    /* ---- SETUP ---- */
+    if (0 == omp_get_thread_num()) {
+      vma = vma_alloc();
+      assert(vma);
+      block = S_vma_2block(vma);
+    }
+    #pragma omp barrier
+
+    /* ---- UNIT ---- */
+    if (1 == omp_get_thread_num()) {
+      vma_free(vma);
+      assert(0 == S_magazine.n);
+    }
+    #pragma omp barrier
+
+    if (0 == omp_get_thread_num()) {
+      /* ---- ASSERTIONS ---- */
+      assert(vma == block->rhead);
+      assert(NULL == vma->vm_next);
+      assert(block == S_mpool->rhead);
+      assert(NULL == block->rnext);
+      assert(MAGAZINE_VCTR == block->vctr);
+
+      /* ---- UNIT ---- */
+      vma_mpool_flush();
+
+      /* ---- ASSERTIONS ---- */
+      assert(NULL == block->rhead);
+      assert(NULL == S_mpool->rhead);
+      assert(0 == S_magazine.n);
+      assert(1 == S_gpool.cctr);
+
+      /* ---- CLEANUP ---- */
+      S_superblock_cache_release(S_superblock_cache_evict(0, 0));
+    }
+  }
+}
+
+
+/* Allocate vmas, free the first half of them, and exit. */
+static void *
+S_exit_thread(void * const arg)
+{
+  int i;
+  struct vm_area ** vma=(struct vm_area**)arg;
+
+  for (i=0; i<OOC_VMA_MAGAZINE_SIZE; ++i) {
+    vma[i] = vma_alloc();
+    assert(vma[i]);
+  }
+  for (i=0; i<OOC_VMA_MAGAZINE_SIZE/2; ++i) {
+    vma_free(vma[i]);
+  }
+
+  return S_mpool;
+}
+
+
+/*! This will test that the pool of an exiting thread is retired, i.e., that
+ *  its magazine is returned to its blocks, that vmas freed to it afterwards go
+ *  to their blocks directly, and that the next thread adopts it. */
+void exit_1(void)
+{
+  int i, ret;
+  void * mpool, * again;
+  pthread_t thread;
+  struct vm_area * vma[OOC_VMA_MAGAZINE_SIZE];
+
+  /* ---- UNIT ---- */
+  ret = pthread_create(&thread, NULL, &S_exit_thread, vma);
+  assert(!ret);
+  ret = pthread_join(thread, &mpool);
+  assert(!ret);
+
+  /* ---- ASSERTIONS ---- */
+  assert(mpool);
+  assert(((struct mpool*)mpool)->dead);
+  assert(mpool == S_gpool.mhead);
+  assert(NULL == ((struct mpool*)mpool)->rhead);
+
+  /* ---- UNIT ---- */
+  for (i=OOC_VMA_MAGAZINE_SIZE/2; i<OOC_VMA_MAGAZINE_SIZE; ++i) {
+    vma_free(vma[i]);
+  }
+
+  /* ---- ASSERTIONS ---- */
+  assert(NULL == ((struct mpool*)mpool)->rhead);
+  assert(NULL == ((struct mpool*)mpool)->head);
+  assert(NULL == S_gpool.head);
+
+  /* ---- UNIT ---- */
+  ret = pthread_create(&thread, NULL, &S_exit_thread, vma);
+  assert(!ret);
+  ret = pthread_join(thread, &again);
+  assert(!ret);
+  for (i=OOC_VMA_MAGAZINE_SIZE/2; i<OOC_VMA_MAGAZINE_SIZE; ++i) {
+    vma_free(vma[i]);
+  }
+
+  /* ---- ASSERTIONS ---- */
+  assert(mpool == again);
+  assert(mpool == S_gpool.mhead);
+  assert(NULL == ((struct mpool*)mpool)->next);
+  assert(NULL == S_gpool.head);
+
+  /* ---- CLEANUP ---- */
+  S_superblock_cache_release(S_superblock_cache_evict(0, 0));
+}
+
+
 int
 main(void)
 {
@@ -1182,6 +1976,13 @@ main(void)
   block_6();
   block_7();
 
+  cache_1();
+  cache_2();
+
+  magazine_1();
+  remote_1();
+  exit_1();
+
   vma = malloc(N_ALLOC*sizeof(struct vm_area*));
   assert(vma);
 
@@ -1209,6 +2010,12 @@ main(void)
 
   free(vma);
 
+  #pragma omp parallel num_threads(N_THREAD)
+  vma_mpool_flush();
+
+  /* Every vma has been freed, so every superblock should be empty. */
+  assert(NULL == S_gpool.head);
+
   vma_gpool_free();
 
 #ifdef SHOW